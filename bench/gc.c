@@ -0,0 +1,225 @@
+// GC marking benchmark: builds heap graphs of instances and classes and
+// times the mark phase of a major collection for each number of marker
+// threads (1, 2, 4 and 8 unless given), reporting the speedup over one.
+//
+//     $ make bench && ./build/gc-bench [threads...]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/dict.h"
+#include "../src/gc.h"
+#include "../src/loxobj.h"
+
+#define TREE_FANOUT 8
+#define TREE_DEPTH 6
+#define NLISTS 64
+#define LIST_LENGTH 8192
+#define NCLASSES 16384
+#define NMETHODS 16
+#define NFIELDS 4
+#define RUNS 5
+#define MAX_THREADS 16
+
+static void build_tree();
+static LoxObj *new_tree(unsigned depth);
+static void build_lists();
+static void build_classes();
+static void mark_graph();
+static double measure();
+static unsigned next_random();
+static char *field_name(unsigned i);
+
+static LoxObj *KLASS = NULL;
+static LoxObj *GRAPH[NLISTS];
+static unsigned NGRAPH = 0;
+static unsigned long long SEED = 88172645463325252ull;
+
+static const struct {
+    const char *name;
+    void (*build)();
+} GRAPHS[] = {
+    { "wide tree", build_tree },
+    { "linked lists", build_lists },
+    { "class graph", build_classes },
+};
+
+
+int main(int argc, char *argv[])
+{
+    unsigned i, j, n, threads[MAX_THREADS];
+    size_t objects;
+    double base, elapsed;
+
+    n = 0;
+    for (i = 1; i < (unsigned) argc && n < MAX_THREADS; i++)
+        if ((threads[n++] = atoi(argv[i])) == 0) {
+            fprintf(stderr, "Usage: gc-bench [threads...]\n");
+            return 1;
+        }
+    if (n == 0)
+        for (n = 0; n < 4; n++)
+            threads[n] = 1u << n;
+
+    gc_register_roots(mark_graph, NULL);
+
+    for (i = 0; i < sizeof(GRAPHS) / sizeof(GRAPHS[0]); i++) {
+        objects = gc_stats()->objects_allocated;
+        GRAPHS[i].build();
+        objects = gc_stats()->objects_allocated - objects;
+        printf("%s: %zu objects\n", GRAPHS[i].name, objects);
+
+        base = 0;
+        for (j = 0; j < n; j++) {
+            gc_set_threads(threads[j]);
+            elapsed = measure();
+            if (j == 0)
+                base = elapsed;
+            printf("  %2u threads: %8.3f ms  %.2fx\n", threads[j], elapsed * 1e3, base / elapsed);
+        }
+
+        NGRAPH = 0;
+        KLASS = NULL;
+        gc_collect();
+    }
+
+    gc_free_all();
+
+    return 0;
+}
+
+
+// Best mark time out of a few major collections.
+static double measure()
+{
+    unsigned run;
+    double best, elapsed;
+
+    best = 0;
+    for (run = 0; run < RUNS; run++) {
+        elapsed = gc_stats()->mark_time;
+        gc_collect();
+        elapsed = gc_stats()->mark_time - elapsed;
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+
+// Every node has TREE_FANOUT children in its fields.
+static void build_tree()
+{
+    KLASS = new_class_obj("Node", NULL, Dict_New());
+    GRAPH[NGRAPH++] = new_tree(TREE_DEPTH);
+}
+
+
+static LoxObj *new_tree(unsigned depth)
+{
+    unsigned i;
+    LoxObj *node;
+
+    node = new_instance_obj(KLASS);
+    if (depth == 0)
+        return node;
+
+    GC_PUSH(node);
+    for (i = 0; i < TREE_FANOUT; i++)
+        instance_set(node, field_name(i), OBJ_VAL(new_tree(depth - 1)));
+    GC_POP(1);
+
+    return node;
+}
+
+
+static void build_lists()
+{
+    unsigned i, j;
+    LoxObj *node;
+
+    KLASS = new_class_obj("Link", NULL, Dict_New());
+
+    for (i = 0; i < NLISTS; i++) {
+        GRAPH[NGRAPH++] = NULL;
+        for (j = 0; j < LIST_LENGTH; j++) {
+            node = new_instance_obj(KLASS);
+            instance_set(node, Dict_Intern("next"), GRAPH[i] ? OBJ_VAL(GRAPH[i]) : NIL_VAL);
+            GRAPH[i] = node;
+        }
+    }
+}
+
+
+// Classes are registered in the method table of a module class, like
+// globals in an environment. Each has a random superclass and methods bound
+// to instances whose fields point to random classes.
+static void build_classes()
+{
+    unsigned i, j, k;
+    char name[32];
+    LoxObj *module, **classes, *klass, *receiver, *method, *native;
+
+    module = new_class_obj("module", NULL, Dict_New());
+    GRAPH[NGRAPH++] = module;
+
+    native = new_callable_obj(0, NULL);
+    Dict_Set(module->klass.methods, "native", OBJ_VAL(native));
+
+    classes = (LoxObj **) malloc(NCLASSES * sizeof(LoxObj *));
+
+    for (i = 0; i < NCLASSES; i++) {
+        snprintf(name, sizeof(name), "Class%u", i);
+        klass = new_class_obj(Dict_Intern(name), i > 0 ? classes[next_random() % i] : NULL, Dict_New());
+        Dict_Set(module->klass.methods, Dict_Intern(name), OBJ_VAL(klass));
+        GC_BARRIER(module);
+        classes[i] = klass;
+
+        for (j = 0; j < NMETHODS; j++) {
+            receiver = new_instance_obj(classes[next_random() % (i + 1)]);
+            for (k = 0; k < NFIELDS; k++)
+                instance_set(receiver, field_name(k), OBJ_VAL(classes[next_random() % (i + 1)]));
+
+            GC_PUSH(receiver);
+            method = new_method_obj(receiver, native);
+            GC_POP(1);
+
+            snprintf(name, sizeof(name), "method%u", j);
+            Dict_Set(klass->klass.methods, Dict_Intern(name), OBJ_VAL(method));
+            GC_BARRIER(klass);
+        }
+    }
+
+    free(classes);
+}
+
+
+static void mark_graph()
+{
+    unsigned i;
+
+    gc_mark((GCObj *) KLASS);
+    for (i = 0; i < NGRAPH; i++)
+        gc_mark((GCObj *) GRAPH[i]);
+}
+
+
+// xorshift64
+static unsigned next_random()
+{
+    SEED ^= SEED << 13;
+    SEED ^= SEED >> 7;
+    SEED ^= SEED << 17;
+
+    return (unsigned) SEED;
+}
+
+
+static char *field_name(unsigned i)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "f%u", i);
+    return Dict_Intern(name);
+}
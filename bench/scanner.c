@@ -0,0 +1,151 @@
+// Scanner throughput benchmark: scans a script (or a generated one if no
+// path is given) over and over for about a second and reports MB/s.
+//
+//     $ make bench && ./build/scanner-bench [path]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/scanner.h"
+
+#define GENERATED_SIZE (4 * 1024 * 1024)
+#define MIN_SECONDS 1.0
+
+static char *read_file(const char *path, size_t *size);
+static char *generate(size_t *size);
+static double now();
+
+
+int main(int argc, char *argv[])
+{
+    size_t size, ntokens, bytes;
+    unsigned runs;
+    double start, elapsed;
+    char *source;
+    Token *tokens;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: scanner-bench [path]\n");
+        return 1;
+    }
+
+    if (argc == 2) {
+        if ((source = read_file(argv[1], &size)) == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", argv[1]);
+            return 1;
+        }
+    } else {
+        source = generate(&size);
+    }
+
+    // warm up, and count the tokens once
+    if ((tokens = scan(source, size)) == NULL)
+        return 1;
+    for (ntokens = 0; tokens[ntokens].type != TOKEN_EOF; ntokens++)
+        ;
+    free_tokens(tokens);
+
+    runs = 0;
+    bytes = 0;
+    start = now();
+    do {
+        free_tokens(scan(source, size));
+        bytes += size;
+        runs++;
+    } while ((elapsed = now() - start) < MIN_SECONDS);
+
+    printf("%zu bytes, %zu tokens, %u runs\n", size, ntokens, runs);
+    printf("%.1f MB/s, %.1f Mtokens/s\n",
+           bytes / elapsed / 1e6, (double) ntokens * runs / elapsed / 1e6);
+
+    free(source);
+
+    return 0;
+}
+
+
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *f;
+    char *source;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+
+    source = (char *) malloc(*size + 1);
+    *size = fread(source, 1, *size, f);
+    fclose(f);
+
+    return source;
+}
+
+
+// A mix of declarations, calls, literals and comments, indented like
+// ordinary code.
+static char *generate(size_t *size)
+{
+    static const char *snippet =
+        "// Shapes and their areas\n"
+        "class Shape {\n"
+        "    init(name) {\n"
+        "        this.name = name;\n"
+        "    }\n"
+        "\n"
+        "    describe() {\n"
+        "        return this.name + \" with area \";\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "class Rectangle < Shape {\n"
+        "    init(width, height) {\n"
+        "        super.init(\"rectangle\");\n"
+        "        this.width = width;     // horizontal extent\n"
+        "        this.height = height;\n"
+        "    }\n"
+        "\n"
+        "    area() { return this.width * this.height; }\n"
+        "}\n"
+        "\n"
+        "fun total_area(count) {\n"
+        "    var sum = 0;\n"
+        "    for (var i = 0; i < count; i = i + 1) {\n"
+        "        if (i >= 10 and !(i == 42) or false) {\n"
+        "            sum = sum + Rectangle(i, 2.5).area();\n"
+        "        } else {\n"
+        "            sum = sum - 1.25;\n"
+        "        }\n"
+        "    }\n"
+        "    while (sum > 1000000) sum = sum / 2;\n"
+        "    return sum;\n"
+        "}\n"
+        "\n"
+        "var result = total_area(100);\n"
+        "print result != nil;\n";
+    size_t n, len;
+    char *source;
+
+    len = strlen(snippet);
+    source = (char *) malloc(GENERATED_SIZE + len);
+
+    for (n = 0; n + len <= GENERATED_SIZE; n += len)
+        memcpy(source + n, snippet, len);
+
+    *size = n;
+    return source;
+}
+
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+typedef struct arenabuf {
+    struct arenabuf *next;
+    void *p;
+} ArenaBuf;
+
+static void grow_arena(Arena *arena);
+
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    // a large array would waste most of a block, malloc it on its own
+    if (size > ARENA_BLOCK / 4) {
+        p = malloc(size);
+        arena_own(arena, p);
+        return p;
+    }
+
+    if ((size_t) (arena->end - arena->next) < size)
+        grow_arena(arena);
+
+    p = arena->next;
+    arena->next += size;
+
+    return p;
+}
+
+
+void arena_own(Arena *arena, void *p)
+{
+    ArenaBuf *buf;
+
+    buf = (ArenaBuf *) arena_alloc(arena, sizeof(ArenaBuf));
+    buf->p = p;
+    buf->next = arena->owned;
+    arena->owned = buf;
+}
+
+
+ArenaMark arena_mark(Arena *arena)
+{
+    return *arena;
+}
+
+
+void arena_reset(Arena *arena, ArenaMark mark)
+{
+    void *block;
+    ArenaBuf *buf;
+
+    // owned buffers are listed in the blocks, free them first
+    for (buf = arena->owned; buf != mark.owned; buf = buf->next)
+        free(buf->p);
+
+    while (arena->blocks != mark.blocks) {
+        block = arena->blocks;
+        arena->blocks = *(void **) block;
+        free(block);
+    }
+
+    *arena = mark;
+}
+
+
+void free_arena(Arena *arena)
+{
+    ArenaMark empty = ARENA_INIT;
+
+    arena_reset(arena, empty);
+}
+
+
+static void grow_arena(Arena *arena)
+{
+    char *block;
+
+    block = (char *) malloc(ARENA_BLOCK);
+    *(void **) block = arena->blocks;
+    arena->blocks = block;
+
+    arena->next = block + ARENA_ALIGN;
+    arena->end = block + ARENA_BLOCK;
+}
@@ -0,0 +1,34 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include <stddef.h>
+
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 8
+
+struct arenabuf;
+
+// Memory that lives and dies together, like the AST of a script or a REPL
+// line, is bump-allocated out of large blocks and never freed one by one.
+// A mark remembers the top of the arena, resetting to it drops everything
+// allocated since in one go. Buffers malloc'ed elsewhere can be handed over
+// with arena_own() to be freed along with the arena.
+typedef struct {
+    char *next;             // bump pointer into the newest block
+    char *end;
+    void *blocks;           // all blocks, linked through their first word
+    struct arenabuf *owned;
+} Arena;
+
+typedef Arena ArenaMark;
+
+#define ARENA_INIT { NULL, NULL, NULL, NULL }
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_own(Arena *arena, void *p);
+
+ArenaMark arena_mark(Arena *arena);
+void arena_reset(Arena *arena, ArenaMark mark);
+void free_arena(Arena *arena);
+
+#endif
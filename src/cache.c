@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+typedef struct {
+    size_t sites;
+    size_t hits;
+    size_t misses;
+    size_t mega;
+} ICTotals;
+
+static void count_site(ICTotals *totals, const InlineCache *ic);
+static void list_sites(const InlineCache *sites);
+static const char *state_name(enum ICState state);
+
+static InlineCache *SITES = NULL;
+
+// Sites dropped along with their AST still show in --ic-stats: they are
+// added to the totals, and the ones worth listing are copied to the heap.
+static ICTotals RETIRED;
+static InlineCache *LISTED = NULL;
+
+
+InlineCache *ic_new(Arena *arena, const char *kind, const Token *name)
+{
+    InlineCache *ic = (InlineCache *) arena_alloc(arena, sizeof(InlineCache));
+
+    memset(ic, 0, sizeof(InlineCache));
+    ic->kind = kind;
+    ic->name = name->lexeme;
+    ic->lineno = name->lineno;
+    ic->state = IC_EMPTY;
+    ic->next = SITES;
+    SITES = ic;
+
+    return ic;
+}
+
+
+ICEntry *ic_lookup(InlineCache *ic, Shape *shape, unsigned klass)
+{
+    unsigned i;
+
+    if (ic->state != IC_MEGA) {
+        for (i = 0; i < ic->n; i++) {
+            if (ic->entries[i].shape == shape && ic->entries[i].klass == klass) {
+                ic->hits++;
+                return &ic->entries[i];
+            }
+        }
+    }
+
+    ic->misses++;
+    return NULL;
+}
+
+
+void ic_update(InlineCache *ic, ICEntry entry)
+{
+    if (ic->state == IC_MEGA)
+        return;
+
+    if (ic->n == IC_ENTRIES) {
+        ic->state = IC_MEGA;
+        return;
+    }
+
+    ic->entries[ic->n++] = entry;
+    ic->state = (ic->n == 1) ? IC_MONO : IC_POLY;
+}
+
+
+InlineCache *ic_top()
+{
+    return SITES;
+}
+
+
+// Sites are pushed as their nodes are allocated, so the ones in the arena
+// past a mark are exactly those above the top taken with it.
+void ic_reset(InlineCache *top)
+{
+    InlineCache *ic, *copy;
+
+    for (ic = SITES; ic != top; ic = ic->next) {
+        count_site(&RETIRED, ic);
+        if (ic->state == IC_POLY || ic->state == IC_MEGA) {
+            copy = (InlineCache *) malloc(sizeof(InlineCache));
+            *copy = *ic;
+            copy->next = LISTED;
+            LISTED = copy;
+        }
+    }
+    SITES = top;
+}
+
+
+// Entries are dropped, megamorphic sites stay so.
+void ic_flush_all()
+{
+    InlineCache *ic;
+
+    for (ic = SITES; ic != NULL; ic = ic->next)
+        if (ic->state != IC_MEGA) {
+            ic->state = IC_EMPTY;
+            ic->n = 0;
+        }
+}
+
+
+void ic_print_stats()
+{
+    ICTotals totals = RETIRED;
+    InlineCache *ic;
+
+    for (ic = SITES; ic != NULL; ic = ic->next)
+        count_site(&totals, ic);
+
+    fprintf(stderr, "ic: sites:           %zu\n", totals.sites);
+    fprintf(stderr, "ic: hits:            %zu\n", totals.hits);
+    fprintf(stderr, "ic: misses:          %zu\n", totals.misses);
+    fprintf(stderr, "ic: megamorphic:     %zu\n", totals.mega);
+
+    list_sites(SITES);
+    list_sites(LISTED);
+}
+
+
+void ic_free_all()
+{
+    InlineCache *ic, *next;
+
+    // live sites belong to the arena
+    for (ic = LISTED; ic != NULL; ic = next) {
+        next = ic->next;
+        free(ic);
+    }
+    LISTED = NULL;
+    SITES = NULL;
+}
+
+
+static void count_site(ICTotals *totals, const InlineCache *ic)
+{
+    if (ic->state == IC_EMPTY)
+        return;
+    totals->sites++;
+    totals->hits += ic->hits;
+    totals->misses += ic->misses;
+    totals->mega += (ic->state == IC_MEGA);
+}
+
+
+// monomorphic sites are the expected case, only list the others
+static void list_sites(const InlineCache *sites)
+{
+    const InlineCache *ic;
+
+    for (ic = sites; ic != NULL; ic = ic->next) {
+        if (ic->state != IC_POLY && ic->state != IC_MEGA)
+            continue;
+        fprintf(stderr, "ic: line %d: %s '%s' %s, %zu hits, %zu misses\n",
+                ic->lineno, ic->kind, ic->name, state_name(ic->state),
+                ic->hits, ic->misses);
+    }
+}
+
+
+static const char *state_name(enum ICState state)
+{
+    switch (state) {
+        case IC_EMPTY:
+            return "empty";
+        case IC_MONO:
+            return "monomorphic";
+        case IC_POLY:
+            return "polymorphic";
+        case IC_MEGA:
+            return "megamorphic";
+    }
+    return "?";
+}
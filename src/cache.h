@@ -0,0 +1,58 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "scanner.h"
+#include "shape.h"
+
+#define IC_ENTRIES 4
+
+struct loxobj;  // forward declaration for LoxObj
+
+// A property access site remembers what it found for the last few receiver
+// layouts. Entries are keyed on the receiver's shape and class id (ids are
+// never reused, unlike addresses of collected classes). Once more layouts
+// show up than there are entries the site goes megamorphic and stops caching.
+enum ICState {
+    IC_EMPTY = 0,
+    IC_MONO,
+    IC_POLY,
+    IC_MEGA,
+};
+
+typedef struct {
+    Shape *shape;
+    unsigned klass;
+    int slot;                   // field index, -1 if 'method' is set
+    Shape *next;                // set sites: shape after adding the field
+    struct loxobj *method;
+} ICEntry;
+
+typedef struct inlinecache {
+    struct inlinecache *next;   // all sites, newest first
+    const char *kind;
+    const char *name;
+    int lineno;
+    enum ICState state;
+    unsigned n;
+    ICEntry entries[IC_ENTRIES];
+    size_t hits;
+    size_t misses;
+} InlineCache;
+
+// Sites are allocated along with their node and dropped with it: resetting
+// to the top of the list taken before parsing unlinks every site since.
+InlineCache *ic_new(Arena *arena, const char *kind, const Token *name);
+ICEntry *ic_lookup(InlineCache *ic, Shape *shape, unsigned klass);
+void ic_update(InlineCache *ic, ICEntry entry);
+
+InlineCache *ic_top();
+void ic_reset(InlineCache *top);
+void ic_flush_all();
+
+void ic_print_stats();
+void ic_free_all();
+
+#endif
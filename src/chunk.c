@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "globals.h"
+#include "loxobj.h"
+#include "value.h"
+
+static size_t simple_instr(const char *name, size_t offset);
+static size_t byte_instr(const char *name, const Chunk *chunk, size_t offset);
+static size_t const_instr(const char *name, const Chunk *chunk, size_t offset);
+static size_t global_instr(const char *name, const Chunk *chunk, size_t offset);
+static size_t invoke_instr(const char *name, const Chunk *chunk, size_t offset);
+static size_t jump_instr(const char *name, int sign, const Chunk *chunk, size_t offset);
+static size_t closure_instr(const Chunk *chunk, size_t offset);
+static size_t disassemble_instr(const Chunk *chunk, size_t offset);
+
+
+Chunk *new_chunk()
+{
+    Chunk *chunk = (Chunk *) malloc(sizeof(Chunk));
+
+    chunk->code = NULL;
+    chunk->n = 0;
+    chunk->capacity = 0;
+    chunk->constants = NULL;
+    chunk->nconstants = 0;
+    chunk->maxconstants = 0;
+
+    return chunk;
+}
+
+
+void free_chunk(Chunk *chunk)
+{
+    free(chunk->code);
+    free(chunk->constants);
+    free(chunk);
+}
+
+
+void chunk_write(Chunk *chunk, uint8_t byte)
+{
+    if (chunk->n >= chunk->capacity) {
+        chunk->capacity = (chunk->capacity < 8) ? 8 : chunk->capacity * 2;
+        chunk->code = (uint8_t *) realloc(chunk->code, chunk->capacity);
+    }
+
+    chunk->code[chunk->n++] = byte;
+}
+
+
+size_t chunk_add_constant(Chunk *chunk, Value value)
+{
+    if (chunk->nconstants >= chunk->maxconstants) {
+        chunk->maxconstants = (chunk->maxconstants < 8) ? 8 : chunk->maxconstants * 2;
+        chunk->constants = (Value *) realloc(chunk->constants,
+                                             chunk->maxconstants * sizeof(Value));
+    }
+
+    chunk->constants[chunk->nconstants] = value;
+
+    return chunk->nconstants++;
+}
+
+
+void disassemble_chunk(const Chunk *chunk, const char *name)
+{
+    size_t offset;
+
+    printf("== %s ==\n", name);
+
+    for (offset = 0; offset < chunk->n;)
+        offset = disassemble_instr(chunk, offset);
+}
+
+
+static size_t disassemble_instr(const Chunk *chunk, size_t offset)
+{
+    printf("%04zu ", offset);
+
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+            return const_instr("OP_CONSTANT", chunk, offset);
+        case OP_NIL:
+            return simple_instr("OP_NIL", offset);
+        case OP_TRUE:
+            return simple_instr("OP_TRUE", offset);
+        case OP_FALSE:
+            return simple_instr("OP_FALSE", offset);
+        case OP_POP:
+            return simple_instr("OP_POP", offset);
+        case OP_POPN:
+            return byte_instr("OP_POPN", chunk, offset);
+        case OP_GET_LOCAL:
+            return byte_instr("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL:
+            return byte_instr("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_GLOBAL:
+            return global_instr("OP_GET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL:
+            return global_instr("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:
+            return global_instr("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_UPVALUE:
+            return byte_instr("OP_GET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE:
+            return byte_instr("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_PROPERTY:
+            return const_instr("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY:
+            return const_instr("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_SUPER:
+            return const_instr("OP_GET_SUPER", chunk, offset);
+        case OP_EQUAL:
+            return simple_instr("OP_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simple_instr("OP_NOT_EQUAL", offset);
+        case OP_GREATER:
+            return simple_instr("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simple_instr("OP_GREATER_EQUAL", offset);
+        case OP_LESS:
+            return simple_instr("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simple_instr("OP_LESS_EQUAL", offset);
+        case OP_ADD:
+            return simple_instr("OP_ADD", offset);
+        case OP_SUBTRACT:
+            return simple_instr("OP_SUBTRACT", offset);
+        case OP_MULTIPLY:
+            return simple_instr("OP_MULTIPLY", offset);
+        case OP_DIVIDE:
+            return simple_instr("OP_DIVIDE", offset);
+        case OP_NOT:
+            return simple_instr("OP_NOT", offset);
+        case OP_NEGATE:
+            return simple_instr("OP_NEGATE", offset);
+        case OP_PRINT:
+            return simple_instr("OP_PRINT", offset);
+        case OP_JUMP:
+            return jump_instr("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jump_instr("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP:
+            return jump_instr("OP_LOOP", -1, chunk, offset);
+        case OP_CALL:
+            return byte_instr("OP_CALL", chunk, offset);
+        case OP_INVOKE:
+            return invoke_instr("OP_INVOKE", chunk, offset);
+        case OP_SUPER_INVOKE:
+            return invoke_instr("OP_SUPER_INVOKE", chunk, offset);
+        case OP_CLOSURE:
+            return closure_instr(chunk, offset);
+        case OP_CLOSE_UPVALUE:
+            return simple_instr("OP_CLOSE_UPVALUE", offset);
+        case OP_RETURN:
+            return simple_instr("OP_RETURN", offset);
+        case OP_CLASS:
+            return const_instr("OP_CLASS", chunk, offset);
+        case OP_INHERIT:
+            return simple_instr("OP_INHERIT", offset);
+        case OP_METHOD:
+            return const_instr("OP_METHOD", chunk, offset);
+        default:
+            printf("unknown opcode %d\n", chunk->code[offset]);
+            return offset + 1;
+    }
+}
+
+
+static size_t simple_instr(const char *name, size_t offset)
+{
+    printf("%s\n", name);
+    return offset + 1;
+}
+
+
+static size_t byte_instr(const char *name, const Chunk *chunk, size_t offset)
+{
+    printf("%-16s %4d\n", name, chunk->code[offset + 1]);
+    return offset + 2;
+}
+
+
+static void print_constant(const Chunk *chunk, unsigned idx)
+{
+    char *s;
+
+    s = str_value(chunk->constants[idx]);
+    printf("%4u '%s'", idx, s);
+    free(s);
+}
+
+
+static size_t const_instr(const char *name, const Chunk *chunk, size_t offset)
+{
+    unsigned idx;
+
+    idx = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+
+    printf("%-16s ", name);
+    print_constant(chunk, idx);
+    printf("\n");
+
+    return offset + 3;
+}
+
+
+static size_t global_instr(const char *name, const Chunk *chunk, size_t offset)
+{
+    unsigned slot;
+
+    slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4u '%s'\n", name, slot, global_name(slot));
+
+    return offset + 3;
+}
+
+
+static size_t invoke_instr(const char *name, const Chunk *chunk, size_t offset)
+{
+    unsigned idx;
+
+    idx = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+
+    printf("%-16s (%d args) ", name, chunk->code[offset + 3]);
+    print_constant(chunk, idx);
+    printf("\n");
+
+    return offset + 4;
+}
+
+
+static size_t jump_instr(const char *name, int sign, const Chunk *chunk, size_t offset)
+{
+    unsigned jump;
+
+    jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4zu -> %zu\n", name, offset, offset + 3 + sign * jump);
+
+    return offset + 3;
+}
+
+
+static size_t closure_instr(const Chunk *chunk, size_t offset)
+{
+    unsigned i, idx;
+    LoxObj *proto;
+
+    idx = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    proto = AS_OBJ(chunk->constants[idx]);
+
+    printf("%-16s ", "OP_CLOSURE");
+    print_constant(chunk, idx);
+    printf("\n");
+
+    offset += 3;
+    for (i = 0; i < proto->proto.nupvalues; i++, offset += 2)
+        printf("%04zu    |                     %s %d\n", offset,
+               chunk->code[offset] ? "local" : "upvalue", chunk->code[offset + 1]);
+
+    return offset;
+}
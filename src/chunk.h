@@ -0,0 +1,73 @@
+#ifndef clox_chunk_h
+#define clox_chunk_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+// Operands: 'const', 'global' and 'jump' are 16 bit, 'slot' and 'argc' are
+// 8 bit.
+typedef enum {
+    OP_CONSTANT = 0,        // const
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    OP_POP,
+    OP_POPN,                // n
+    OP_GET_LOCAL,           // slot
+    OP_SET_LOCAL,           // slot
+    OP_GET_GLOBAL,          // global
+    OP_DEFINE_GLOBAL,       // global
+    OP_SET_GLOBAL,          // global
+    OP_GET_UPVALUE,         // slot
+    OP_SET_UPVALUE,         // slot
+    OP_GET_PROPERTY,        // const (name)
+    OP_SET_PROPERTY,        // const (name)
+    OP_GET_SUPER,           // const (name)
+    OP_EQUAL,
+    OP_NOT_EQUAL,
+    OP_GREATER,
+    OP_GREATER_EQUAL,
+    OP_LESS,
+    OP_LESS_EQUAL,
+    OP_ADD,
+    OP_SUBTRACT,
+    OP_MULTIPLY,
+    OP_DIVIDE,
+    OP_NOT,
+    OP_NEGATE,
+    OP_PRINT,
+    OP_JUMP,                // jump
+    OP_JUMP_IF_FALSE,       // jump
+    OP_LOOP,                // jump
+    OP_CALL,                // argc
+    OP_INVOKE,              // const (name), argc
+    OP_SUPER_INVOKE,        // const (name), argc
+    OP_CLOSURE,             // const (proto), then (is_local, index) per upvalue
+    OP_CLOSE_UPVALUE,
+    OP_RETURN,
+    OP_CLASS,               // const (name)
+    OP_INHERIT,
+    OP_METHOD,              // const (name)
+} OpCode;
+
+
+typedef struct chunk {
+    uint8_t *code;
+    size_t n;
+    size_t capacity;
+    Value *constants;
+    size_t nconstants;
+    size_t maxconstants;
+} Chunk;
+
+Chunk *new_chunk();
+void free_chunk(Chunk *chunk);
+
+void chunk_write(Chunk *chunk, uint8_t byte);
+size_t chunk_add_constant(Chunk *chunk, Value value);
+
+void disassemble_chunk(const Chunk *chunk, const char *name);
+
+#endif
@@ -0,0 +1,813 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "dict.h"
+#include "expr.h"
+#include "gc.h"
+#include "globals.h"
+#include "logger.h"
+#include "loxobj.h"
+#include "scanner.h"
+#include "stmt.h"
+#include "value.h"
+
+#define MAX_LOCALS 256
+#define MAX_CONSTANTS 65536
+#define MAX_JUMP 65535
+
+// Define to dump the bytecode of every compiled function
+// #define DEBUG_PRINT_CODE
+
+
+typedef struct scope {
+    struct scope *next;
+    unsigned base;
+} Scope;
+
+
+// The compiler walks the resolved AST, so a local is addressed by the
+// resolver's (depth, slot) binding: its stack slot is the base of the
+// scope 'depth' hops up plus 'slot'.
+typedef struct compiler {
+    struct compiler *enclosing;
+    LoxObj *proto;
+    Scope *scopes;
+    unsigned nlocals;
+    bool captured[MAX_LOCALS];
+    bool full;              // ran out of locals, reported once
+    Dict *names;
+} Compiler;
+
+
+static void mark_roots();
+
+static void init_compiler(Compiler *compiler, LoxObj *proto);
+static void end_compiler(Compiler *compiler);
+
+static void compile_stmt(Stmt *stmt);
+static void compile_block_stmt(Stmt *stmt);
+static void compile_class_stmt(Stmt *stmt);
+static void compile_expr_stmt(Stmt *stmt);
+static void compile_fun_stmt(Stmt *stmt);
+static void compile_if_stmt(Stmt *stmt);
+static void compile_print_stmt(Stmt *stmt);
+static void compile_return_stmt(Stmt *stmt);
+static void compile_var_stmt(Stmt *stmt);
+static void compile_while_stmt(Stmt *stmt);
+static void compile_fun(Stmt *stmt, bool method, bool init);
+
+static void compile_expr(const Expr *expr);
+static void compile_assign(const Expr *expr);
+static void compile_binary(const Expr *expr);
+static void compile_call(const Expr *expr);
+static void compile_get(const Expr *expr);
+static void compile_literal(const Expr *expr);
+static void compile_logic(const Expr *expr);
+static void compile_set(const Expr *expr);
+static void compile_super(const Expr *expr);
+static void compile_unary(const Expr *expr);
+static unsigned compile_args(const Expr *expr);
+
+static void begin_scope();
+static void end_scope();
+static Scope *scope_at(unsigned depth);
+static void define_var(char *name);
+static void load_var(const Binding *bind);
+static void store_var(const Binding *bind);
+
+static void emit_byte(uint8_t byte);
+static void emit_bytes(uint8_t byte1, uint8_t byte2);
+static void emit_short(uint8_t op, unsigned operand);
+static void emit_global(uint8_t op, unsigned slot);
+static void emit_return();
+static size_t emit_jump(uint8_t op);
+static void patch_jump(size_t offset);
+static void emit_loop(size_t start);
+static unsigned make_constant(Value value);
+static unsigned name_constant(char *name);
+static Chunk *current_chunk();
+
+static Compiler *CURRENT = NULL;
+static bool HAS_ERROR = false;
+
+
+LoxObj *compile(Stmt **stmts)
+{
+    unsigned i;
+    Compiler compiler;
+    LoxObj *proto;
+
+    gc_register_roots(mark_roots, NULL);
+
+    HAS_ERROR = false;
+
+    init_compiler(&compiler, new_proto_obj(NULL, 0, false));
+
+    for (i = 0; stmts[i] != NULL; i++)
+        compile_stmt(stmts[i]);
+
+    emit_return();
+
+    proto = compiler.proto;
+    end_compiler(&compiler);
+
+    return (HAS_ERROR) ? NULL : proto;
+}
+
+
+static void mark_roots()
+{
+    Compiler *compiler;
+
+    for (compiler = CURRENT; compiler != NULL; compiler = compiler->enclosing)
+        gc_mark((GCObj *) compiler->proto);
+}
+
+
+static void init_compiler(Compiler *compiler, LoxObj *proto)
+{
+    compiler->enclosing = CURRENT;
+    compiler->proto = proto;
+    compiler->scopes = NULL;
+    // slot 0 holds the running closure, or the receiver of a method
+    compiler->nlocals = 1;
+    memset(compiler->captured, 0, sizeof(compiler->captured));
+    compiler->full = false;
+    compiler->names = Dict_New();
+
+    CURRENT = compiler;
+}
+
+
+static void end_compiler(Compiler *compiler)
+{
+    Scope *scope;
+
+#ifdef DEBUG_PRINT_CODE
+    char *name;
+
+    if (!HAS_ERROR) {
+        name = str_obj(compiler->proto);
+        disassemble_chunk(compiler->proto->proto.chunk, name);
+        free(name);
+    }
+#endif
+
+    while ((scope = compiler->scopes) != NULL) {
+        compiler->scopes = scope->next;
+        free(scope);
+    }
+
+    Dict_Free(compiler->names);
+
+    CURRENT = compiler->enclosing;
+}
+
+
+static void error(const char *msg)
+{
+    log_error(LOX_SYNTAX_ERR, "%s", msg);
+    HAS_ERROR = true;
+}
+
+
+static void compile_stmt(Stmt *stmt)
+{
+    switch (stmt->type) {
+        case STMT_BLOCK:
+            return compile_block_stmt(stmt);
+        case STMT_CLASS:
+            return compile_class_stmt(stmt);
+        case STMT_EXPR:
+            return compile_expr_stmt(stmt);
+        case STMT_FUN:
+            return compile_fun_stmt(stmt);
+        case STMT_IF:
+            return compile_if_stmt(stmt);
+        case STMT_PRINT:
+            return compile_print_stmt(stmt);
+        case STMT_RETURN:
+            return compile_return_stmt(stmt);
+        case STMT_VAR:
+            return compile_var_stmt(stmt);
+        case STMT_WHILE:
+            return compile_while_stmt(stmt);
+    }
+}
+
+
+static void compile_block_stmt(Stmt *stmt)
+{
+    unsigned i;
+
+    // the resolver gives no scope to a block that declares nothing
+    if (stmt->block.nslots == 0) {
+        for (i = 0; i < stmt->block.n; i++)
+            compile_stmt(stmt->block.stmts[i]);
+        return;
+    }
+
+    begin_scope();
+
+    for (i = 0; i < stmt->block.n; i++)
+        compile_stmt(stmt->block.stmts[i]);
+
+    end_scope();
+}
+
+
+static void compile_class_stmt(Stmt *stmt)
+{
+    unsigned i, name, slot;
+    bool global, init;
+    char *method;
+
+    name = name_constant(stmt->klass.name->lexeme);
+    global = (CURRENT->scopes == NULL);
+    slot = CURRENT->nlocals;
+
+    emit_short(OP_CLASS, name);
+    define_var(stmt->klass.name->lexeme);
+
+    // the superclass is resolved outside of the scope holding 'super'
+    if (stmt->klass.superclass != NULL) {
+        compile_expr(stmt->klass.superclass);
+        begin_scope();
+        CURRENT->nlocals++;
+    }
+
+    if (global)
+        emit_global(OP_GET_GLOBAL, global_slot(stmt->klass.name->lexeme));
+    else
+        emit_bytes(OP_GET_LOCAL, slot);
+
+    if (stmt->klass.superclass != NULL)
+        emit_byte(OP_INHERIT);
+
+    for (i = 0; i < stmt->klass.n; i++) {
+        method = stmt->klass.methods[i]->fun.name;
+        init = (strcmp(method, "init") == 0);
+        compile_fun(stmt->klass.methods[i], true, init);
+        emit_short(OP_METHOD, name_constant(method));
+    }
+
+    emit_byte(OP_POP);
+
+    if (stmt->klass.superclass != NULL)
+        end_scope();
+}
+
+
+static void compile_expr_stmt(Stmt *stmt)
+{
+    compile_expr(stmt->expr);
+    emit_byte(OP_POP);
+}
+
+
+static void compile_fun_stmt(Stmt *stmt)
+{
+    compile_fun(stmt, false, false);
+    define_var(stmt->fun.name);
+}
+
+
+static void compile_if_stmt(Stmt *stmt)
+{
+    size_t then_jump, else_jump;
+
+    compile_expr(stmt->ifelse.cond);
+
+    then_jump = emit_jump(OP_JUMP_IF_FALSE);
+    emit_byte(OP_POP);
+    compile_stmt(stmt->ifelse.conseq);
+
+    else_jump = emit_jump(OP_JUMP);
+    patch_jump(then_jump);
+    emit_byte(OP_POP);
+
+    if (stmt->ifelse.alt != NULL)
+        compile_stmt(stmt->ifelse.alt);
+
+    patch_jump(else_jump);
+}
+
+
+static void compile_print_stmt(Stmt *stmt)
+{
+    compile_expr(stmt->expr);
+    emit_byte(OP_PRINT);
+}
+
+
+static void compile_return_stmt(Stmt *stmt)
+{
+    if (CURRENT->proto->proto.init) {
+        emit_return();
+        return;
+    }
+
+    if (stmt->expr != NULL)
+        compile_expr(stmt->expr);
+    else
+        emit_byte(OP_NIL);
+
+    emit_byte(OP_RETURN);
+}
+
+
+static void compile_var_stmt(Stmt *stmt)
+{
+    if (stmt->var.expr != NULL)
+        compile_expr(stmt->var.expr);
+    else
+        emit_byte(OP_NIL);
+
+    define_var(stmt->var.name);
+}
+
+
+static void compile_while_stmt(Stmt *stmt)
+{
+    size_t start, exit_jump;
+
+    start = current_chunk()->n;
+    exit_jump = 0;
+
+    if (stmt->whileloop.cond != NULL) {
+        compile_expr(stmt->whileloop.cond);
+        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+        emit_byte(OP_POP);
+    }
+
+    compile_stmt(stmt->whileloop.body);
+    emit_loop(start);
+
+    if (stmt->whileloop.cond != NULL) {
+        patch_jump(exit_jump);
+        emit_byte(OP_POP);
+    }
+}
+
+
+// Compiles the function into its own prototype and emits the OP_CLOSURE
+// that instantiates it, followed by where each of its upvalues comes from.
+static void compile_fun(Stmt *stmt, bool method, bool init)
+{
+    unsigned i, slot;
+    Upvalue *upvalue;
+    Compiler compiler;
+    LoxObj *proto;
+
+    if (stmt->fun.nupvalues > UINT8_MAX + 1) {
+        error("too many closure variables in function");
+        return;
+    }
+
+    init_compiler(&compiler, new_proto_obj(stmt->fun.name, stmt->fun.n, init));
+
+    proto = compiler.proto;
+    proto->proto.nupvalues = stmt->fun.nupvalues;
+
+    // the resolver puts 'this' in the first slot of a method's scope
+    begin_scope();
+    if (method)
+        compiler.scopes->base = 0;
+    compiler.nlocals += stmt->fun.n;
+
+    // the body's locals follow in the same scope, the return pops them all
+    for (i = 0; i < stmt->fun.body->block.n; i++)
+        compile_stmt(stmt->fun.body->block.stmts[i]);
+    emit_return();
+
+    end_compiler(&compiler);
+
+    emit_short(OP_CLOSURE, make_constant(OBJ_VAL(proto)));
+
+    for (i = 0; i < stmt->fun.nupvalues; i++) {
+        upvalue = &stmt->fun.upvalues[i];
+        if (upvalue->is_local) {
+            slot = scope_at(upvalue->depth)->base + upvalue->index;
+            CURRENT->captured[slot] = true;
+            emit_bytes(1, slot);
+        } else {
+            emit_bytes(0, upvalue->index);
+        }
+    }
+}
+
+
+static void compile_expr(const Expr *expr)
+{
+    switch (expr->type) {
+        case EXPR_ASSIGN:
+            return compile_assign(expr);
+        case EXPR_BINARY:
+            return compile_binary(expr);
+        case EXPR_CALL:
+            return compile_call(expr);
+        case EXPR_GET:
+            return compile_get(expr);
+        case EXPR_GROUPING:
+            return compile_expr(expr->grouping);
+        case EXPR_LITERAL:
+            return compile_literal(expr);
+        case EXPR_LOGIC:
+            return compile_logic(expr);
+        case EXPR_THIS:
+            return load_var(&expr->var.bind);
+        case EXPR_SET:
+            return compile_set(expr);
+        case EXPR_SUPER:
+            return compile_super(expr);
+        case EXPR_UNARY:
+            return compile_unary(expr);
+        case EXPR_VAR:
+            return load_var(&expr->var.bind);
+    }
+}
+
+
+static void compile_assign(const Expr *expr)
+{
+    compile_expr(expr->assign.value);
+    store_var(&expr->assign.bind);
+}
+
+
+static void compile_binary(const Expr *expr)
+{
+    compile_expr(expr->binary.left);
+    compile_expr(expr->binary.right);
+
+    switch (expr->binary.op->type) {
+        case TOKEN_MINUS:
+            return emit_byte(OP_SUBTRACT);
+        case TOKEN_SLASH:
+            return emit_byte(OP_DIVIDE);
+        case TOKEN_STAR:
+            return emit_byte(OP_MULTIPLY);
+        case TOKEN_PLUS:
+            return emit_byte(OP_ADD);
+        case TOKEN_BANG_EQUAL:
+            return emit_byte(OP_NOT_EQUAL);
+        case TOKEN_EQUAL_EQUAL:
+            return emit_byte(OP_EQUAL);
+        case TOKEN_LESS:
+            return emit_byte(OP_LESS);
+        case TOKEN_LESS_EQUAL:
+            return emit_byte(OP_LESS_EQUAL);
+        case TOKEN_GREATER:
+            return emit_byte(OP_GREATER);
+        case TOKEN_GREATER_EQUAL:
+            return emit_byte(OP_GREATER_EQUAL);
+        default:
+            error("unexpected binary operator");
+    }
+}
+
+
+static void compile_call(const Expr *expr)
+{
+    unsigned argc, name;
+    const Expr *callee;
+
+    callee = expr->call.callee;
+
+    // method calls skip creating the bound method
+    if (callee->type == EXPR_GET) {
+        compile_expr(callee->get.object);
+        argc = compile_args(expr);
+        emit_short(OP_INVOKE, name_constant(callee->get.name->lexeme));
+        emit_byte(argc);
+    } else if (callee->type == EXPR_SUPER) {
+        name = name_constant(callee->super.method->lexeme);
+        load_var(&callee->super.this);
+        argc = compile_args(expr);
+        load_var(&callee->super.bind);
+        emit_short(OP_SUPER_INVOKE, name);
+        emit_byte(argc);
+    } else {
+        compile_expr(callee);
+        argc = compile_args(expr);
+        emit_bytes(OP_CALL, argc);
+    }
+}
+
+
+static unsigned compile_args(const Expr *expr)
+{
+    unsigned i;
+
+    if (expr->call.argc > UINT8_MAX) {
+        error("cannot have more than 255 arguments");
+        return 0;
+    }
+
+    for (i = 0; i < expr->call.argc; i++)
+        compile_expr(expr->call.args[i]);
+
+    return expr->call.argc;
+}
+
+
+static void compile_get(const Expr *expr)
+{
+    compile_expr(expr->get.object);
+    emit_short(OP_GET_PROPERTY, name_constant(expr->get.name->lexeme));
+}
+
+
+// Folded literals keep the token of the operator they replace, so go by
+// the value rather than the token type.
+static void compile_literal(const Expr *expr)
+{
+    Value value;
+
+    value = expr->literal.value;
+
+    if (IS_NIL(value))
+        emit_byte(OP_NIL);
+    else if (IS_BOOL(value))
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else if (IS_NUMBER(value))
+        emit_short(OP_CONSTANT, make_constant(value));
+    else if (IS_OBJ(value) && AS_OBJ(value)->type == LOX_OBJ_STRING)
+        emit_short(OP_CONSTANT, name_constant(AS_OBJ(value)->sval));
+    else
+        error("unexpected literal");
+}
+
+
+static void compile_logic(const Expr *expr)
+{
+    size_t else_jump, end_jump;
+
+    compile_expr(expr->binary.left);
+
+    if (expr->binary.op->type == TOKEN_OR) {
+        else_jump = emit_jump(OP_JUMP_IF_FALSE);
+        end_jump = emit_jump(OP_JUMP);
+        patch_jump(else_jump);
+    } else {
+        end_jump = emit_jump(OP_JUMP_IF_FALSE);
+    }
+
+    emit_byte(OP_POP);
+    compile_expr(expr->binary.right);
+
+    patch_jump(end_jump);
+}
+
+
+static void compile_set(const Expr *expr)
+{
+    compile_expr(expr->set.object);
+    compile_expr(expr->set.value);
+    emit_short(OP_SET_PROPERTY, name_constant(expr->set.name->lexeme));
+}
+
+
+static void compile_super(const Expr *expr)
+{
+    load_var(&expr->super.this);
+    load_var(&expr->super.bind);
+    emit_short(OP_GET_SUPER, name_constant(expr->super.method->lexeme));
+}
+
+
+static void compile_unary(const Expr *expr)
+{
+    compile_expr(expr->unary.right);
+
+    switch (expr->unary.op->type) {
+        case TOKEN_BANG:
+            return emit_byte(OP_NOT);
+        case TOKEN_MINUS:
+            return emit_byte(OP_NEGATE);
+        default:
+            error("unexpected unary operator");
+    }
+}
+
+
+static void begin_scope()
+{
+    Scope *scope = (Scope *) malloc(sizeof(Scope));
+
+    scope->base = CURRENT->nlocals;
+    scope->next = CURRENT->scopes;
+    CURRENT->scopes = scope;
+}
+
+
+// Pops the scope's locals, moving the captured ones to the heap.
+static void end_scope()
+{
+    unsigned n;
+    Scope *scope;
+
+    scope = CURRENT->scopes;
+    CURRENT->scopes = scope->next;
+
+    n = 0;
+    while (CURRENT->nlocals > scope->base) {
+        CURRENT->nlocals--;
+        if (CURRENT->captured[CURRENT->nlocals]) {
+            if (n > 0)
+                emit_bytes(OP_POPN, n);
+            n = 0;
+            CURRENT->captured[CURRENT->nlocals] = false;
+            emit_byte(OP_CLOSE_UPVALUE);
+        } else {
+            n++;
+        }
+    }
+
+    if (n == 1)
+        emit_byte(OP_POP);
+    else if (n > 1)
+        emit_bytes(OP_POPN, n);
+
+    free(scope);
+}
+
+
+static Scope *scope_at(unsigned depth)
+{
+    Scope *scope;
+
+    for (scope = CURRENT->scopes; depth > 0; depth--)
+        scope = scope->next;
+
+    return scope;
+}
+
+
+// Outside of any scope the value on top of the stack becomes a global,
+// otherwise it just stays there as the next local.
+static void define_var(char *name)
+{
+    if (CURRENT->scopes == NULL) {
+        emit_global(OP_DEFINE_GLOBAL, global_slot(name));
+        return;
+    }
+
+    if (CURRENT->nlocals >= MAX_LOCALS) {
+        if (!CURRENT->full)
+            error("too many local variables in function");
+        CURRENT->full = true;
+        return;
+    }
+
+    CURRENT->nlocals++;
+}
+
+
+static void load_var(const Binding *bind)
+{
+    if (bind->depth == EXPR_GLOBAL)
+        emit_global(OP_GET_GLOBAL, bind->slot);
+    else if (bind->depth == EXPR_UPVALUE)
+        emit_bytes(OP_GET_UPVALUE, bind->slot);
+    else
+        emit_bytes(OP_GET_LOCAL, scope_at(bind->depth)->base + bind->slot);
+}
+
+
+static void store_var(const Binding *bind)
+{
+    if (bind->depth == EXPR_GLOBAL)
+        emit_global(OP_SET_GLOBAL, bind->slot);
+    else if (bind->depth == EXPR_UPVALUE)
+        emit_bytes(OP_SET_UPVALUE, bind->slot);
+    else
+        emit_bytes(OP_SET_LOCAL, scope_at(bind->depth)->base + bind->slot);
+}
+
+
+static void emit_byte(uint8_t byte)
+{
+    chunk_write(current_chunk(), byte);
+}
+
+
+static void emit_bytes(uint8_t byte1, uint8_t byte2)
+{
+    emit_byte(byte1);
+    emit_byte(byte2);
+}
+
+
+static void emit_short(uint8_t op, unsigned operand)
+{
+    emit_byte(op);
+    emit_bytes((operand >> 8) & 0xff, operand & 0xff);
+}
+
+
+static void emit_global(uint8_t op, unsigned slot)
+{
+    if (slot > UINT16_MAX) {
+        error("too many global variables");
+        return;
+    }
+
+    emit_short(op, slot);
+}
+
+
+// Initialisers always hand back their receiver.
+static void emit_return()
+{
+    if (CURRENT->proto->proto.init)
+        emit_bytes(OP_GET_LOCAL, 0);
+    else
+        emit_byte(OP_NIL);
+
+    emit_byte(OP_RETURN);
+}
+
+
+static size_t emit_jump(uint8_t op)
+{
+    emit_short(op, 0xffff);
+
+    return current_chunk()->n - 2;
+}
+
+
+static void patch_jump(size_t offset)
+{
+    size_t jump;
+    Chunk *chunk;
+
+    chunk = current_chunk();
+    jump = chunk->n - offset - 2;
+
+    if (jump > MAX_JUMP) {
+        error("too much code to jump over");
+        return;
+    }
+
+    chunk->code[offset] = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
+}
+
+
+static void emit_loop(size_t start)
+{
+    size_t jump;
+
+    jump = current_chunk()->n - start + 3;
+
+    if (jump > MAX_JUMP) {
+        error("loop body too large");
+        return;
+    }
+
+    emit_short(OP_LOOP, jump);
+}
+
+
+static unsigned make_constant(Value value)
+{
+    size_t idx;
+
+    idx = chunk_add_constant(current_chunk(), value);
+    GC_BARRIER(CURRENT->proto);
+
+    if (idx >= MAX_CONSTANTS) {
+        error("too many constants in one chunk");
+        return 0;
+    }
+
+    return idx;
+}
+
+
+// Names and string literals are interned per chunk, so each one is
+// allocated only once however often it's referenced.
+static unsigned name_constant(char *name)
+{
+    unsigned idx;
+    Value value;
+
+    if (!IS_UNDEF(value = Dict_Get(CURRENT->names, name)))
+        return AS_NUMBER(value);
+
+    idx = make_constant(OBJ_VAL(new_str_obj(strdup(name))));
+    Dict_Set(CURRENT->names, name, NUMBER_VAL(idx));
+
+    return idx;
+}
+
+
+static Chunk *current_chunk()
+{
+    return CURRENT->proto->proto.chunk;
+}
@@ -0,0 +1,9 @@
+#ifndef clox_compiler_h
+#define clox_compiler_h
+
+#include "loxobj.h"
+#include "stmt.h"
+
+LoxObj *compile(Stmt **stmts);
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constant.h"
+#include "gc.h"
+#include "loxobj.h"
+
+static void mark_constants();
+
+static Value *CONSTANTS = NULL;
+static size_t NCONSTANTS = 0;
+static size_t MAXCONSTANTS = 0;
+
+
+Value new_constant(const Token *literal)
+{
+    Value value;
+
+    switch (literal->type) {
+        case TOKEN_NUMBER:
+            return NUMBER_VAL(atof(literal->lexeme));
+        case TOKEN_STRING:
+            value = OBJ_VAL(new_str_obj(strdup(literal->lexeme)));
+            add_constant(value);
+            return value;
+        case TOKEN_FALSE:
+            return FALSE_VAL;
+        case TOKEN_TRUE:
+            return TRUE_VAL;
+        case TOKEN_NIL:
+            return NIL_VAL;
+        default:
+            return UNDEF_VAL;
+    }
+}
+
+
+size_t constants_top()
+{
+    return NCONSTANTS;
+}
+
+
+void constants_reset(size_t top)
+{
+    NCONSTANTS = top;
+}
+
+
+void free_constants()
+{
+    free(CONSTANTS);
+    CONSTANTS = NULL;
+    NCONSTANTS = MAXCONSTANTS = 0;
+}
+
+
+// Numbers and other immediates live in the node itself, only objects need
+// to be pooled.
+void add_constant(Value value)
+{
+    if (NCONSTANTS == 0)
+        gc_register_roots(mark_constants, NULL);
+
+    if (NCONSTANTS >= MAXCONSTANTS) {
+        MAXCONSTANTS = (MAXCONSTANTS == 0) ? 64 : MAXCONSTANTS * 2;
+        CONSTANTS = (Value *) realloc(CONSTANTS, MAXCONSTANTS * sizeof(Value));
+    }
+
+    CONSTANTS[NCONSTANTS++] = value;
+}
+
+
+static void mark_constants()
+{
+    size_t i;
+
+    for (i = 0; i < NCONSTANTS; i++)
+        gc_mark_value(CONSTANTS[i]);
+}
@@ -0,0 +1,20 @@
+#ifndef clox_constant_h
+#define clox_constant_h
+
+#include <stddef.h>
+
+#include "scanner.h"
+#include "value.h"
+
+// Literals are converted to values once, when their node is parsed. Strings
+// become objects shared by every evaluation of the literal, the pool keeps
+// them alive for as long as the AST referring to them. Like the AST, the
+// pool is rewound once a script or REPL line is done with.
+Value new_constant(const Token *literal);
+void add_constant(Value value);
+
+size_t constants_top();
+void constants_reset(size_t top);
+void free_constants();
+
+#endif
@@ -1,30 +1,62 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "dict.h"
+#include "slab.h"
+
+#define GROUP_WIDTH 16
+#define MIN_CAPACITY 4
+
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xfe)
+
+#define H1(hashval) ((hashval) >> 7)
+#define H2(hashval) ((uint8_t) ((hashval) & 0x7f))
 
-#define DEFAULT_SIZE 8
+// Bit i is set when the i-th control byte of the group matches.
+typedef uint32_t GroupMask;
 
-static Entry **new_entries(size_t n);
-static void free_entries(size_t n, Entry **entries);
+static GroupMask group_match(const uint8_t *group, uint8_t h2);
+static GroupMask group_match_empty(const uint8_t *group);
+static GroupMask group_match_free(const uint8_t *group);
 
-static Entry *Entry_New(char *key, void *obj, unsigned hashval);
-static Entry *Entry_Copy(Entry *entry);
-static void Entry_Free(Entry *entry);
+static Entry *find_entry(Dict *dict, const char *key, uint64_t hashval);
+static size_t find_free_slot(Dict *dict, uint64_t hashval);
+static Entry *insert_entry(Dict *dict, uint64_t hashval);
+static void set_ctrl(Dict *dict, size_t idx, uint8_t ctrl);
+static void Dict_Resize(Dict *dict, size_t capacity);
+static char *intern_key(const char *key, uint64_t hashval);
+static uint64_t hash_str(const char *s);
+static void *alloc_mem(size_t size);
+static void free_mem(void *p, size_t size);
 
-static unsigned hash_str(char *s);
-static void Dict_Resize(Dict *dict);
+// Shared by all dicts that haven't stored anything yet, so creating one
+// (e.g. for the fields of every instance) doesn't allocate the table.
+static uint8_t EMPTY_GROUP[GROUP_WIDTH] = {
+    CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY,
+    CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY,
+};
+
+static Dict *KEYS = NULL;
+
+static SlabAllocator SLABS = SLAB_ALLOCATOR("dict");
 
 
 Dict *Dict_New()
 {
-    Dict *dict = (Dict *) malloc(sizeof(Dict));
+    Dict *dict = (Dict *) alloc_mem(sizeof(Dict));
 
-    dict->capacity = DEFAULT_SIZE;
-    dict->entries = new_entries(dict->capacity);
-    dict->fill = 0;
+    dict->ctrl = EMPTY_GROUP;
+    dict->entries = NULL;
+    dict->capacity = 0;
     dict->used = 0;
+    dict->deleted = 0;
 
     return dict;
 }
@@ -32,19 +64,17 @@ Dict *Dict_New()
 
 Dict *Dict_Copy(Dict *dict)
 {
-    unsigned i;
     Dict *copy;
 
-    copy = (Dict *) malloc(sizeof(Dict));
-
-    copy->capacity = dict->capacity;
-    copy->fill = dict->fill;
-    copy->used = dict->used;
+    copy = (Dict *) alloc_mem(sizeof(Dict));
+    *copy = *dict;
 
-    copy->entries = new_entries(copy->capacity);
-    for (i = 0; i < copy->capacity; i++)
-        if (dict->entries[i] != NULL)
-            copy->entries[i] = Entry_Copy(dict->entries[i]);
+    if (dict->capacity > 0) {
+        copy->ctrl = (uint8_t *) alloc_mem(dict->capacity + GROUP_WIDTH);
+        memcpy(copy->ctrl, dict->ctrl, dict->capacity + GROUP_WIDTH);
+        copy->entries = (Entry *) alloc_mem(dict->capacity * sizeof(Entry));
+        memcpy(copy->entries, dict->entries, dict->capacity * sizeof(Entry));
+    }
 
     return copy;
 }
@@ -52,171 +82,336 @@ Dict *Dict_Copy(Dict *dict)
 
 void Dict_Free(Dict *dict)
 {
-    free_entries(dict->capacity, dict->entries);
-    free(dict);
+    if (dict->capacity > 0) {
+        free_mem(dict->ctrl, dict->capacity + GROUP_WIDTH);
+        free_mem(dict->entries, dict->capacity * sizeof(Entry));
+    }
+    free_mem(dict, sizeof(Dict));
 }
 
-static Entry **new_entries(size_t n)
+
+Value Dict_Get(Dict *dict, char *key)
 {
-    return (Entry **) calloc(n, sizeof(Entry *));
+    Entry *entry;
+
+    if ((entry = find_entry(dict, key, hash_str(key))) != NULL)
+        return entry->value;
+
+    return UNDEF_VAL;
 }
 
 
-static void free_entries(size_t n, Entry **entries)
+void Dict_Set(Dict *dict, char *key, Value value)
 {
-    unsigned i;
+    uint64_t hashval;
     Entry *entry;
 
-    for (i = 0; i < n; i++) {
-        if ((entry = entries[i]) != NULL)
-            Entry_Free(entry);
-        entries[i] = NULL;
+    hashval = hash_str(key);
+
+    if ((entry = find_entry(dict, key, hashval)) != NULL) {
+        entry->value = value;
+        return;
     }
+
+    key = intern_key(key, hashval);
+
+    entry = insert_entry(dict, hashval);
+    entry->key = key;
+    entry->value = value;
 }
 
 
-static Entry *Entry_New(char *key, void *value, unsigned hashval)
-{ 
+// Removed entries leave a tombstone, so that probe sequences running
+// through the slot keep going. Tombstones are reused by later inserts and
+// dropped when the table is rehashed.
+bool Dict_Delete(Dict *dict, char *key)
+{
     Entry *entry;
 
-    entry = (Entry *) malloc(sizeof(Entry));
+    if ((entry = find_entry(dict, key, hash_str(key))) == NULL)
+        return false;
 
-    entry->key = strdup(key);
-    entry->value = value;
-    entry->hashval = hashval;
-    entry->deleted = false;
+    set_ctrl(dict, entry - dict->entries, CTRL_DELETED);
+    dict->used--;
+    dict->deleted++;
 
-    return entry;
+    return true;
 }
 
 
-static Entry *Entry_Copy(Entry *entry)
+bool Dict_Next(Dict *dict, size_t *pos, char **key, Value *value)
 {
-    Entry *copy;
+    Entry *entry;
 
-    copy = (Entry *) malloc(sizeof(Entry));
+    while (*pos < dict->capacity) {
+        if (dict->ctrl[*pos] & CTRL_EMPTY) {
+            (*pos)++;
+            continue;
+        }
+        entry = &dict->entries[(*pos)++];
+        if (key != NULL)
+            *key = entry->key;
+        if (value != NULL)
+            *value = entry->value;
+        return true;
+    }
 
-    copy->key = strdup(entry->key);
-    copy->value = entry->value;
-    copy->hashval = entry->hashval;
-    copy->deleted = entry->deleted;
+    return false;
+}
 
-    return copy;
+
+// Returns the interned copy of key, which stays valid until exit.
+char *Dict_Intern(const char *key)
+{
+    return intern_key(key, hash_str(key));
+}
+
+
+// Interned keys outlive every dict, so they go last, once nothing can refer
+// to them.
+void Dict_FreeKeys()
+{
+    size_t pos = 0;
+    char *key;
+
+    if (KEYS == NULL)
+        return;
+
+    while (Dict_Next(KEYS, &pos, &key, NULL))
+        free(key);
+
+    Dict_Free(KEYS);
+    KEYS = NULL;
+}
+
+
+#ifdef __SSE2__
+
+static GroupMask group_match(const uint8_t *group, uint8_t h2)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+
+static GroupMask group_match_empty(const uint8_t *group)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) CTRL_EMPTY)));
+}
+
+
+// Both EMPTY and DELETED have the high bit set, full slots don't.
+static GroupMask group_match_free(const uint8_t *group)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+
+#else
+
+static GroupMask group_match(const uint8_t *group, uint8_t h2)
+{
+    unsigned i;
+    GroupMask mask = 0;
+
+    for (i = 0; i < GROUP_WIDTH; i++)
+        if (group[i] == h2)
+            mask |= (GroupMask) 1 << i;
+
+    return mask;
 }
 
 
-static void Entry_Free(Entry *entry)
+static GroupMask group_match_empty(const uint8_t *group)
 {
-    free(entry->key);
-    // I don't think dict should free its values
-    // free(entry->value);
-    free(entry);
+    return group_match(group, CTRL_EMPTY);
 }
 
 
-void *Dict_Get(Dict *dict, char *key)
+static GroupMask group_match_free(const uint8_t *group)
 {
-    unsigned idx, hashval;
+    unsigned i;
+    GroupMask mask = 0;
+
+    for (i = 0; i < GROUP_WIDTH; i++)
+        if (group[i] & CTRL_EMPTY)
+            mask |= (GroupMask) 1 << i;
+
+    return mask;
+}
+
+#endif
+
+
+static unsigned lowest_bit(GroupMask mask)
+{
+    return __builtin_ctz(mask);
+}
+
+
+// Groups are probed triangularly, which visits every group once the
+// capacity is a power of two. The control bytes of the first group are
+// mirrored past the end so a group can be loaded at any position.
+static Entry *find_entry(Dict *dict, const char *key, uint64_t hashval)
+{
+    size_t mask, pos, stride, idx;
+    GroupMask match;
     Entry *entry;
 
-    hashval = hash_str(key);
-    idx = hashval % dict->capacity;
+    mask = (dict->capacity > 0) ? dict->capacity - 1 : 0;
+    pos = H1(hashval) & mask;
+
+    for (stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        match = group_match(dict->ctrl + pos, H2(hashval));
+        while (match != 0) {
+            idx = (pos + lowest_bit(match)) & mask;
+            entry = &dict->entries[idx];
+            if (entry->hashval == hashval && (entry->key == key || strcmp(entry->key, key) == 0))
+                return entry;
+            match &= match - 1;
+        }
+
+        if (group_match_empty(dict->ctrl + pos) != 0)
+            return NULL;
 
-    while ((entry = dict->entries[idx]) != NULL) {
-        if (!entry->deleted && entry->hashval == hashval && strcmp(entry->key, key) == 0)
-            return entry->value;
-        idx = (idx + 1) % dict->capacity;
+        pos = (pos + stride) & mask;
     }
+}
+
+
+// Tables smaller than a group fit in the first group loaded, past that it
+// only holds the mirrored bytes and EMPTY padding, which must not be taken
+// for free slots.
+static size_t find_free_slot(Dict *dict, uint64_t hashval)
+{
+    size_t mask, pos, stride;
+    GroupMask match, valid;
 
-    return NULL;
+    mask = dict->capacity - 1;
+    pos = H1(hashval) & mask;
+    valid = (dict->capacity < GROUP_WIDTH) ? ((GroupMask) 1 << dict->capacity) - 1 : ~(GroupMask) 0;
+
+    for (stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+        if ((match = group_match_free(dict->ctrl + pos) & valid) != 0)
+            return (pos + lowest_bit(match)) & mask;
+
+        pos = (pos + stride) & mask;
+    }
 }
 
 
-void Dict_Set(Dict *dict, char *key, void *value)
+// Keeps at least an eighth of the slots empty, counting tombstones as
+// used: lookups stop at the first group with an empty slot.
+static Entry *insert_entry(Dict *dict, uint64_t hashval)
 {
-    unsigned idx, target_idx, hashval;
-    bool seen;
+    size_t idx;
     Entry *entry;
 
-    seen = false;
-    hashval = hash_str(key);
-    idx = hashval % dict->capacity;
+    if (dict->capacity == 0) {
+        Dict_Resize(dict, MIN_CAPACITY);
+    } else if ((dict->used + dict->deleted + 1) * 8 > dict->capacity * 7) {
+        // mostly tombstones: rehashing in place reclaims them
+        if (dict->used * 2 < dict->capacity * 7 / 8)
+            Dict_Resize(dict, dict->capacity);
+        else
+            Dict_Resize(dict, dict->capacity * 2);
+    }
 
-    while ((entry = dict->entries[idx]) != NULL) {
-        if ((entry->hashval == hashval) && (strcmp(entry->key, key) == 0)) {
-            seen = true;
-            target_idx = idx;
-            break;
-        }
-        if (!seen && entry->deleted)
-            target_idx = idx;
-        idx = (idx + 1) % dict->capacity;
+    idx = find_free_slot(dict, hashval);
+
+    if (dict->ctrl[idx] == CTRL_DELETED)
+        dict->deleted--;
+    set_ctrl(dict, idx, H2(hashval));
+    dict->used++;
+
+    entry = &dict->entries[idx];
+    entry->hashval = hashval;
+
+    return entry;
+}
+
+
+static void set_ctrl(Dict *dict, size_t idx, uint8_t ctrl)
+{
+    dict->ctrl[idx] = ctrl;
+    if (idx < GROUP_WIDTH)
+        dict->ctrl[dict->capacity + idx] = ctrl;
+}
+
+
+static void Dict_Resize(Dict *dict, size_t capacity)
+{
+    size_t i, idx, old_capacity;
+    uint8_t *old_ctrl;
+    Entry *old_entries;
+
+    old_ctrl = dict->ctrl;
+    old_entries = dict->entries;
+    old_capacity = dict->capacity;
+
+    dict->ctrl = (uint8_t *) alloc_mem(capacity + GROUP_WIDTH);
+    memset(dict->ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+    dict->entries = (Entry *) alloc_mem(capacity * sizeof(Entry));
+    dict->capacity = capacity;
+    dict->deleted = 0;
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_ctrl[i] & CTRL_EMPTY)
+            continue;
+        idx = find_free_slot(dict, old_entries[i].hashval);
+        set_ctrl(dict, idx, old_ctrl[i]);
+        dict->entries[idx] = old_entries[i];
     }
 
-    if (!seen) 
-        target_idx = idx;
-
-    if (dict->entries[target_idx] == NULL) {
-        dict->fill++;
-        dict->used++;
-        dict->entries[target_idx] = Entry_New(key, value, hashval);
-    } else if (dict->entries[target_idx]->deleted) {
-        dict->used++;
-        dict->entries[target_idx]->value = value;
-        dict->entries[target_idx]->deleted = false;
-    } else {
-        dict->entries[target_idx]->value = value;
+    if (old_capacity > 0) {
+        free_mem(old_ctrl, old_capacity + GROUP_WIDTH);
+        free_mem(old_entries, old_capacity * sizeof(Entry));
     }
- 
-    if (3 * dict->fill >= 2 * dict->capacity)
-        Dict_Resize(dict);
-}
-
-
-static void Dict_Resize(Dict *dict)
-{
-    unsigned i, idx;
-    size_t capacity;
-    Entry *entry, **entries;
-
-    capacity = dict->capacity;
-    if (capacity >= dict->used && dict->used > DEFAULT_SIZE)
-        while (capacity >= dict->used)
-            capacity /= 2;
-    else
-        while (capacity < dict->used)
-            capacity *= 2;
-
-    entries = new_entries(capacity);
-    
-    for (i = 0; i < dict->capacity; i++)
-        if ((entry = dict->entries[i]) != NULL) {
-            if (!entry->deleted) {
-                idx = entry->hashval % capacity;
-                while (entries[idx] != NULL)
-                    idx = (idx + 1) % capacity;
-                entries[idx] = entry;
-            } else {
-                dict->entries[i] = NULL;
-                Entry_Free(entry);
-            }
-        }
+}
 
-    free(dict->entries);
 
-    dict->entries = entries;
-    dict->capacity = capacity;
-    dict->fill = dict->used;
-    dict->used = capacity;
+// The pool of interned keys is itself a dict, whose entries own their key.
+static char *intern_key(const char *key, uint64_t hashval)
+{
+    Entry *entry;
+
+    if (KEYS == NULL)
+        KEYS = Dict_New();
+
+    if ((entry = find_entry(KEYS, key, hashval)) != NULL)
+        return entry->key;
+
+    entry = insert_entry(KEYS, hashval);
+    entry->key = strdup(key);
+    entry->value = NIL_VAL;
+
+    return entry->key;
 }
 
 
-static unsigned hash_str(char *s) 
+// FNV-1a
+static uint64_t hash_str(const char *s)
 {
-    unsigned hashval;
+    uint64_t hashval;
 
-    for (hashval = 0; *s != '\0'; s++)
-        hashval = *s + 31 * hashval;
+    for (hashval = 0xcbf29ce484222325ULL; *s != '\0'; s++) {
+        hashval ^= (uint8_t) *s;
+        hashval *= 0x100000001b3ULL;
+    }
 
     return hashval;
 }
+
+
+static void *alloc_mem(size_t size)
+{
+    return slab_alloc(&SLABS, slab_class(size), size);
+}
+
+
+static void free_mem(void *p, size_t size)
+{
+    slab_free(&SLABS, slab_class(size), p);
+}
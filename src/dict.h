@@ -2,31 +2,44 @@
 #define clox_dict_h
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-#define DICT_GET(type, dict, name) (type *) Dict_Get(dict, name)
-#define DICT_SET(dict, name, value) Dict_Set(dict, name, (void *) value)
+#include "value.h"
 
+#define DICT_GET(type, dict, name) ((type *) AS_PTR(Dict_Get(dict, name)))
+#define DICT_SET(dict, name, value) Dict_Set(dict, name, OBJ_VAL(value))
+
+// Keys are interned: every distinct key is copied once for the lifetime of
+// the program and shared by all dicts that contain it.
 typedef struct {
     char *key;
-    void *value;
-    unsigned hashval;
-    bool deleted;
+    uint64_t hashval;
+    Value value;
 } Entry;
 
 
+// Open addressing in the style of Swiss tables: a control byte per slot
+// holds either the low 7 bits of the slot's hash or an EMPTY/DELETED marker,
+// and lookups compare a whole group of control bytes at once.
 typedef struct {
-    Entry **entries;
+    uint8_t *ctrl;
+    Entry *entries;
     size_t capacity;
-    unsigned fill;
-    unsigned used;
+    size_t used;
+    size_t deleted;
 } Dict;
 
 Dict *Dict_New();
 Dict *Dict_Copy(Dict *dict);
 void Dict_Free();
 
-void *Dict_Get(Dict *d, char *key);
-void Dict_Set(Dict *d, char *key, void *value);
+Value Dict_Get(Dict *d, char *key);
+void Dict_Set(Dict *d, char *key, Value value);
+bool Dict_Delete(Dict *d, char *key);
+bool Dict_Next(Dict *d, size_t *pos, char **key, Value *value);
+
+char *Dict_Intern(const char *key);
+void Dict_FreeKeys();
 
 #endif
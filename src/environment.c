@@ -1,98 +1,124 @@
 #include <stdlib.h>
 
-#include "dict.h"
 #include "environment.h"
-#include "logger.h"
+#include "gc.h"
 #include "loxobj.h"
 
+#define MAX_FRAME 8
 
-LoxEnv *new_env()
-{
-    LoxEnv *env = (LoxEnv *) malloc(sizeof(LoxEnv));
-
-    env->next = NULL;
-    env->storage = Dict_New();
+static LoxEnv *alloc_env(unsigned capacity);
 
-    return env;
-}
+// Disclosed envs, by capacity, to be reused for the next frames. They are
+// unreachable, so the lists are dropped whenever the collector marks.
+static LoxEnv *FRAMES[MAX_FRAME];
 
 
-LoxEnv *env_copy(LoxEnv *env)
+LoxEnv *enclose_env(LoxEnv *env, unsigned capacity)
 {
-    LoxEnv *copy = (LoxEnv *) malloc(sizeof(LoxEnv));
+    LoxEnv *local_env;
 
-    copy->next = NULL;
-    if (env->next != NULL)
-        copy->next = env_copy(env->next);
+    GC_PUSH(env);
+    local_env = alloc_env(capacity);
+    GC_POP(1);
 
-    // don't copy global ENV;
-    if (env->next == NULL)
-        copy->storage = env->storage;
-    else
-        copy->storage = Dict_Copy(env->storage);
+    local_env->next = env;
 
-    return copy;
+    return local_env;
 }
 
 
-void free_env(LoxEnv *env)
+// Closes the upvalues captured from this env, so closures outliving
+// the scope keep their own copy of the variable. The env is dead then, its
+// slots are dropped: they may point into a call region about to be freed.
+// Small envs are kept for the next frame of the same size.
+LoxEnv *disclose_env(LoxEnv *env)
 {
-    Dict_Free(env->storage);
-    free(env);
+    LoxEnv *enclosing;
+    LoxObj *upvalue, *next;
+
+    for (upvalue = env->open; upvalue != NULL; upvalue = next) {
+        next = upvalue->upvalue.next;
+        upvalue->upvalue.closed = *upvalue->upvalue.location;
+        upvalue->upvalue.location = &upvalue->upvalue.closed;
+        upvalue->upvalue.next = NULL;
+        GC_BARRIER(upvalue);
+    }
+    env->open = NULL;
+    env->n = 0;
+
+    enclosing = env->next;
+    if (env->capacity < MAX_FRAME) {
+        env->next = FRAMES[env->capacity];
+        FRAMES[env->capacity] = env;
+    }
+
+    return enclosing;
 }
 
 
-LoxEnv *enclose_env(LoxEnv *env)
+void free_frames()
 {
-    LoxEnv *local_env = new_env();
-
-    local_env->next = env;
+    unsigned i;
 
-    return local_env;
+    for (i = 0; i < MAX_FRAME; i++)
+        FRAMES[i] = NULL;
 }
 
 
-LoxEnv *disclose_env(LoxEnv *env)
+void env_def(LoxEnv *env, Value value)
 {
-    LoxEnv *e = env->next;
-
-    env->next = NULL;
-    free_env(env);
-
-    return e;
+    if (env->n < env->capacity)
+        env->slots[env->n++] = value;
+    GC_BARRIER(env);
 }
 
 
-int env_assign(LoxEnv *env, char *name, LoxObj *obj)
+LoxEnv *env_ancestor(LoxEnv *env, unsigned depth)
 {
-    LoxEnv *e;
-    LoxObj *o;
+    while (depth--)
+        env = env->next;
 
-    for (e = env; e != NULL; e = e->next)
-        if ((o = DICT_GET(LoxObj, e->storage, name)) != NULL) {
-            DICT_SET(e->storage, name, obj);
-            return 0;
-        }
-
-    log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", name);
-    return 1;
+    return env;
 }
 
 
-void env_def(LoxEnv *env, char *name, LoxObj *obj)
+// Variables captured by several closures share one upvalue.
+LoxObj *env_capture(LoxEnv *env, unsigned slot)
 {
-    DICT_SET(env->storage, name, obj);
+    LoxObj *upvalue;
+
+    for (upvalue = env->open; upvalue != NULL; upvalue = upvalue->upvalue.next)
+        if (upvalue->upvalue.location == &env->slots[slot])
+            return upvalue;
+
+    upvalue = new_upvalue_obj(&env->slots[slot]);
+    upvalue->upvalue.next = env->open;
+    env->open = upvalue;
+    GC_BARRIER(env);
+
+    return upvalue;
 }
 
 
-LoxObj *env_get(LoxEnv *env, char *name)
+static LoxEnv *alloc_env(unsigned capacity)
 {
-    LoxEnv *e;
-    LoxObj *o;
+    unsigned i;
+    LoxEnv *env;
 
-    for (e = env; e != NULL; e = e->next)
-        if ((o = DICT_GET(LoxObj, e->storage, name)) != NULL)
-            return o;
+    if (capacity < MAX_FRAME && (env = FRAMES[capacity]) != NULL) {
+        FRAMES[capacity] = env->next;
+        GC_BARRIER(env);    // it may be old
+    } else {
+        env = (LoxEnv *) gc_alloc(sizeof(LoxEnv) + capacity * sizeof(Value), GC_KIND_ENV);
+        gc_register_roots(free_frames, NULL);
+    }
 
-    return NULL;
+    env->next = NULL;
+    env->open = NULL;
+    env->n = 0;
+    env->capacity = capacity;
+    for (i = 0; i < capacity; i++)
+        env->slots[i] = UNDEF_VAL;
+
+    return env;
 }
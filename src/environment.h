@@ -1,23 +1,39 @@
 #ifndef clox_environment_h
 #define clox_environment_h
 
-#include "dict.h"
+#include "gc.h"
 #include "loxobj.h"
+#include "value.h"
 
+// Environments hold the locals of a call or block in a fixed array of slots
+// whose indices are computed by the resolver, globals are kept apart (see
+// globals.h). Closures don't keep environments alive: they capture single
+// slots through upvalues, which are listed in 'open' until the environment
+// is disclosed.
 typedef struct loxenv {
+    GCObj gc;
     struct loxenv *next;
-    Dict *storage;
+    LoxObj *open;
+    unsigned n;
+    unsigned capacity;
+    Value slots[];
 } LoxEnv;
 
-LoxEnv *new_env();
-LoxEnv *env_copy();
-void free_env(LoxEnv *env);
-
-LoxEnv *enclose_env(LoxEnv *env);
+LoxEnv *enclose_env(LoxEnv *env, unsigned capacity);
 LoxEnv *disclose_env(LoxEnv *env);
+void free_frames();
+
+void env_def(LoxEnv *env, Value value);
+
+LoxEnv *env_ancestor(LoxEnv *env, unsigned depth);
+LoxObj *env_capture(LoxEnv *env, unsigned slot);
 
-int env_assign(LoxEnv *env, char *name, LoxObj *obj);
-void env_def(LoxEnv *env, char *name, LoxObj *obj);
-LoxObj *env_get(LoxEnv *env, char *name);
+#define ENV_GET_AT(env, depth, slot) (env_ancestor(env, depth)->slots[slot])
+#define ENV_SET_AT(env, depth, slot, value) \
+    do { \
+        LoxEnv *ancestor_ = env_ancestor(env, depth); \
+        ancestor_->slots[slot] = (value); \
+        GC_BARRIER(ancestor_); \
+    } while (0)
 
 #endif
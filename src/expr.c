@@ -1,8 +1,12 @@
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "cache.h"
+#include "constant.h"
 #include "expr.h"
 #include "scanner.h"
 
@@ -17,23 +21,26 @@ static int join_expr(
 );
 
 
-Expr *new_assign_expr(Token *name, Expr *value)
+Expr *new_assign_expr(Arena *arena, Token *name, Expr *value)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_ASSIGN;
     expr->assign.name = name;
     expr->assign.value = value;
+    expr->assign.bind.depth = EXPR_GLOBAL;
+    expr->assign.bind.slot = 0;
 
     return expr;
 }
 
 
-Expr *new_binary_expr(Expr *left, Token *op, Expr *right)
+Expr *new_binary_expr(Arena *arena, Expr *left, Token *op, Expr *right)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_BINARY;
+    expr->local = false;
     expr->binary.left = left;
     expr->binary.op = op;
     expr->binary.right = right;
@@ -42,11 +49,12 @@ Expr *new_binary_expr(Expr *left, Token *op, Expr *right)
 }
 
 
-Expr *new_call_expr(Expr *callee, Token *paren, size_t argc, Expr **args)
+Expr *new_call_expr(Arena *arena, Expr *callee, Token *paren, size_t argc, Expr **args)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_CALL;
+    expr->local = false;
     expr->call.callee = callee;
     expr->call.paren = paren;
     expr->call.argc = argc;
@@ -56,21 +64,23 @@ Expr *new_call_expr(Expr *callee, Token *paren, size_t argc, Expr **args)
 }
 
 
-Expr *new_get_expr(Token *name, Expr *object)
+Expr *new_get_expr(Arena *arena, Token *name, Expr *object)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_GET;
+    expr->local = false;
     expr->get.name = name;
     expr->get.object = object;
+    expr->get.cache = ic_new(arena, "get", name);
 
     return expr;
 }
 
 
-Expr *new_grouping_expr(Expr *group)
+Expr *new_grouping_expr(Arena *arena, Expr *group)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_GROUPING;
     expr->grouping = group;
@@ -79,20 +89,21 @@ Expr *new_grouping_expr(Expr *group)
 }
 
 
-Expr *new_literal_expr(Token *literal)
+Expr *new_literal_expr(Arena *arena, Token *literal)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_LITERAL;
-    expr->literal = literal;
+    expr->literal.token = literal;
+    expr->literal.value = new_constant(literal);
 
     return expr;
 }
 
 
-Expr *new_logic_expr(Expr *left, Token *op, Expr *right)
+Expr *new_logic_expr(Arena *arena, Expr *left, Token *op, Expr *right)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_LOGIC;
     expr->binary.left = left;
@@ -103,20 +114,23 @@ Expr *new_logic_expr(Expr *left, Token *op, Expr *right)
 }
 
 
-Expr *new_this_expr(Token *keyword)
+Expr *new_this_expr(Arena *arena, Token *keyword)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_THIS;
-    expr->keyword = keyword;
+    expr->var.name = keyword;
+    expr->var.bind.depth = EXPR_GLOBAL;
+    expr->var.bind.slot = 0;
+    expr->var.decl = NULL;
 
     return expr;
 }
 
 
-Expr *new_unary_expr(Token *op, Expr *right)
+Expr *new_unary_expr(Arena *arena, Token *op, Expr *right)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_UNARY;
     expr->unary.op = op;
@@ -126,86 +140,51 @@ Expr *new_unary_expr(Token *op, Expr *right)
 }
 
 
-Expr *new_set_expr(Token *name, Expr *object, Expr *value)
+Expr *new_set_expr(Arena *arena, Token *name, Expr *object, Expr *value)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_SET;
     expr->set.name = name;
     expr->set.object = object;
     expr->set.value = value;
+    expr->set.cache = ic_new(arena, "set", name);
 
     return expr;
 }
 
 
-Expr *new_super_expr(Token *keyword, Token *method)
+Expr *new_super_expr(Arena *arena, Token *keyword, Token *method)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_SUPER;
+    expr->local = false;
     expr->super.keyword = keyword;
     expr->super.method = method;
+    expr->super.bind.depth = EXPR_GLOBAL;
+    expr->super.bind.slot = 0;
+    expr->super.this.depth = EXPR_GLOBAL;
+    expr->super.this.slot = 0;
 
     return expr;
 }
 
 
-Expr *new_var_expr(Token *name)
+Expr *new_var_expr(Arena *arena, Token *name)
 {
-    Expr *expr = (Expr *) malloc(sizeof(Expr));
+    Expr *expr = (Expr *) arena_alloc(arena, sizeof(Expr));
 
     expr->type = EXPR_VAR;
-    expr->varname = name;
+    expr->var.name = name;
+    expr->var.bind.depth = EXPR_GLOBAL;
+    expr->var.bind.slot = 0;
+    expr->var.decl = NULL;
 
     return expr;
 }
 
 
-void free_expr(Expr *expr)
-{
-    unsigned i;
-
-    switch (expr->type) {
-        case EXPR_ASSIGN:
-            free_expr(expr->assign.value);
-            break;
-        case EXPR_BINARY:
-        case EXPR_LOGIC:
-            free_expr(expr->binary.left);
-            free_expr(expr->binary.right);
-            break;
-        case EXPR_CALL:
-            free_expr(expr->call.callee);
-            if (expr->call.args != NULL) {
-                for (i = 0; i < expr->call.argc; i++)
-                    free_expr(expr->call.args[i]);
-                free(expr->call.args);
-            }
-            break;
-        case EXPR_GET:
-            free_expr(expr->get.object);
-            break;
-        case EXPR_GROUPING:
-            free_expr(expr->grouping);
-            break;
-        case EXPR_SET:
-            free_expr(expr->set.object);
-            free_expr(expr->set.value);
-            break;
-        case EXPR_SUPER:
-            break;
-        case EXPR_UNARY:
-            free_expr(expr->unary.right);
-            break;
-        default:
-            break;
-    }
-
-    free(expr);
-}
-
-
 void print_expr(const Expr *expr)
 {
     char *s;
@@ -242,12 +221,12 @@ static int _str_expr(char *s, unsigned len, size_t *maxlen, const Expr *expr)
             return join_expr(s, len, maxlen, "group",
                             1, expr->grouping);
         case EXPR_LITERAL:
-            return join_expr(s, len, maxlen, expr->literal->lexeme, 0);
+            return join_expr(s, len, maxlen, expr->literal.token->lexeme, 0);
         case EXPR_UNARY:
             return join_expr(s, len, maxlen, expr->unary.op->lexeme,
                             1, expr->unary.right);
         case EXPR_VAR:
-            return join_expr(s, len, maxlen, expr->varname->lexeme, 0);
+            return join_expr(s, len, maxlen, expr->var.name->lexeme, 0);
         default:
             return len;
     }
@@ -1,7 +1,14 @@
 #ifndef clox_expr_h
 #define clox_expr_h
 
+#include <stdbool.h>
+
+#include "arena.h"
 #include "scanner.h"
+#include "value.h"
+
+struct inlinecache;  // forward declaration for InlineCache
+struct stmt;
 
 enum ExprType {
     EXPR_ASSIGN = 0,
@@ -19,38 +26,53 @@ enum ExprType {
 };
 
 
+// Variable references are annotated by the resolver with the number of
+// environments to walk up (depth) and the slot within that environment.
+// A depth of EXPR_GLOBAL means slot indexes the global table (see globals.h),
+// EXPR_UPVALUE means it indexes the upvalues of the running closure.
+// References to a local declared by 'var' also point at the declaration.
+#define EXPR_GLOBAL -1
+#define EXPR_UPVALUE -2
+
+typedef struct {
+    int depth;
+    unsigned slot;
+} Binding;
+
+
+// Allocating expressions (string concatenation, class calls and bound
+// methods) are flagged 'local' by the resolver if their value can't
+// outlive the call frame, see gc_alloc_local().
 typedef struct expr {
     enum ExprType type;
+    bool local;
     union {
-        struct { Token *name; struct expr *value; } assign;
+        struct { Token *name; struct expr *value; Binding bind; } assign;
         struct { struct expr *left; Token *op; struct expr *right; } binary;
         struct { struct expr *callee; Token *paren; size_t argc; struct expr **args; } call;
-        struct { Token *name; struct expr *object; } get;
+        struct { Token *name; struct expr *object; struct inlinecache *cache; } get;
         struct expr *grouping;
-        Token *literal;
-        Token *keyword;
-        struct { Token *name; struct expr *object; struct expr *value; } set;
-        struct { Token *keyword; Token *method; } super;
+        struct { Token *token; Value value; } literal;
+        struct { Token *name; struct expr *object; struct expr *value; struct inlinecache *cache; } set;
+        struct { Token *keyword; Token *method; Binding bind; Binding this; } super;
         struct { Token *op; struct expr *right; } unary;
-        Token *varname;
+        struct { Token *name; Binding bind; struct stmt *decl; } var;
     };
 } Expr;
 
 
-Expr *new_assign_expr(Token *name, Expr *value);
-Expr *new_binary_expr(Expr *left, Token *op, Expr *right);
-Expr *new_call_expr(Expr *callee, Token *paren, size_t argc, Expr **args);
-Expr *new_get_expr(Token *name, Expr *object);
-Expr *new_grouping_expr(Expr *expr);
-Expr *new_literal_expr(Token *literal);
-Expr *new_logic_expr(Expr *left, Token *op, Expr *right);
-Expr *new_set_expr(Token *name, Expr *object, Expr *value);
-Expr *new_super_expr(Token *keyword, Token *method);
-Expr *new_this_expr(Token *keyword);
-Expr *new_unary_expr(Token *op, Expr *right);
-Expr *new_var_expr(Token *name);
-
-void free_expr(Expr *expr);
+Expr *new_assign_expr(Arena *arena, Token *name, Expr *value);
+Expr *new_binary_expr(Arena *arena, Expr *left, Token *op, Expr *right);
+Expr *new_call_expr(Arena *arena, Expr *callee, Token *paren, size_t argc, Expr **args);
+Expr *new_get_expr(Arena *arena, Token *name, Expr *object);
+Expr *new_grouping_expr(Arena *arena, Expr *expr);
+Expr *new_literal_expr(Arena *arena, Token *literal);
+Expr *new_logic_expr(Arena *arena, Expr *left, Token *op, Expr *right);
+Expr *new_set_expr(Arena *arena, Token *name, Expr *object, Expr *value);
+Expr *new_super_expr(Arena *arena, Token *keyword, Token *method);
+Expr *new_this_expr(Arena *arena, Token *keyword);
+Expr *new_unary_expr(Arena *arena, Token *op, Expr *right);
+Expr *new_var_expr(Arena *arena, Token *name);
 
 
 void print_expr(const Expr *expr);
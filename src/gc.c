@@ -0,0 +1,1356 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dict.h"
+#include "environment.h"
+#include "gc.h"
+#include "loxobj.h"
+#include "slab.h"
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_SLICE_BYTES (32 * 1024)      // allocated between two mark slices
+#define GC_MAX_ROOT_HOOKS 8
+#define GC_HISTOGRAM_BUCKETS 24
+#define GC_MAX_THREADS 64
+#define GC_DEQUE_SIZE 1024
+#define GC_REGION_SIZE (1024 * 1024)    // held by all call regions at most
+
+// Define to collect before every allocation (useful to find missing roots
+// and write barriers), with a major collection every GC_STRESS_MAJOR. An
+// incremental one then marks a single object per allocation, and the heap
+// is compacted at the first safepoint after each major one.
+// #define DEBUG_STRESS_GC
+#define GC_STRESS_MAJOR 16
+
+#ifdef DEBUG_STRESS_GC
+#define GC_SLICE_CHECK 1
+#define GC_SWEEP_STEP 1
+#define GC_COMPACT_THRESHOLD 0
+#define GC_COMPACT_MIN_HEAP SLAB_SIZE
+#else
+#define GC_SLICE_CHECK 32               // objects marked between clock reads
+#define GC_SWEEP_STEP 64                // old objects swept per allocation
+#define GC_COMPACT_THRESHOLD 0.25       // share of the slabs left unused
+#define GC_COMPACT_MIN_HEAP (1024 * 1024) // of slabs
+#endif
+
+typedef struct {
+    GCObj **items;
+    size_t n;
+    size_t capacity;
+} GCStack;
+
+// A Chase-Lev work-stealing deque: its marker pushes and takes at the
+// bottom, the others steal from the top. Buffers outgrown during a
+// collection are freed once it's over, thieves may still read them.
+typedef struct gcbuf {
+    struct gcbuf *prev;
+    long capacity;
+    GCObj *items[];
+} GCBuf;
+
+typedef struct {
+    long top;
+    char pad[64 - sizeof(long)];    // thieves write 'top', keep it apart
+    long bottom;
+    GCBuf *buf;
+    unsigned id;
+    bool started;
+    pthread_t thread;
+} Marker;
+
+static void gc_stack_push(GCStack *stack, GCObj *obj);
+
+static void parallel_trace();
+static void *mark_worker(void *arg);
+static GCObj *steal_work(Marker *marker);
+static bool is_marking_done();
+static bool has_work();
+static void deque_push(Marker *marker, GCObj *obj);
+static GCObj *deque_take(Marker *marker);
+static GCObj *deque_steal(Marker *marker);
+static GCBuf *deque_grow(Marker *marker, long top, long bottom);
+
+static void collect(bool major);
+static void start_marking();
+static void mark_slice();
+static void finish_marking(double start);
+static void sweep(bool major);
+static void record_pause(double start);
+static int compare_pauses(const void *a, const void *b);
+static void mark_roots();
+static void mark_remembered();
+static void trace_refs();
+static void blacken(GCObj *obj);
+static void blacken_obj(LoxObj *obj);
+static void blacken_env(LoxEnv *env);
+static void mark_dict(Dict *dict);
+static void sweep_step();
+static void finish_sweep();
+static void sweep_old(size_t n);
+static void sweep_young();
+static void free_gcobj(GCObj *obj);
+static void release_gcobj(GCObj *obj);
+static void compact();
+static void pin_roots();
+static GCObj *move(GCObj *obj);
+static void move_refs(GCObj *obj);
+static void move_obj_refs(LoxObj *obj);
+static void move_env_refs(LoxEnv *env);
+static void move_dict(Dict *dict);
+static double fragmentation(size_t *reserved);
+static size_t resident_bytes();
+static double now();
+
+#define SLABS(obj) ((obj)->kind == GC_KIND_ENV ? &ENV_SLABS : &OBJ_SLABS)
+#define MOVED(ptr) ((void *) gc_moved((GCObj *) (ptr)))
+
+static SlabAllocator OBJ_SLABS = SLAB_ALLOCATOR("obj");
+static SlabAllocator ENV_SLABS = SLAB_ALLOCATOR("env");
+
+// Objects don't move when they are promoted, they are just relinked
+// from one list to the other.
+static GCObj *YOUNG = NULL;
+static GCObj *OLD = NULL;
+static GCObj *UNSWEPT = NULL;   // old objects a lazy sweep has yet to look at
+static GCStack GRAY = { NULL, 0, 0 };
+static GCStack ROOTS = { NULL, 0, 0 };
+static GCStack REMEMBERED = { NULL, 0, 0 };
+
+static Arena REGION = ARENA_INIT;
+static GCObj *REGION_OBJECTS = NULL;
+static size_t REGION_BYTES = 0;
+static unsigned REGION_DEPTH = 0;
+
+static gc_roots_t ROOT_HOOKS[GC_MAX_ROOT_HOOKS];
+static gc_roots_t MOVE_HOOKS[GC_MAX_ROOT_HOOKS];
+static unsigned NHOOKS = 0;
+
+static size_t YOUNG_BYTES = 0;
+static size_t OLD_BYTES = 0;
+static size_t NEXT_MAJOR = GC_MIN_HEAP;
+static size_t NEXT_SLICE = 0;
+static bool MINOR = false;
+static bool MARKING = false;
+static unsigned BUDGET = 0;     // microseconds per mark slice, 0 to stop the world
+static bool LAZY_SWEEP = true;
+static bool COMPACT = false;
+static bool COMPACT_DUE = false;    // a major collection has been swept since
+static bool PINNING = false;        // gc_mark() pins instead
+
+static Marker *MARKERS = NULL;
+static unsigned MAXMARKERS = 0;
+static unsigned NTHREADS = 1;
+static unsigned NMARKERS = 0;   // markers running
+static unsigned IDLE = 0;       // markers out of work
+static __thread Marker *MARKER = NULL;
+
+static double *PAUSES = NULL;
+static size_t NPAUSES = 0;
+static size_t MAXPAUSES = 0;
+
+static GCStats STATS;
+
+
+void *gc_alloc(size_t size, enum GCObjKind kind)
+{
+    GCObj *obj;
+    unsigned cls;
+
+    if (UNSWEPT != NULL)
+        sweep_step();
+
+#ifdef DEBUG_STRESS_GC
+    if (MARKING)
+        mark_slice();
+    else if ((STATS.collections + 1) % GC_STRESS_MAJOR != 0)
+        collect(false);
+    else if (BUDGET > 0)
+        start_marking();
+    else
+        collect(true);
+#else
+    if (MARKING) {
+        if (YOUNG_BYTES + size > NEXT_SLICE)
+            mark_slice();
+    } else if (YOUNG_BYTES + size > GC_NURSERY_SIZE) {
+        // the old generation only shrinks back once it's swept
+        bool major = (UNSWEPT == NULL && OLD_BYTES > NEXT_MAJOR);
+        collect(major && BUDGET == 0);
+        if (major && BUDGET > 0)
+            start_marking();
+    }
+#endif
+
+    cls = slab_class(size);
+    obj = (GCObj *) slab_alloc(kind == GC_KIND_ENV ? &ENV_SLABS : &OBJ_SLABS, cls, size);
+
+    obj->kind = kind;
+    obj->sizeclass = cls;
+    obj->marked = false;
+    obj->old = false;
+    obj->remembered = false;
+    obj->pinned = false;
+    obj->local = false;
+    obj->size = size;
+    obj->next = YOUNG;
+    YOUNG = obj;
+
+    YOUNG_BYTES += size;
+    STATS.bytes_allocated += size;
+    STATS.objects_allocated++;
+
+    return obj;
+}
+
+
+void gc_grow(GCObj *obj, size_t size)
+{
+    obj->size += size;
+    if (obj->local)
+        REGION_BYTES += size;
+    else if (obj->old)
+        OLD_BYTES += size;
+    else
+        YOUNG_BYTES += size;
+    STATS.bytes_allocated += size;
+}
+
+
+GCRegion gc_region_enter()
+{
+    GCRegion region;
+
+    // keep the first block, or every call from the top level would
+    // allocate one and free it
+    if (REGION.blocks == NULL)
+        arena_alloc(&REGION, ARENA_ALIGN);
+
+    region.arena = arena_mark(&REGION);
+    region.objects = REGION_OBJECTS;
+    region.bytes = REGION_BYTES;
+    REGION_DEPTH++;
+
+    return region;
+}
+
+
+void gc_region_leave(GCRegion region)
+{
+    GCObj *obj, *next;
+
+    REGION_DEPTH--;
+    if (REGION_OBJECTS == region.objects)
+        return;
+
+    for (obj = REGION_OBJECTS; obj != region.objects; obj = next) {
+        next = obj->next;
+        STATS.bytes_freed += obj->size;
+        STATS.objects_freed++;
+        release_gcobj(obj);
+    }
+    REGION_OBJECTS = region.objects;
+    REGION_BYTES = region.bytes;
+    arena_reset(&REGION, region.arena);
+}
+
+
+void *gc_alloc_local(size_t size, enum GCObjKind kind)
+{
+    GCObj *obj;
+
+    if (REGION_DEPTH == 0 || REGION_BYTES + size > GC_REGION_SIZE)
+        return gc_alloc(size, kind);
+
+    obj = (GCObj *) arena_alloc(&REGION, size);
+
+    // never traced, scanned as roots instead
+    obj->kind = kind;
+    obj->sizeclass = SLAB_LARGE;
+    obj->marked = true;
+    obj->old = false;
+    obj->remembered = false;
+    obj->pinned = false;
+    obj->local = true;
+    obj->size = size;
+    obj->next = REGION_OBJECTS;
+    REGION_OBJECTS = obj;
+
+    REGION_BYTES += size;
+    STATS.bytes_allocated += size;
+    STATS.objects_allocated++;
+    STATS.region_objects++;
+
+    return obj;
+}
+
+
+void gc_collect()
+{
+    if (MARKING)
+        finish_marking(now());
+    else
+        collect(true);
+}
+
+
+void gc_set_incremental(unsigned budget)
+{
+    BUDGET = budget;
+}
+
+
+void gc_set_lazy_sweep(bool lazy)
+{
+    LAZY_SWEEP = lazy;
+}
+
+
+void gc_set_threads(unsigned n)
+{
+    unsigned i;
+
+    if (n == 0)
+        n = 1;
+    if (n > GC_MAX_THREADS)
+        n = GC_MAX_THREADS;
+
+    if (n > MAXMARKERS) {
+        MARKERS = (Marker *) realloc(MARKERS, n * sizeof(Marker));
+        for (i = MAXMARKERS; i < n; i++) {
+            MARKERS[i].top = MARKERS[i].bottom = 0;
+            MARKERS[i].id = i;
+            MARKERS[i].buf = (GCBuf *) malloc(sizeof(GCBuf) + GC_DEQUE_SIZE * sizeof(GCObj *));
+            MARKERS[i].buf->prev = NULL;
+            MARKERS[i].buf->capacity = GC_DEQUE_SIZE;
+        }
+        MAXMARKERS = n;
+    }
+    NTHREADS = n;
+}
+
+
+void gc_set_compact(bool compact)
+{
+    COMPACT = compact;
+}
+
+
+// Objects may only move where nothing but the roots points to them: C
+// locals can't be updated. Compaction runs here once a major collection
+// has left enough of the slabs unused.
+void gc_safepoint()
+{
+    size_t reserved;
+
+    if (!COMPACT_DUE)
+        return;
+    COMPACT_DUE = false;
+
+    if (fragmentation(&reserved) >= GC_COMPACT_THRESHOLD && reserved >= GC_COMPACT_MIN_HEAP)
+        compact();
+}
+
+
+void gc_free_all()
+{
+    unsigned i;
+    GCObj *obj, *next;
+
+    for (obj = YOUNG; obj != NULL; obj = next) {
+        next = obj->next;
+        free_gcobj(obj);
+    }
+    for (obj = OLD; obj != NULL; obj = next) {
+        next = obj->next;
+        free_gcobj(obj);
+    }
+    for (obj = UNSWEPT; obj != NULL; obj = next) {
+        next = obj->next;
+        free_gcobj(obj);
+    }
+    for (obj = REGION_OBJECTS; obj != NULL; obj = next) {
+        next = obj->next;
+        release_gcobj(obj);
+    }
+    YOUNG = OLD = UNSWEPT = REGION_OBJECTS = NULL;
+    YOUNG_BYTES = OLD_BYTES = REGION_BYTES = 0;
+    free_arena(&REGION);
+    REGION_DEPTH = 0;
+
+    free(GRAY.items);
+    free(ROOTS.items);
+    free(REMEMBERED.items);
+    GRAY.items = ROOTS.items = REMEMBERED.items = NULL;
+    GRAY.n = GRAY.capacity = ROOTS.n = ROOTS.capacity = 0;
+    REMEMBERED.n = REMEMBERED.capacity = 0;
+    MARKING = false;
+
+    free(PAUSES);
+    PAUSES = NULL;
+    NPAUSES = MAXPAUSES = 0;
+
+    for (i = 0; i < MAXMARKERS; i++)
+        free(MARKERS[i].buf);
+    free(MARKERS);
+    MARKERS = NULL;
+    MAXMARKERS = 0;
+    NTHREADS = 1;
+}
+
+
+void gc_remember(GCObj *obj)
+{
+    obj->remembered = true;
+    gc_stack_push(&REMEMBERED, obj);
+}
+
+
+void gc_register_roots(gc_roots_t mark_roots, gc_roots_t move_roots)
+{
+    unsigned i;
+
+    for (i = 0; i < NHOOKS; i++)
+        if (ROOT_HOOKS[i] == mark_roots)
+            return;
+
+    if (NHOOKS < GC_MAX_ROOT_HOOKS) {
+        ROOT_HOOKS[NHOOKS] = mark_roots;
+        MOVE_HOOKS[NHOOKS++] = move_roots;
+    }
+}
+
+
+// Old objects are taken as live by a minor collection, which doesn't
+// look into them unless they are remembered.
+void gc_mark(GCObj *obj)
+{
+    if (obj == NULL)
+        return;
+
+    if (PINNING) {
+        obj->pinned = true;
+        return;
+    }
+
+    // markers may race for an object, the one that sets the bit traces it
+    if (MARKER != NULL) {
+        if (!__atomic_load_n(&obj->marked, __ATOMIC_RELAXED)
+                && !__atomic_exchange_n(&obj->marked, true, __ATOMIC_RELAXED))
+            deque_push(MARKER, obj);
+        return;
+    }
+
+    if (obj->marked || (MINOR && obj->old))
+        return;
+
+    obj->marked = true;
+    gc_stack_push(&GRAY, obj);
+}
+
+
+void gc_mark_value(Value value)
+{
+    if (IS_OBJ(value))
+        gc_mark((GCObj *) AS_OBJ(value));
+}
+
+
+// While compacting, a moved object is left marked with its new address
+// in 'next'.
+GCObj *gc_moved(GCObj *obj)
+{
+    return (obj != NULL && obj->marked && !obj->local) ? obj->next : obj;
+}
+
+
+Value gc_moved_value(Value value)
+{
+    return IS_OBJ(value) ? OBJ_VAL((LoxObj *) gc_moved((GCObj *) AS_OBJ(value))) : value;
+}
+
+
+void gc_push_root(GCObj *obj)
+{
+    gc_stack_push(&ROOTS, obj);
+}
+
+
+void gc_pop_roots(size_t n)
+{
+    ROOTS.n -= n;
+}
+
+
+size_t gc_roots_top()
+{
+    return ROOTS.n;
+}
+
+
+void gc_roots_reset(size_t top)
+{
+    if (top < ROOTS.n)
+        ROOTS.n = top;
+}
+
+
+const GCStats *gc_stats()
+{
+    return &STATS;
+}
+
+
+void gc_print_stats()
+{
+    size_t i, n;
+    unsigned b;
+    double *sorted, limit;
+
+    fprintf(stderr, "gc: collections:     %zu\n", STATS.collections);
+    fprintf(stderr, "gc: minor:           %zu\n", STATS.minor_collections);
+    fprintf(stderr, "gc: major:           %zu\n", STATS.major_collections);
+    if (BUDGET > 0)
+        fprintf(stderr, "gc: mark slices:     %zu (%u us budget)\n", STATS.mark_slices, BUDGET);
+    fprintf(stderr, "gc: promoted:        %zu", STATS.objects_promoted);
+    if (STATS.nursery_objects > 0)
+        fprintf(stderr, " (%.1f%% of nursery)",
+                STATS.objects_promoted * 100.0 / STATS.nursery_objects);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "gc: objects alloc'd: %zu\n", STATS.objects_allocated);
+    if (STATS.region_objects > 0)
+        fprintf(stderr, "gc: region alloc'd:  %zu (%.1f%% of objects)\n", STATS.region_objects,
+                STATS.region_objects * 100.0 / STATS.objects_allocated);
+    fprintf(stderr, "gc: objects freed:   %zu\n", STATS.objects_freed);
+    fprintf(stderr, "gc: bytes alloc'd:   %zu\n", STATS.bytes_allocated);
+    fprintf(stderr, "gc: bytes freed:     %zu\n", STATS.bytes_freed);
+    fprintf(stderr, "gc: bytes live:      %zu\n", YOUNG_BYTES + OLD_BYTES);
+    if (NTHREADS > 1)
+        fprintf(stderr, "gc: major marking:   %.3f ms (%u threads)\n", STATS.mark_time * 1e3, NTHREADS);
+    else
+        fprintf(stderr, "gc: major marking:   %.3f ms\n", STATS.mark_time * 1e3);
+    fprintf(stderr, "gc: major sweeping:  %.3f ms (%s)\n", STATS.sweep_time * 1e3,
+            LAZY_SWEEP ? "lazy" : "eager");
+    if (STATS.compactions > 0) {
+        fprintf(stderr, "gc: compactions:     %zu (%zu objects moved, %zu slabs released)\n",
+                STATS.compactions, STATS.objects_moved, STATS.slabs_released);
+        fprintf(stderr, "gc: fragmentation:   %.1f%% -> %.1f%% (last compaction)\n",
+                STATS.fragmentation_before * 100, STATS.fragmentation_after * 100);
+        fprintf(stderr, "gc: rss:             %zu KB -> %zu KB (last compaction)\n",
+                STATS.rss_before / 1024, STATS.rss_after / 1024);
+    }
+    fprintf(stderr, "gc: total pause:     %.3f ms\n", STATS.total_pause * 1e3);
+    fprintf(stderr, "gc: max pause:       %.3f ms\n", STATS.max_pause * 1e3);
+    if (NPAUSES == 0)
+        return;
+
+    fprintf(stderr, "gc: mean pause:      %.3f ms\n", STATS.total_pause * 1e3 / NPAUSES);
+
+    sorted = (double *) malloc(NPAUSES * sizeof(double));
+    memcpy(sorted, PAUSES, NPAUSES * sizeof(double));
+    qsort(sorted, NPAUSES, sizeof(double), compare_pauses);
+
+    fprintf(stderr, "gc: p50 pause:       %.3f ms\n", sorted[(NPAUSES - 1) / 2] * 1e3);
+    fprintf(stderr, "gc: p99 pause:       %.3f ms\n", sorted[(NPAUSES - 1) * 99 / 100] * 1e3);
+
+    // pauses per power of two microseconds
+    for (b = 0, i = 0; i < NPAUSES && b < GC_HISTOGRAM_BUCKETS; b++) {
+        limit = (1u << b) / 1e6;
+        for (n = 0; i < NPAUSES && (sorted[i] < limit || b == GC_HISTOGRAM_BUCKETS - 1); i++)
+            n++;
+        if (n > 0)
+            fprintf(stderr, "gc: pauses < %7u us: %zu\n", 1u << b, n);
+    }
+
+    free(sorted);
+}
+
+
+static void gc_stack_push(GCStack *stack, GCObj *obj)
+{
+    if (stack->n >= stack->capacity) {
+        stack->capacity = (stack->capacity < 64) ? 64 : stack->capacity * 2;
+        stack->items = (GCObj **) realloc(stack->items, stack->capacity * sizeof(GCObj *));
+    }
+    stack->items[stack->n++] = obj;
+}
+
+
+// A minor collection traces the young objects reachable from the roots and
+// the remembered set and promotes them, the rest of the nursery is freed.
+// A major collection traces everything and also sweeps the old generation.
+static void collect(bool major)
+{
+    double start;
+
+    start = now();
+    if (major)
+        finish_sweep();
+    MINOR = !major;
+
+    mark_roots();
+    if (MINOR)
+        mark_remembered();
+    trace_refs();
+    if (major)
+        STATS.mark_time += now() - start;
+    sweep(major);
+
+    MINOR = false;
+    record_pause(start);
+}
+
+
+// An incremental major collection marks in slices between allocations,
+// without collecting the nursery in the meantime. The mutator may store a
+// white object into one that has been marked already: the write barrier
+// remembers old objects, and young ones are all looked at again when the
+// marking finishes, together with the roots.
+static void start_marking()
+{
+    double start;
+
+    start = now();
+    finish_sweep();
+    MARKING = true;
+    mark_roots();
+    NEXT_SLICE = YOUNG_BYTES + GC_SLICE_BYTES;
+    record_pause(start);
+}
+
+
+static void mark_slice()
+{
+    double start, deadline;
+    unsigned n;
+
+    start = now();
+    deadline = start + BUDGET / 1e6;
+#ifdef DEBUG_STRESS_GC
+    deadline = start;
+#endif
+
+    for (n = 1; GRAY.n > 0; n++) {
+        blacken(GRAY.items[--GRAY.n]);
+        if (n % GC_SLICE_CHECK == 0 && now() >= deadline)
+            break;
+    }
+    STATS.mark_slices++;
+    STATS.mark_time += now() - start;
+
+    if (GRAY.n == 0) {
+        finish_marking(start);
+    } else {
+        NEXT_SLICE = YOUNG_BYTES + GC_SLICE_BYTES;
+        record_pause(start);
+    }
+}
+
+
+static void finish_marking(double start)
+{
+    double remark;
+    GCObj *obj;
+
+    remark = now();
+    mark_roots();
+    mark_remembered();
+    for (obj = YOUNG; obj != NULL; obj = obj->next)
+        if (obj->marked)
+            blacken(obj);
+    trace_refs();
+    STATS.mark_time += now() - remark;
+    sweep(true);
+
+    MARKING = false;
+    record_pause(start);
+}
+
+
+// A lazy major collection leaves the old generation to be swept a few
+// objects at a time by the allocations that follow, so its pause is about
+// marking only. Objects promoted meanwhile don't go on the unswept list.
+static void sweep(bool major)
+{
+    size_t i;
+
+    // before a major sweep frees some of them
+    for (i = 0; i < REMEMBERED.n; i++)
+        REMEMBERED.items[i]->remembered = false;
+    REMEMBERED.n = 0;
+
+    if (major) {
+        UNSWEPT = OLD;
+        OLD = NULL;
+        if (!LAZY_SWEEP)
+            finish_sweep();
+        STATS.major_collections++;
+    } else {
+        STATS.minor_collections++;
+    }
+
+    sweep_young();
+    STATS.collections++;
+}
+
+
+static void sweep_step()
+{
+    double start;
+
+    start = now();
+    sweep_old(GC_SWEEP_STEP);
+    STATS.sweep_time += now() - start;
+}
+
+
+static void finish_sweep()
+{
+    double start;
+
+    if (UNSWEPT == NULL)
+        return;
+
+    start = now();
+    sweep_old(SIZE_MAX);
+    STATS.sweep_time += now() - start;
+}
+
+
+static void record_pause(double start)
+{
+    double pause;
+
+    pause = now() - start;
+    STATS.total_pause += pause;
+    if (pause > STATS.max_pause)
+        STATS.max_pause = pause;
+
+    if (NPAUSES >= MAXPAUSES) {
+        MAXPAUSES = (MAXPAUSES == 0) ? 256 : MAXPAUSES * 2;
+        PAUSES = (double *) realloc(PAUSES, MAXPAUSES * sizeof(double));
+    }
+    PAUSES[NPAUSES++] = pause;
+}
+
+
+static int compare_pauses(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+// Region objects aren't marked, what they point to is.
+static void mark_roots()
+{
+    unsigned i;
+    GCObj *obj;
+
+    for (i = 0; i < ROOTS.n; i++)
+        gc_mark(ROOTS.items[i]);
+
+    for (obj = REGION_OBJECTS; obj != NULL; obj = obj->next)
+        blacken(obj);
+
+    for (i = 0; i < NHOOKS; i++)
+        ROOT_HOOKS[i]();
+}
+
+
+static void mark_remembered()
+{
+    size_t i;
+
+    for (i = 0; i < REMEMBERED.n; i++)
+        blacken(REMEMBERED.items[i]);
+}
+
+
+static void trace_refs()
+{
+    if (NTHREADS > 1 && !MINOR) {
+        parallel_trace();
+        return;
+    }
+
+    while (GRAY.n > 0)
+        blacken(GRAY.items[--GRAY.n]);
+}
+
+
+// The gray objects are dealt out to the markers, which trace from them
+// while the program waits. The calling thread is marker 0.
+static void parallel_trace()
+{
+    unsigned i;
+    size_t k;
+    GCBuf *buf, *prev;
+
+    for (k = 0; k < GRAY.n; k++)
+        deque_push(&MARKERS[k % NTHREADS], GRAY.items[k]);
+    GRAY.n = 0;
+
+    NMARKERS = NTHREADS;
+    IDLE = 0;
+    for (i = 1; i < NTHREADS; i++) {
+        MARKERS[i].started = (pthread_create(&MARKERS[i].thread, NULL, mark_worker, &MARKERS[i]) == 0);
+        // if not, its deque is left for the others to steal from
+        if (!MARKERS[i].started)
+            __atomic_fetch_sub(&NMARKERS, 1, __ATOMIC_SEQ_CST);
+    }
+
+    mark_worker(&MARKERS[0]);
+
+    for (i = 0; i < NTHREADS; i++) {
+        if (i > 0 && MARKERS[i].started)
+            pthread_join(MARKERS[i].thread, NULL);
+        for (buf = MARKERS[i].buf->prev; buf != NULL; buf = prev) {
+            prev = buf->prev;
+            free(buf);
+        }
+        MARKERS[i].buf->prev = NULL;
+    }
+}
+
+
+static void *mark_worker(void *arg)
+{
+    GCObj *obj;
+
+    MARKER = (Marker *) arg;
+
+    for (;;) {
+        while ((obj = deque_take(MARKER)) != NULL)
+            blacken(obj);
+        if ((obj = steal_work(MARKER)) != NULL)
+            blacken(obj);
+        else if (is_marking_done())
+            break;
+    }
+
+    MARKER = NULL;
+    return NULL;
+}
+
+
+static GCObj *steal_work(Marker *marker)
+{
+    unsigned i;
+    GCObj *obj;
+
+    for (i = 1; i < NTHREADS; i++)
+        if ((obj = deque_steal(&MARKERS[(marker->id + i) % NTHREADS])) != NULL)
+            return obj;
+
+    return NULL;
+}
+
+
+// Only a busy marker can make more work, so once they are all idle with
+// nothing left in the deques, the marking is over.
+static bool is_marking_done()
+{
+    __atomic_fetch_add(&IDLE, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        if (__atomic_load_n(&IDLE, __ATOMIC_SEQ_CST) == __atomic_load_n(&NMARKERS, __ATOMIC_SEQ_CST)
+                && !has_work())
+            return true;
+        if (has_work()) {
+            __atomic_fetch_sub(&IDLE, 1, __ATOMIC_SEQ_CST);
+            return false;
+        }
+        sched_yield();
+    }
+}
+
+
+static bool has_work()
+{
+    unsigned i;
+
+    for (i = 0; i < NTHREADS; i++)
+        if (__atomic_load_n(&MARKERS[i].top, __ATOMIC_SEQ_CST)
+                < __atomic_load_n(&MARKERS[i].bottom, __ATOMIC_SEQ_CST))
+            return true;
+
+    return false;
+}
+
+
+static void deque_push(Marker *marker, GCObj *obj)
+{
+    long top, bottom;
+    GCBuf *buf;
+
+    bottom = __atomic_load_n(&marker->bottom, __ATOMIC_RELAXED);
+    top = __atomic_load_n(&marker->top, __ATOMIC_ACQUIRE);
+    buf = marker->buf;
+
+    if (bottom - top >= buf->capacity)
+        buf = deque_grow(marker, top, bottom);
+
+    __atomic_store_n(&buf->items[bottom & (buf->capacity - 1)], obj, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&marker->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+
+static GCObj *deque_take(Marker *marker)
+{
+    long top, bottom;
+    GCBuf *buf;
+    GCObj *obj;
+
+    bottom = __atomic_load_n(&marker->bottom, __ATOMIC_RELAXED) - 1;
+    buf = marker->buf;
+    __atomic_store_n(&marker->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&marker->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&marker->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    obj = __atomic_load_n(&buf->items[bottom & (buf->capacity - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // the last one, a thief may be taking it too
+        if (!__atomic_compare_exchange_n(&marker->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            obj = NULL;
+        __atomic_store_n(&marker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return obj;
+}
+
+
+static GCObj *deque_steal(Marker *marker)
+{
+    long top, bottom;
+    GCBuf *buf;
+    GCObj *obj;
+
+    top = __atomic_load_n(&marker->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&marker->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+        return NULL;
+
+    buf = __atomic_load_n(&marker->buf, __ATOMIC_ACQUIRE);
+    obj = __atomic_load_n(&buf->items[top & (buf->capacity - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&marker->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+
+    return obj;
+}
+
+
+static GCBuf *deque_grow(Marker *marker, long top, long bottom)
+{
+    long i;
+    GCBuf *buf, *old;
+
+    old = marker->buf;
+    buf = (GCBuf *) malloc(sizeof(GCBuf) + 2 * old->capacity * sizeof(GCObj *));
+    buf->prev = old;
+    buf->capacity = 2 * old->capacity;
+
+    for (i = top; i < bottom; i++)
+        buf->items[i & (buf->capacity - 1)] = old->items[i & (old->capacity - 1)];
+
+    __atomic_store_n(&marker->buf, buf, __ATOMIC_RELEASE);
+    return buf;
+}
+
+
+static void blacken(GCObj *obj)
+{
+    switch (obj->kind) {
+        case GC_KIND_OBJ:
+            blacken_obj((LoxObj *) obj);
+            break;
+        case GC_KIND_ENV:
+            blacken_env((LoxEnv *) obj);
+            break;
+    }
+}
+
+
+static void blacken_obj(LoxObj *obj)
+{
+    unsigned i;
+
+    switch (obj->type) {
+        case LOX_OBJ_CLASS:
+            gc_mark((GCObj *) obj->klass.superclass);
+            gc_mark((GCObj *) obj->klass.init);
+            mark_dict(obj->klass.methods);
+            break;
+        case LOX_OBJ_FUN:
+            gc_mark((GCObj *) obj->fun.proto);
+            for (i = 0; i < obj->fun.nupvalues; i++)
+                gc_mark((GCObj *) obj->fun.upvalues[i]);
+            break;
+        case LOX_OBJ_INSTANCE:
+            gc_mark((GCObj *) obj->instance.klass);
+            for (i = 0; i < obj->instance.shape->nfields; i++)
+                gc_mark_value(obj->instance.fields[i]);
+            break;
+        case LOX_OBJ_METHOD:
+            gc_mark((GCObj *) obj->method.receiver);
+            gc_mark((GCObj *) obj->method.fun);
+            break;
+        case LOX_OBJ_PROTO:
+            for (i = 0; i < obj->proto.chunk->nconstants; i++)
+                gc_mark_value(obj->proto.chunk->constants[i]);
+            break;
+        case LOX_OBJ_UPVALUE:
+            gc_mark_value(*obj->upvalue.location);
+            gc_mark((GCObj *) obj->upvalue.next);
+            break;
+        default:
+            break;
+    }
+}
+
+
+static void blacken_env(LoxEnv *env)
+{
+    unsigned i;
+
+    gc_mark((GCObj *) env->next);
+    gc_mark((GCObj *) env->open);
+    for (i = 0; i < env->n; i++)
+        gc_mark_value(env->slots[i]);
+}
+
+
+static void mark_dict(Dict *dict)
+{
+    size_t pos;
+    Value value;
+
+    if (dict == NULL)
+        return;
+
+    pos = 0;
+    while (Dict_Next(dict, &pos, NULL, &value))
+        gc_mark_value(value);
+}
+
+
+// Sweeps up to n objects off the unswept list, survivors go back to the
+// old generation.
+static void sweep_old(size_t n)
+{
+    GCObj *obj;
+
+    for (; n > 0 && (obj = UNSWEPT) != NULL; n--) {
+        UNSWEPT = obj->next;
+        if (obj->marked) {
+            obj->marked = false;
+            obj->next = OLD;
+            OLD = obj;
+        } else {
+            OLD_BYTES -= obj->size;
+            STATS.bytes_freed += obj->size;
+            STATS.objects_freed++;
+            free_gcobj(obj);
+        }
+    }
+
+    if (UNSWEPT == NULL) {
+        NEXT_MAJOR = OLD_BYTES * GC_HEAP_GROW_FACTOR;
+        if (NEXT_MAJOR < GC_MIN_HEAP)
+            NEXT_MAJOR = GC_MIN_HEAP;
+        COMPACT_DUE = COMPACT;
+    }
+}
+
+
+// Empties the nursery: survivors are promoted, whatever the collection.
+static void sweep_young()
+{
+    GCObj *obj, *next;
+
+    for (obj = YOUNG; obj != NULL; obj = next) {
+        next = obj->next;
+        if (MINOR)
+            STATS.nursery_objects++;
+        if (obj->marked) {
+            obj->marked = false;
+            obj->old = true;
+            obj->next = OLD;
+            OLD = obj;
+            OLD_BYTES += obj->size;
+            if (MINOR)
+                STATS.objects_promoted++;
+        } else {
+            STATS.bytes_freed += obj->size;
+            STATS.objects_freed++;
+            free_gcobj(obj);
+        }
+    }
+    YOUNG = NULL;
+    YOUNG_BYTES = 0;
+}
+
+
+static void free_gcobj(GCObj *obj)
+{
+    release_gcobj(obj);
+    slab_free(SLABS(obj), obj->sizeclass, obj);
+}
+
+
+// Frees what the object owns, but not the object itself. Environments
+// don't own anything.
+static void release_gcobj(GCObj *obj)
+{
+    if (obj->kind == GC_KIND_OBJ)
+        free_obj((LoxObj *) obj);
+}
+
+
+// Collects everything, then moves the live objects out of the sparsest
+// slabs into the holes of the others, which are given back to the system.
+// Objects held by roots that can't be updated stay where they are, and so
+// do open upvalues and the environments they point into.
+static void compact()
+{
+    size_t i, reserved;
+    double start;
+    GCObj *obj, *next;
+    GCStack live = { NULL, 0, 0 };
+
+    gc_collect();
+    finish_sweep();
+    COMPACT_DUE = false;
+
+    start = now();
+    STATS.rss_before = resident_bytes();
+    STATS.fragmentation_before = fragmentation(&reserved);
+
+    pin_roots();
+    for (obj = OLD; obj != NULL; obj = obj->next) {
+        if (obj->kind == GC_KIND_ENV && ((LoxEnv *) obj)->open != NULL)
+            obj->pinned = true;
+        else if (obj->kind == GC_KIND_OBJ && ((LoxObj *) obj)->type == LOX_OBJ_UPVALUE
+                && ((LoxObj *) obj)->upvalue.location != &((LoxObj *) obj)->upvalue.closed)
+            obj->pinned = true;
+    }
+
+    slab_compact_start(&OBJ_SLABS);
+    slab_compact_start(&ENV_SLABS);
+    for (obj = OLD; obj != NULL; obj = obj->next)
+        slab_compact_note(SLABS(obj), obj->sizeclass, obj, obj->pinned);
+    slab_compact_plan(&OBJ_SLABS);
+    slab_compact_plan(&ENV_SLABS);
+
+    for (obj = OLD; obj != NULL; obj = next) {
+        next = obj->next;
+        if (!obj->pinned && slab_is_evacuated(SLABS(obj), obj->sizeclass, obj))
+            obj = move(obj);
+        gc_stack_push(&live, obj);
+    }
+
+    for (i = 0; i < live.n; i++)
+        move_refs(live.items[i]);
+    for (i = 0; i < NHOOKS; i++)
+        if (MOVE_HOOKS[i] != NULL)
+            MOVE_HOOKS[i]();
+
+    OLD = NULL;
+    for (i = live.n; i-- > 0; ) {
+        live.items[i]->pinned = false;
+        live.items[i]->next = OLD;
+        OLD = live.items[i];
+    }
+    free(live.items);
+
+    STATS.slabs_released += slab_compact_finish(&OBJ_SLABS);
+    STATS.slabs_released += slab_compact_finish(&ENV_SLABS);
+    STATS.fragmentation_after = fragmentation(&reserved);
+    STATS.compactions++;
+    record_pause(start);
+
+    STATS.rss_after = resident_bytes();
+}
+
+
+static void pin_roots()
+{
+    unsigned i;
+    GCObj *obj;
+
+    PINNING = true;
+    for (i = 0; i < ROOTS.n; i++)
+        gc_mark(ROOTS.items[i]);
+    for (obj = REGION_OBJECTS; obj != NULL; obj = obj->next)
+        blacken(obj);
+    for (i = 0; i < NHOOKS; i++)
+        if (MOVE_HOOKS[i] == NULL)
+            ROOT_HOOKS[i]();
+    PINNING = false;
+}
+
+
+// Objects point to themselves when instance fields are still inline or an
+// upvalue is closed.
+static GCObj *move(GCObj *obj)
+{
+    GCObj *to;
+    LoxObj *from, *copy;
+
+    to = (GCObj *) slab_alloc(SLABS(obj), obj->sizeclass, SLAB_CLASS_SIZE(obj->sizeclass));
+    memcpy(to, obj, SLAB_CLASS_SIZE(obj->sizeclass));
+
+    if (obj->kind == GC_KIND_OBJ) {
+        from = (LoxObj *) obj;
+        copy = (LoxObj *) to;
+        if (from->type == LOX_OBJ_INSTANCE && from->instance.fields == (Value *) (from + 1))
+            copy->instance.fields = (Value *) (copy + 1);
+        if (from->type == LOX_OBJ_UPVALUE && from->upvalue.location == &from->upvalue.closed)
+            copy->upvalue.location = &copy->upvalue.closed;
+    }
+
+    obj->marked = true;
+    obj->next = to;
+    STATS.objects_moved++;
+
+    return to;
+}
+
+
+static void move_refs(GCObj *obj)
+{
+    switch (obj->kind) {
+        case GC_KIND_OBJ:
+            move_obj_refs((LoxObj *) obj);
+            break;
+        case GC_KIND_ENV:
+            move_env_refs((LoxEnv *) obj);
+            break;
+    }
+}
+
+
+static void move_obj_refs(LoxObj *obj)
+{
+    unsigned i;
+    Chunk *chunk;
+
+    switch (obj->type) {
+        case LOX_OBJ_CLASS:
+            obj->klass.superclass = MOVED(obj->klass.superclass);
+            obj->klass.init = MOVED(obj->klass.init);
+            move_dict(obj->klass.methods);
+            break;
+        case LOX_OBJ_FUN:
+            obj->fun.proto = MOVED(obj->fun.proto);
+            for (i = 0; i < obj->fun.nupvalues; i++)
+                obj->fun.upvalues[i] = MOVED(obj->fun.upvalues[i]);
+            break;
+        case LOX_OBJ_INSTANCE:
+            obj->instance.klass = MOVED(obj->instance.klass);
+            for (i = 0; i < obj->instance.shape->nfields; i++)
+                obj->instance.fields[i] = gc_moved_value(obj->instance.fields[i]);
+            break;
+        case LOX_OBJ_METHOD:
+            obj->method.receiver = MOVED(obj->method.receiver);
+            obj->method.fun = MOVED(obj->method.fun);
+            break;
+        case LOX_OBJ_PROTO:
+            chunk = obj->proto.chunk;
+            for (i = 0; i < chunk->nconstants; i++)
+                chunk->constants[i] = gc_moved_value(chunk->constants[i]);
+            break;
+        case LOX_OBJ_UPVALUE:
+            // open ones point into a pinned environment or the VM stack
+            obj->upvalue.closed = gc_moved_value(obj->upvalue.closed);
+            obj->upvalue.next = MOVED(obj->upvalue.next);
+            break;
+        default:
+            break;
+    }
+}
+
+
+static void move_env_refs(LoxEnv *env)
+{
+    unsigned i;
+
+    env->next = MOVED(env->next);
+    env->open = MOVED(env->open);
+    for (i = 0; i < env->n; i++)
+        env->slots[i] = gc_moved_value(env->slots[i]);
+}
+
+
+static void move_dict(Dict *dict)
+{
+    size_t pos;
+    char *key;
+    Value value;
+
+    if (dict == NULL)
+        return;
+
+    pos = 0;
+    while (Dict_Next(dict, &pos, &key, &value))
+        if (IS_OBJ(value) && ((GCObj *) AS_OBJ(value))->marked)
+            Dict_Set(dict, key, gc_moved_value(value));
+}
+
+
+// Share of the slabs not taken by live objects.
+static double fragmentation(size_t *reserved)
+{
+    size_t used, total, n;
+
+    slab_usage(&OBJ_SLABS, &used, reserved);
+    slab_usage(&ENV_SLABS, &n, &total);
+    used += n;
+    *reserved += total;
+
+    return (*reserved > 0) ? 1 - (double) used / *reserved : 0;
+}
+
+
+static size_t resident_bytes()
+{
+    FILE *fp;
+    unsigned long size, resident;
+
+    if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+        return 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,118 @@
+#ifndef clox_gc_h
+#define clox_gc_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "value.h"
+
+enum GCObjKind {
+    GC_KIND_OBJ = 0,
+    GC_KIND_ENV,
+};
+
+// Every collectable value (LoxObj, LoxEnv) starts with this header,
+// so the collector can link and mark them without knowing their layout.
+typedef struct gcobj {
+    struct gcobj *next;
+    uint8_t kind;           // enum GCObjKind
+    bool marked;
+    uint8_t sizeclass;      // slab the object was carved from
+    bool old;               // survived a collection
+    bool remembered;        // old object in the remembered set
+    bool pinned;            // can't be moved by the compaction under way
+    bool local;             // in a call region, see gc_alloc_local()
+    size_t size;
+} GCObj;
+
+typedef struct {
+    size_t collections;
+    size_t minor_collections;
+    size_t major_collections;
+    size_t objects_promoted;
+    size_t nursery_objects;     // young objects looked at by minor collections
+    size_t mark_slices;
+    double mark_time;           // spent marking for major collections
+    double sweep_time;          // and sweeping the old generation, lazily or not
+    size_t bytes_allocated;
+    size_t bytes_freed;
+    size_t objects_allocated;
+    size_t objects_freed;
+    double total_pause;
+    double max_pause;
+    size_t compactions;
+    size_t objects_moved;
+    size_t slabs_released;
+    double fragmentation_before;    // around the last compaction
+    double fragmentation_after;
+    size_t rss_before;
+    size_t rss_after;
+    size_t region_objects;      // allocated by gc_alloc_local()
+} GCStats;
+
+// Where a call region started, see gc_region_enter().
+typedef struct {
+    ArenaMark arena;
+    GCObj *objects;
+    size_t bytes;
+} GCRegion;
+
+typedef void (*gc_roots_t)(void);
+
+void *gc_alloc(size_t size, enum GCObjKind kind);
+void gc_grow(GCObj *obj, size_t size);
+void gc_collect();
+void gc_set_incremental(unsigned budget);
+void gc_set_lazy_sweep(bool lazy);
+void gc_set_threads(unsigned n);
+void gc_set_compact(bool compact);
+void gc_safepoint();
+void gc_free_all();
+
+// Objects that can't outlive the call that allocates them (as found by the
+// resolver) are bump-allocated from the region the call entered, and freed
+// all at once when it leaves it. They are never traced themselves, but
+// scanned like roots by every collection. Outside of any call, or once the
+// regions have grown too large, gc_alloc_local() falls back to gc_alloc().
+GCRegion gc_region_enter();
+void gc_region_leave(GCRegion region);
+void *gc_alloc_local(size_t size, enum GCObjKind kind);
+
+void gc_remember(GCObj *obj);
+
+// mark_roots marks what the hook's owner holds. Compaction calls
+// move_roots to have it replace what it holds with gc_moved(), or pins the
+// objects marked by mark_roots if there's no move_roots.
+void gc_register_roots(gc_roots_t mark_roots, gc_roots_t move_roots);
+void gc_mark(GCObj *obj);
+void gc_mark_value(Value value);
+GCObj *gc_moved(GCObj *obj);
+Value gc_moved_value(Value value);
+
+void gc_push_root(GCObj *obj);
+void gc_pop_roots(size_t n);
+size_t gc_roots_top();
+void gc_roots_reset(size_t top);
+
+const GCStats *gc_stats();
+void gc_print_stats();
+
+#define GC_PUSH(obj) gc_push_root((GCObj *) (obj))
+#define GC_PUSH_VALUE(value) gc_push_root(IS_OBJ(value) ? (GCObj *) AS_OBJ(value) : NULL)
+#define GC_POP(n) gc_pop_roots(n)
+
+// New objects are young. A minor collection only traces young objects,
+// starting from the roots and the remembered set, and promotes the ones
+// that survive. So an old object that may point to a young one has to be
+// remembered: call GC_BARRIER on an object after storing a reference in it.
+// Incremental marking relies on the same barrier to look again at old
+// objects written to while it was under way.
+#define GC_BARRIER(obj) \
+    do { \
+        if (((GCObj *) (obj))->old && !((GCObj *) (obj))->remembered) \
+            gc_remember((GCObj *) (obj)); \
+    } while (0)
+
+#endif
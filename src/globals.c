@@ -1,16 +1,115 @@
+#include <stdlib.h>
 #include <time.h>
 
-#include "environment.h"
+#include "dict.h"
+#include "gc.h"
+#include "globals.h"
 #include "loxobj.h"
+#include "value.h"
 
 #define UNUSED(x) (void)(x)
 
+static void mark_globals();
+static void move_globals();
 
-LoxObj *loxclock(LoxObj *self, unsigned argc, LoxObj **args)
+static Dict *SLOTS = NULL;      // name -> slot
+static char **NAMES = NULL;
+static Value *VALUES = NULL;
+static unsigned NGLOBALS = 0;
+static unsigned MAXGLOBALS = 0;
+
+
+unsigned global_slot(const char *name)
+{
+    Value slot;
+
+    if (SLOTS == NULL) {
+        SLOTS = Dict_New();
+        gc_register_roots(mark_globals, move_globals);
+    }
+
+    if (!IS_UNDEF(slot = Dict_Get(SLOTS, (char *) name)))
+        return AS_NUMBER(slot);
+
+    if (NGLOBALS >= MAXGLOBALS) {
+        MAXGLOBALS = (MAXGLOBALS == 0) ? 64 : MAXGLOBALS * 2;
+        NAMES = (char **) realloc(NAMES, MAXGLOBALS * sizeof(char *));
+        VALUES = (Value *) realloc(VALUES, MAXGLOBALS * sizeof(Value));
+    }
+
+    NAMES[NGLOBALS] = Dict_Intern(name);
+    VALUES[NGLOBALS] = UNDEF_VAL;
+    Dict_Set(SLOTS, (char *) name, NUMBER_VAL(NGLOBALS));
+
+    return NGLOBALS++;
+}
+
+
+char *global_name(unsigned slot)
+{
+    return NAMES[slot];
+}
+
+
+Value global_get(unsigned slot)
+{
+    return (slot < NGLOBALS) ? VALUES[slot] : UNDEF_VAL;
+}
+
+
+void global_set(unsigned slot, Value value)
+{
+    if (slot < NGLOBALS)
+        VALUES[slot] = value;
+}
+
+
+void free_globals()
+{
+    if (SLOTS != NULL)
+        Dict_Free(SLOTS);
+    free(NAMES);
+    free(VALUES);
+    SLOTS = NULL;
+    NAMES = NULL;
+    VALUES = NULL;
+    NGLOBALS = MAXGLOBALS = 0;
+}
+
+
+void define_natives()
+{
+    unsigned slot;
+
+    slot = global_slot("clock");
+    global_set(slot, OBJ_VAL(new_callable_obj(0, loxclock)));
+}
+
+
+Value loxclock(LoxObj *self, unsigned argc, Value *args)
 {
     UNUSED(self);
     UNUSED(argc);
     UNUSED(args);
 
-    return new_num_obj((double) clock() / CLOCKS_PER_SEC);
+    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+}
+
+
+// Globals are roots, writing to them needs no barrier.
+static void mark_globals()
+{
+    unsigned i;
+
+    for (i = 0; i < NGLOBALS; i++)
+        gc_mark_value(VALUES[i]);
+}
+
+
+static void move_globals()
+{
+    unsigned i;
+
+    for (i = 0; i < NGLOBALS; i++)
+        VALUES[i] = gc_moved_value(VALUES[i]);
 }
@@ -2,7 +2,21 @@
 #define clox_globals_h
 
 #include "loxobj.h"
+#include "value.h"
 
-LoxObj *loxclock(LoxObj *self, unsigned argc, LoxObj **args);
+// Globals are late bound, but they don't need a lookup by name at runtime:
+// the resolver and the compiler give every global name they come across a
+// slot in one table, defined or not yet, and the name keeps it for the rest
+// of the session (REPL lines included). The slot of a name that hasn't been
+// defined holds UNDEF.
+unsigned global_slot(const char *name);
+char *global_name(unsigned slot);
+Value global_get(unsigned slot);
+void global_set(unsigned slot, Value value);
+void free_globals();
+
+void define_natives();
+
+Value loxclock(LoxObj *self, unsigned argc, Value *args);
 
 #endif
@@ -2,21 +2,25 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
 #include "dict.h"
 #include "environment.h"
 #include "expr.h"
+#include "gc.h"
 #include "globals.h"
 #include "interpreter.h"
 #include "logger.h"
 #include "loxobj.h"
 #include "scanner.h"
+#include "shape.h"
 #include "stmt.h"
+#include "value.h"
 
 #define UNUSED(x) (void)(x)
 
 typedef struct {
     int code;
-    LoxObj *value;
+    Value value;
 } ExecResult;
 
 
@@ -25,18 +29,18 @@ static ExecResult ExecResult_Ok()
     ExecResult res;
 
     res.code = 0;
-    res.value = NULL;
+    res.value = UNDEF_VAL;
 
     return res;
 }
 
 
-static ExecResult ExecResult_Return(LoxObj *obj)
+static ExecResult ExecResult_Return(Value value)
 {
     ExecResult res;
 
     res.code = 1;
-    res.value = obj;
+    res.value = value;
 
     return res;
 }
@@ -47,16 +51,18 @@ static ExecResult ExecResult_Err()
     ExecResult res;
 
     res.code = -1;
-    res.value = NULL;
+    res.value = UNDEF_VAL;
 
     return res;
 }
 
 
-static LoxEnv *init_env();
+static void mark_roots();
+static void move_roots();
 
 static ExecResult exec(Stmt *stmt);
 static ExecResult exec_block_stmt(Stmt *stmt);
+static ExecResult exec_stmts(Stmt *block);
 static ExecResult exec_class_stmt(Stmt *stmt);
 static ExecResult exec_fun_stmt(Stmt *stmt);
 static ExecResult exec_expr_stmt(Stmt *stmt);
@@ -66,54 +72,90 @@ static ExecResult exec_return_stmt(Stmt *stmt);
 static ExecResult exec_var_stmt(Stmt *stmt);
 static ExecResult exec_while_stmt(Stmt *stmt);
 
-static LoxObj *eval(const Expr *expr);
-static LoxObj *eval_assignment(const Expr *expr);
-static LoxObj *eval_binary(const Expr *expr);
-static LoxObj *eval_call(const Expr *expr);
-static unsigned class_arity(LoxObj *self);
-static LoxObj *class_call(LoxObj *self, unsigned argc, LoxObj **args);
-static LoxObj *fun_call(LoxObj *self, unsigned argc, LoxObj **args);
-static LoxObj *eval_get(const Expr *expr);
-static LoxObj *eval_literal(const Expr *expr);
-static LoxObj *eval_logic(const Expr *expr);
-static LoxObj *eval_this(const Expr *expr);
-static LoxObj *eval_set(const Expr *expr);
-static LoxObj *eval_super(const Expr *expr);
-static LoxObj *eval_unary(const Expr *expr);
-static LoxObj *eval_var(const Expr *expr);
+static Value eval(const Expr *expr);
+static Value eval_assignment(const Expr *expr);
+static Value eval_binary(const Expr *expr);
+static Value eval_call(const Expr *expr);
+static void push_arg(Value value);
+static Value class_call(LoxObj *self, unsigned argc, Value *args);
+static Value local_class_call(LoxObj *self, unsigned argc, Value *args);
+static Value instantiate(LoxObj *self, bool local, unsigned argc, Value *args);
+static Value fun_call(LoxObj *self, unsigned argc, Value *args);
+static Value call_fun(LoxObj *fun, LoxObj *this, unsigned argc, Value *args);
+static LoxObj *new_closure(Stmt *stmt, bool init);
+static Value eval_get(const Expr *expr);
+static Value get_property(const Expr *expr, LoxObj **this);
+static Value eval_literal(const Expr *expr);
+static Value eval_logic(const Expr *expr);
+static Value eval_this(const Expr *expr);
+static Value eval_set(const Expr *expr);
+static Value eval_super(const Expr *expr);
+static Value eval_unary(const Expr *expr);
+static Value eval_var(const Expr *expr);
+static Value lookup_var(const Token *name, const Binding *bind);
+static void assign_var(const Binding *bind, Value value);
+static void define_var(char *name, Value value);
 static char *joinstr(const char *s1, const char *s2);
-static LoxObj *find_method(LoxObj *obj, LoxObj *klass, char *name);
+static bool is_string(Value value);
+static LoxObj *find_method(LoxObj *klass, char *name);
 
-static LoxEnv *ENV = NULL;
+static bool STARTED = false;
+static LoxEnv *ENV = NULL;         // NULL at the top level
+static LoxObj *CLOSURE = NULL;
+
+// Arguments of the calls under way, each call's above its caller's.
+static Value *STACK = NULL;
+static size_t NSTACK = 0;
+static size_t MAXSTACK = 0;
 
 
 int interpret(Stmt **stmts)
 {
     int i, code;
+    size_t roots;
 
-    if (ENV == NULL)
-        ENV = init_env();
+    if (!STARTED) {
+        STARTED = true;
+        gc_register_roots(mark_roots, move_roots);
+        define_natives();
+    }
+
+    roots = gc_roots_top();
 
     for (i = 0; stmts[i] != NULL; i++)  {
-        if ((code = exec(stmts[i]).code) < 0)
+        code = exec(stmts[i]).code;
+        // error paths bail out without popping their temporaries
+        gc_roots_reset(roots);
+        if (code < 0)
             return code;
+        gc_safepoint();
     }
 
     return 0;
 }
 
 
-static LoxEnv *init_env()
+static void mark_roots()
 {
-    LoxEnv *env;
-    char *s;
+    size_t i;
+
+    gc_mark((GCObj *) ENV);
+    gc_mark((GCObj *) CLOSURE);
+    for (i = 0; i < NSTACK; i++)
+        gc_mark_value(STACK[i]);
+}
 
-    env = new_env();
-    
-    s = strdup("clock");
-    env_def(env, s, new_callable_obj(0, loxclock));
 
-    return env;
+// Inline caches hold on to methods without marking them, they start over.
+static void move_roots()
+{
+    size_t i;
+
+    ENV = (LoxEnv *) gc_moved((GCObj *) ENV);
+    CLOSURE = (LoxObj *) gc_moved((GCObj *) CLOSURE);
+    for (i = 0; i < NSTACK; i++)
+        STACK[i] = gc_moved_value(STACK[i]);
+    ic_flush_all();
 }
 
 
@@ -144,23 +186,33 @@ static ExecResult exec(Stmt *stmt)
 }
 
 
+// Blocks that declare nothing run in the enclosing env.
 static ExecResult exec_block_stmt(Stmt *stmt)
 {
-    unsigned i;
     ExecResult res;
 
-    ENV = enclose_env(ENV);
+    if (stmt->block.nslots == 0)
+        return exec_stmts(stmt);
+
+    ENV = enclose_env(ENV, stmt->block.nslots);
+    res = exec_stmts(stmt);
+    ENV = disclose_env(ENV);
+
+    return res;
+}
+
+
+static ExecResult exec_stmts(Stmt *block)
+{
+    unsigned i;
+    ExecResult res;
 
-    for (i = 0; i < stmt->block.n; i++) {
-        res = exec(stmt->block.stmts[i]);
-        if (res.code != 0) {
-            ENV = disclose_env(ENV);
+    for (i = 0; i < block->block.n; i++) {
+        res = exec(block->block.stmts[i]);
+        if (res.code != 0)
             return res;
-        }
     }
 
-    ENV = disclose_env(ENV);
-
     return ExecResult_Ok();
 }
 
@@ -170,50 +222,43 @@ static ExecResult exec_class_stmt(Stmt *stmt)
     bool init;
     unsigned i;
     LoxObj *klass, *method, *superclass;
-    Dict *methods;
+    Value value;
 
     superclass = NULL;
     if (stmt->klass.superclass != NULL) {
-        if ((superclass = eval(stmt->klass.superclass)) == NULL)
+        if (IS_UNDEF(value = eval(stmt->klass.superclass)))
             return ExecResult_Err();
 
-        if (superclass->type != LOX_OBJ_CLASS) {
+        if (!IS_OBJ(value) || AS_OBJ(value)->type != LOX_OBJ_CLASS) {
             log_error(LOX_RUNTIME_ERR, "superclass must be a class");
             return ExecResult_Err();
         }
+        superclass = AS_OBJ(value);
     }
 
-    env_def(ENV, stmt->klass.name->lexeme, new_nil_obj());
+    GC_PUSH(superclass);
+
+    klass = new_class_obj(stmt->klass.name->lexeme, superclass, Dict_New());
+    if (superclass != NULL)
+        class_inherit(klass);
+    define_var(stmt->klass.name->lexeme, OBJ_VAL(klass));
 
     if (superclass != NULL) {
-        ENV = enclose_env(ENV);
-        env_def(ENV, "super", superclass);
+        ENV = enclose_env(ENV, 1);
+        env_def(ENV, OBJ_VAL(superclass));
     }
 
-    methods = Dict_New(); 
     for (i = 0; i < stmt->klass.n; i++) {
         init = (strcmp(stmt->klass.methods[i]->fun.name, "init") == 0);
-        method = new_fun_obj(stmt->klass.methods[i], stmt->klass.methods[i]->fun.n, init);
-        DICT_SET(methods, method->fun.declaration->fun.name, method);
-    }
-
-    klass = new_class_obj(stmt->klass.name->lexeme, superclass, methods);
-
-    if (superclass != NULL)
-        env_assign(ENV->next, stmt->klass.name->lexeme, klass);
-    else
-        env_assign(ENV, stmt->klass.name->lexeme, klass);
-
-    if (ENV->next != NULL) {
-        for (i = 0; i< stmt->klass.n; i++) {
-            method = DICT_GET(LoxObj, klass->klass.methods, stmt->klass.methods[i]->fun.name);
-            method->fun.closure = env_copy(ENV); 
-        }
+        method = new_closure(stmt->klass.methods[i], init);
+        class_add_method(klass, method->fun.declaration->fun.name, method);
     }
 
     if (superclass != NULL)
         ENV = disclose_env(ENV);
 
+    GC_POP(1);
+
     return ExecResult_Ok();
 }
 
@@ -222,11 +267,8 @@ static ExecResult exec_fun_stmt(Stmt *stmt)
 {
     LoxObj *fun;
 
-    fun = new_fun_obj(stmt, stmt->fun.n, false);
-    if (ENV->next != NULL)
-        fun->fun.closure = env_copy(ENV);
-
-    env_def(ENV, stmt->fun.name, fun);
+    fun = new_closure(stmt, false);
+    define_var(stmt->fun.name, OBJ_VAL(fun));
 
     return ExecResult_Ok();
 }
@@ -234,12 +276,12 @@ static ExecResult exec_fun_stmt(Stmt *stmt)
 
 static ExecResult exec_if_stmt(Stmt *stmt)
 {
-    LoxObj *cond;
+    Value cond;
 
-    if ((cond = eval(stmt->ifelse.cond)) == NULL)
+    if (IS_UNDEF(cond = eval(stmt->ifelse.cond)))
         return ExecResult_Err();
 
-    if (is_obj_truthy(cond))
+    if (is_value_truthy(cond))
         return exec(stmt->ifelse.conseq);
     else if (stmt->ifelse.alt != NULL)
         return exec(stmt->ifelse.alt);
@@ -250,12 +292,12 @@ static ExecResult exec_if_stmt(Stmt *stmt)
 
 static ExecResult exec_print_stmt(Stmt *stmt)
 {
-    LoxObj *obj;
+    Value value;
 
-    if ((obj = eval(stmt->expr)) == NULL)
+    if (IS_UNDEF(value = eval(stmt->expr)))
         return ExecResult_Err();
 
-    print_obj(obj);
+    print_value(value);
 
     return ExecResult_Ok();
 }
@@ -263,7 +305,7 @@ static ExecResult exec_print_stmt(Stmt *stmt)
 
 static ExecResult exec_expr_stmt(Stmt *stmt)
 {
-    if (eval(stmt->expr) == NULL)
+    if (IS_UNDEF(eval(stmt->expr)))
         return ExecResult_Err();
     else
         return ExecResult_Ok();
@@ -272,30 +314,30 @@ static ExecResult exec_expr_stmt(Stmt *stmt)
 
 static ExecResult exec_return_stmt(Stmt *stmt)
 {
-    LoxObj *obj;
+    Value value;
 
     if (stmt->expr == NULL)
-        return ExecResult_Return(new_nil_obj());
+        return ExecResult_Return(NIL_VAL);
 
-    if ((obj = eval(stmt->expr)) == NULL)
+    if (IS_UNDEF(value = eval(stmt->expr)))
         return ExecResult_Err();
     else
-        return ExecResult_Return(obj);
+        return ExecResult_Return(value);
 }
 
 
 static ExecResult exec_var_stmt(Stmt *stmt)
 {
-    LoxObj *obj;
+    Value value;
 
     if (stmt->var.expr != NULL) {
-        if ((obj = eval(stmt->var.expr)) == NULL)
+        if (IS_UNDEF(value = eval(stmt->var.expr)))
             return ExecResult_Err();
     } else {
-        obj = new_nil_obj();
+        value = NIL_VAL;
     }
 
-    env_def(ENV, stmt->var.name, obj);
+    define_var(stmt->var.name, value);
 
     return ExecResult_Ok();
 }
@@ -304,14 +346,14 @@ static ExecResult exec_var_stmt(Stmt *stmt)
 static ExecResult exec_while_stmt(Stmt *stmt)
 {
     ExecResult res;
-    LoxObj *obj;
+    Value cond;
 
     while (true) {
         if (stmt->whileloop.cond != NULL) {
-            if ((obj = eval(stmt->whileloop.cond)) == NULL)
+            if (IS_UNDEF(cond = eval(stmt->whileloop.cond)))
                 return ExecResult_Err();
 
-            if (!is_obj_truthy(obj))
+            if (!is_value_truthy(cond))
                 return ExecResult_Ok();
         }
 
@@ -323,7 +365,7 @@ static ExecResult exec_while_stmt(Stmt *stmt)
 }
 
 
-static LoxObj *eval(const Expr *expr)
+static Value eval(const Expr *expr)
 {
     switch (expr->type) {
         case EXPR_ASSIGN:
@@ -351,36 +393,42 @@ static LoxObj *eval(const Expr *expr)
         case EXPR_VAR:
             return eval_var(expr);
         default:
-            return NULL;
+            return UNDEF_VAL;
     }
 }
 
 
-static LoxObj *eval_assignment(const Expr *expr)
+static Value eval_assignment(const Expr *expr)
 {
-    LoxObj *value;
+    Value value;
 
-    if ((value = eval(expr->assign.value)) != NULL) {
-        env_assign(ENV, expr->varname->lexeme, value);
-        return value;
+    if (IS_UNDEF(value = eval(expr->assign.value)))
+        return UNDEF_VAL;
+
+    if (expr->assign.bind.depth == EXPR_GLOBAL
+            && IS_UNDEF(global_get(expr->assign.bind.slot))) {
+        log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", expr->assign.name->lexeme);
+        return UNDEF_VAL;
     }
 
-    return NULL;
+    assign_var(&expr->assign.bind, value);
+
+    return value;
 }
 
 
-static LoxObj *eval_logic(const Expr *expr)
+static Value eval_logic(const Expr *expr)
 {
-    LoxObj *left;
+    Value left;
 
-    if ((left = eval(expr->binary.left)) == NULL)
-        return NULL;
+    if (IS_UNDEF(left = eval(expr->binary.left)))
+        return UNDEF_VAL;
 
     if (expr->binary.op->type == TOKEN_OR) {
-        if (is_obj_truthy(left))
+        if (is_value_truthy(left))
             return left;
     } else {
-        if (!is_obj_truthy(left))
+        if (!is_value_truthy(left))
             return left;
     }
 
@@ -388,143 +436,191 @@ static LoxObj *eval_logic(const Expr *expr)
 }
 
 
-static LoxObj *eval_this(const Expr *expr)
+static Value eval_this(const Expr *expr)
 {
-    LoxObj *obj;
-
-    if ((obj = env_get(ENV, expr->keyword->lexeme)) == NULL)
-        log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", expr->keyword->lexeme);
-
-    return obj;
+    return lookup_var(expr->var.name, &expr->var.bind);
 }
 
 
-static LoxObj *eval_set(const Expr *expr)
+static Value eval_set(const Expr *expr)
 {
-    LoxObj *obj, *value;
+    char *name;
+    LoxObj *obj, *klass;
+    Shape *shape;
+    ICEntry *entry;
+    Value value;
 
-    if ((obj = eval(expr->set.object)) == NULL)
-        return NULL;
+    if (IS_UNDEF(value = eval(expr->set.object)))
+        return UNDEF_VAL;
 
-    if (obj->type != LOX_OBJ_INSTANCE) {
+    if (!IS_OBJ(value) || AS_OBJ(value)->type != LOX_OBJ_INSTANCE) {
         log_error(LOX_RUNTIME_ERR, "only instances have fields");
-        return NULL;
+        return UNDEF_VAL;
     }
 
-    if ((value = eval(expr->set.value)) == NULL)
-        return NULL;
+    obj = AS_OBJ(value);
+
+    GC_PUSH(obj);
+    value = eval(expr->set.value);
+    GC_POP(1);
 
-    DICT_SET(obj->instance.fields, expr->set.name->lexeme, value);
+    if (IS_UNDEF(value))
+        return UNDEF_VAL;
+
+    klass = obj->instance.klass;
+    shape = obj->instance.shape;
+
+    // a hit may still need the slow path if the field doesn't fit yet
+    entry = ic_lookup(expr->set.cache, shape, klass->klass.id);
+    if (entry != NULL && (unsigned) entry->slot < obj->instance.capacity) {
+        obj->instance.fields[entry->slot] = value;
+        GC_BARRIER(obj);
+        if (entry->next != NULL) {
+            obj->instance.shape = entry->next;
+            if (entry->next->nfields > klass->klass.nfields)
+                klass->klass.nfields = entry->next->nfields;
+        }
+        return value;
+    }
+
+    name = expr->set.name->lexeme;
+    instance_set(obj, name, value);
+
+    if (entry != NULL)
+        return value;
+
+    if (obj->instance.shape != shape)
+        ic_update(expr->set.cache, (ICEntry) {
+            shape, klass->klass.id, shape->nfields, obj->instance.shape, NULL
+        });
+    else
+        ic_update(expr->set.cache, (ICEntry) {
+            shape, klass->klass.id, shape_lookup(shape, name), NULL, NULL
+        });
 
     return value;
 }
 
 
-static LoxObj *eval_super(const Expr *expr)
+static Value eval_super(const Expr *expr)
 {
-    LoxObj *instance, *superclass, *method;
+    Value instance, superclass;
+    LoxObj *method;
 
-    instance = env_get(ENV, "this");
-    superclass = env_get(ENV, "super");
+    if (IS_UNDEF(superclass = lookup_var(expr->super.keyword, &expr->super.bind)))
+        return UNDEF_VAL;
+    if (IS_UNDEF(instance = lookup_var(expr->super.keyword, &expr->super.this)))
+        return UNDEF_VAL;
 
-    method = find_method(instance, superclass, expr->super.method->lexeme);
+    method = find_method(AS_OBJ(superclass), expr->super.method->lexeme);
 
     if (method == NULL) {
         log_error(LOX_RUNTIME_ERR, "undefined property '%s'", expr->super.method->lexeme);
-        return NULL;
+        return UNDEF_VAL;
     }
 
-    return method;
+    if (expr->local)
+        return OBJ_VAL(new_local_method_obj(AS_OBJ(instance), method));
+    return OBJ_VAL(new_method_obj(AS_OBJ(instance), method));
 }
 
 
-static LoxObj *eval_unary(const Expr *expr) 
+static Value eval_unary(const Expr *expr) 
 {
-    LoxObj *right;
+    Value right;
 
-    if ((right = eval(expr->unary.right)) == NULL)
-        return NULL;
+    if (IS_UNDEF(right = eval(expr->unary.right)))
+        return UNDEF_VAL;
 
     switch (expr->unary.op->type) {
         case TOKEN_BANG:
-            return new_bool_obj(!is_obj_truthy(right));
+            return BOOL_VAL(!is_value_truthy(right));
         case TOKEN_MINUS:
-            if (right->type != LOX_OBJ_NUMBER) {
+            if (!IS_NUMBER(right)) {
                 log_error(LOX_RUNTIME_ERR, "operand must be a number");
-                return NULL; 
+                return UNDEF_VAL; 
             }
-            return new_num_obj(right->fval * -1);
+            return NUMBER_VAL(AS_NUMBER(right) * -1);
         default:
-            return NULL;
+            return UNDEF_VAL;
     }
 }
 
 
-static LoxObj *eval_binary(const Expr *expr)
+static Value eval_binary(const Expr *expr)
 {
-    LoxObj *left, *right;
-    LoxObj *obj = NULL;
+    Value left, right;
+    Value value = UNDEF_VAL;
+    bool numbers;
 
-    if ((left = eval(expr->binary.left)) == NULL)
-        return NULL;
+    if (IS_UNDEF(left = eval(expr->binary.left)))
+        return UNDEF_VAL;
 
-    if ((right = eval(expr->binary.right)) == NULL)
-        return NULL;
+    GC_PUSH_VALUE(left);
+    if (IS_UNDEF(right = eval(expr->binary.right))) {
+        GC_POP(1);
+        return UNDEF_VAL;
+    }
+    GC_PUSH_VALUE(right);
+
+    numbers = IS_NUMBER(left) && IS_NUMBER(right);
 
     switch (expr->binary.op->type) {
         case TOKEN_MINUS:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_num_obj(left->fval - right->fval);
+            if (numbers)
+                value = NUMBER_VAL(AS_NUMBER(left) - AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
         case TOKEN_SLASH:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_num_obj(left->fval / right->fval);
+            if (numbers)
+                value = NUMBER_VAL(AS_NUMBER(left) / AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
         case TOKEN_STAR:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_num_obj(left->fval * right->fval); 
+            if (numbers)
+                value = NUMBER_VAL(AS_NUMBER(left) * AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
         case TOKEN_PLUS:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_num_obj(left->fval + right->fval);
-            else if (left->type == LOX_OBJ_STRING && right->type == LOX_OBJ_STRING)
-                obj = new_str_obj(joinstr(left->sval, right->sval));
+            if (numbers)
+                value = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+            else if (is_string(left) && is_string(right) && expr->local)
+                value = OBJ_VAL(new_local_str_obj(joinstr(AS_OBJ(left)->sval, AS_OBJ(right)->sval)));
+            else if (is_string(left) && is_string(right))
+                value = OBJ_VAL(new_str_obj(joinstr(AS_OBJ(left)->sval, AS_OBJ(right)->sval)));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be two numbers or two strings");
             break;
         case TOKEN_BANG_EQUAL:
-            obj = new_bool_obj(!is_obj_equal(left, right));
+            value = BOOL_VAL(!is_value_equal(left, right));
             break;
         case TOKEN_EQUAL_EQUAL:
-            obj = new_bool_obj(is_obj_equal(left, right));
+            value = BOOL_VAL(is_value_equal(left, right));
             break;
         case TOKEN_LESS:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_bool_obj(left->fval < right->fval); 
+            if (numbers)
+                value = BOOL_VAL(AS_NUMBER(left) < AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
         case TOKEN_LESS_EQUAL:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_bool_obj(left->fval <= right->fval); 
+            if (numbers)
+                value = BOOL_VAL(AS_NUMBER(left) <= AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
         case TOKEN_GREATER:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_bool_obj(left->fval > right->fval);
+            if (numbers)
+                value = BOOL_VAL(AS_NUMBER(left) > AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
         case TOKEN_GREATER_EQUAL:
-            if (left->type == LOX_OBJ_NUMBER && right->type == LOX_OBJ_NUMBER)
-                obj = new_bool_obj(left->fval >= right->fval);
+            if (numbers)
+                value = BOOL_VAL(AS_NUMBER(left) >= AS_NUMBER(right));
             else
                 log_error(LOX_RUNTIME_ERR, "operands must be numbers");
             break;
@@ -533,24 +629,42 @@ static LoxObj *eval_binary(const Expr *expr)
             break;
     }
 
-    // I can't free objs, cause they might be referenced by others
-    //free_obj(left);
-    //free_obj(right);
+    GC_POP(2);
 
-    return obj;
+    return value;
 }
 
 
-static LoxObj *eval_call(const Expr *expr)
+static Value eval_call(const Expr *expr)
 {
     unsigned i, arity;
-    LoxObj *callee, *arg, **args, *obj;
+    size_t roots, base;
+    LoxObj *callee, *this;
+    Value value;
     func_t f;
 
-    args = NULL;
+    this = NULL;
+    roots = gc_roots_top();
+    base = NSTACK;
+
+    // obj.method() passes obj straight to the method instead of going
+    // through a bound method
+    if (expr->call.callee->type == EXPR_GET)
+        value = get_property(expr->call.callee, &this);
+    else
+        value = eval(expr->call.callee);
+
+    if (IS_UNDEF(value))
+        return UNDEF_VAL;
 
-    if ((callee = eval(expr->call.callee)) == NULL)
-        return NULL;
+    if (!IS_OBJ(value)) {
+        log_error(LOX_RUNTIME_ERR, "can only call functions or classes");
+        return UNDEF_VAL;
+    }
+
+    callee = AS_OBJ(value);
+    GC_PUSH(callee);
+    GC_PUSH(this);
 
     switch (callee->type) {
         case LOX_OBJ_CALLABLE:
@@ -558,25 +672,26 @@ static LoxObj *eval_call(const Expr *expr)
             arity = callee->callable.arity;
             break;
         case LOX_OBJ_CLASS:
-            f = class_call;
-            arity = class_arity(callee);
+            f = expr->local ? local_class_call : class_call;
+            arity = callee->klass.arity;
             break;
         case LOX_OBJ_FUN:
             f = fun_call;
             arity = callee->fun.arity;
             break;
+        case LOX_OBJ_METHOD:
+            f = fun_call;
+            arity = callee->method.fun->fun.arity;
+            break;
         default:
             log_error(LOX_RUNTIME_ERR, "can only call functions or classes");
             goto cleanup;
     }
 
-    if (expr->call.args != NULL ) {
-        args = (LoxObj **) calloc(expr->call.argc + 1, sizeof(LoxObj *));
-        for (i = 0; i < expr->call.argc; i++) {
-            if ((arg = eval(expr->call.args[i])) == NULL)
-                goto cleanup;
-            args[i] = arg;
-        }
+    for (i = 0; i < expr->call.argc; i++) {
+        if (IS_UNDEF(value = eval(expr->call.args[i])))
+            goto cleanup;
+        push_arg(value);
     }
 
     if (expr->call.argc != arity) {
@@ -584,131 +699,283 @@ static LoxObj *eval_call(const Expr *expr)
         goto cleanup;
     }
 
-    if ((obj = f(callee, expr->call.argc, args)) == NULL)
+    // the callee gets its arguments in place, the stack only grows while
+    // they are evaluated
+    if (this != NULL)
+        value = call_fun(callee, this, expr->call.argc, STACK + base);
+    else
+        value = f(callee, expr->call.argc, STACK + base);
+
+    if (IS_UNDEF(value))
         goto cleanup;
 
-    return obj;
+    NSTACK = base;
+    gc_roots_reset(roots);
+
+    return value;
 
 cleanup:
-    if (args != NULL) free(args);
-    // maybe free obj later?
-    return NULL;
+    NSTACK = base;
+    gc_roots_reset(roots);
+    return UNDEF_VAL;
 }
 
 
-static LoxObj *class_call(LoxObj *self, unsigned argc, LoxObj **args)
+static void push_arg(Value value)
+{
+    if (NSTACK >= MAXSTACK) {
+        MAXSTACK = (MAXSTACK == 0) ? 256 : MAXSTACK * 2;
+        STACK = (Value *) realloc(STACK, MAXSTACK * sizeof(Value));
+    }
+
+    STACK[NSTACK++] = value;
+}
+
+
+static Value class_call(LoxObj *self, unsigned argc, Value *args)
+{
+    return instantiate(self, false, argc, args);
+}
+
+
+static Value local_class_call(LoxObj *self, unsigned argc, Value *args)
+{
+    return instantiate(self, true, argc, args);
+}
+
+
+// An instance the call site doesn't let escape goes in the call region,
+// unless 'init' may keep it.
+static Value instantiate(LoxObj *self, bool local, unsigned argc, Value *args)
 {
     LoxObj *instance, *init;
+    Value value;
 
-    instance = new_instance_obj(self);
+    init = self->klass.init;
+    if (local && (init == NULL || !init->fun.declaration->fun.this_escapes))
+        instance = new_local_instance_obj(self);
+    else
+        instance = new_instance_obj(self);
+    GC_PUSH(instance);
 
-    if ((init = find_method(instance, instance->instance.klass, "init")) != NULL)
-        return fun_call(init, argc, args);
+    value = OBJ_VAL(instance);
+    if (init != NULL)
+        value = call_fun(init, instance, argc, args);
 
-    return instance;
+    GC_POP(1);
+
+    return value;
 }
 
 
-static unsigned class_arity(LoxObj *self)
+static Value fun_call(LoxObj *self, unsigned argc, Value *args)
 {
-    LoxObj *init;
+    if (self->type == LOX_OBJ_METHOD)
+        return call_fun(self->method.fun, self->method.receiver, argc, args);
 
-    if ((init = DICT_GET(LoxObj, self->klass.methods, "init")) != NULL)
-        return init->fun.arity;
-    if (self->klass.superclass != NULL)
-        return class_arity(self->klass.superclass);
-    return 0;
+    return call_fun(self, NULL, argc, args);
 }
 
 
-static LoxObj *fun_call(LoxObj *self, unsigned argc, LoxObj **args)
+// Runs a function in a fresh frame that doesn't link to the caller's or the
+// declaring scope's environments: outer variables are reached via upvalues.
+// The frame holds the receiver, the parameters and the body's locals.
+// What the frame allocated in its region goes with it.
+static Value call_fun(LoxObj *fun, LoxObj *this, unsigned argc, Value *args)
 {
     unsigned i;
     Stmt *block;
     ExecResult res;
+    LoxEnv *env;
+    LoxObj *closure;
+    GCRegion region;
 
-    LoxEnv *env = ENV;
-    if (self->fun.closure != NULL)
-        ENV = enclose_env(self->fun.closure);
-    else
-        ENV = enclose_env(ENV);
+    region = gc_region_enter();
 
-    for (i = 0; i < argc; i++) {
-        env_def(ENV, self->fun.declaration->fun.params[i]->lexeme, args[i]);
-    }
+    env = ENV;
+    closure = CLOSURE;
+
+    GC_PUSH(env);
+    GC_PUSH(closure);
 
-    block = self->fun.declaration->fun.body;
-    res = exec_block_stmt(block);
+    block = fun->fun.declaration->fun.body;
+    ENV = enclose_env(NULL, block->block.nslots);
+    CLOSURE = fun;
+
+    if (this != NULL)
+        env_def(ENV, OBJ_VAL(this));
+
+    for (i = 0; i < argc; i++)
+        env_def(ENV, args[i]);
+
+    res = exec_stmts(block);
 
     ENV = disclose_env(ENV);
     ENV = env;
+    CLOSURE = closure;
+
+    GC_POP(2);
+    gc_region_leave(region);
 
     if (res.code < 0)
-        return NULL;
+        return UNDEF_VAL;
 
-    if (self->fun.init)
-        return env_get(self->fun.closure, "this");
+    if (fun->fun.init)
+        return OBJ_VAL(this);
 
-    if (res.value != NULL)
+    if (!IS_UNDEF(res.value))
         return res.value;
 
-    return new_nil_obj();
+    return NIL_VAL;
 }
 
 
-static LoxObj *eval_get(const Expr *expr)
+static LoxObj *new_closure(Stmt *stmt, bool init)
+{
+    unsigned i;
+    Upvalue *upvalue;
+    LoxObj *fun;
+
+    fun = new_fun_obj(stmt, stmt->fun.n, init);
+
+    GC_PUSH(fun);
+    for (i = 0; i < stmt->fun.nupvalues; i++) {
+        upvalue = &stmt->fun.upvalues[i];
+        if (upvalue->is_local)
+            fun->fun.upvalues[i] = env_capture(env_ancestor(ENV, upvalue->depth), upvalue->index);
+        else
+            fun->fun.upvalues[i] = CLOSURE->fun.upvalues[upvalue->index];
+        GC_BARRIER(fun);
+    }
+    GC_POP(1);
+
+    return fun;
+}
+
+
+static Value eval_get(const Expr *expr)
+{
+    LoxObj *this, *method;
+    Value value;
+
+    if (IS_UNDEF(value = get_property(expr, &this)) || this == NULL)
+        return value;
+
+    GC_PUSH(this);
+    if (expr->local)
+        method = new_local_method_obj(this, AS_OBJ(value));
+    else
+        method = new_method_obj(this, AS_OBJ(value));
+    GC_POP(1);
+
+    return OBJ_VAL(method);
+}
+
+
+// Evaluates a property without binding methods: a method is returned as is,
+// with its receiver in 'this', which is NULL for fields.
+static Value get_property(const Expr *expr, LoxObj **this)
 {
     char *name;
-    LoxObj *obj, *prop, *method;
+    int slot;
+    LoxObj *obj, *klass, *method;
+    Shape *shape;
+    ICEntry *entry;
+    Value value;
+
+    *this = NULL;
 
-    if ((obj = eval(expr->get.object)) == NULL)
-        return NULL;
+    if (IS_UNDEF(value = eval(expr->get.object)))
+        return UNDEF_VAL;
 
-    if ((obj->type != LOX_OBJ_INSTANCE)) {
+    if (!IS_OBJ(value) || AS_OBJ(value)->type != LOX_OBJ_INSTANCE) {
         log_error(LOX_RUNTIME_ERR, "only instances have properties");
-        return NULL;
+        return UNDEF_VAL;
+    }
+
+    obj = AS_OBJ(value);
+    klass = obj->instance.klass;
+    shape = obj->instance.shape;
+
+    if ((entry = ic_lookup(expr->get.cache, shape, klass->klass.id)) != NULL) {
+        if (entry->method == NULL)
+            return obj->instance.fields[entry->slot];
+        *this = obj;
+        return OBJ_VAL(entry->method);
     }
 
     name = expr->get.name->lexeme;
 
-    if ((prop = DICT_GET(LoxObj, obj->instance.fields, name)) != NULL)
-        return prop;
+    if ((slot = shape_lookup(shape, name)) >= 0) {
+        ic_update(expr->get.cache, (ICEntry) { shape, klass->klass.id, slot, NULL, NULL });
+        return obj->instance.fields[slot];
+    }
+
+    if ((method = find_method(klass, name)) == NULL) {
+        log_error(LOX_RUNTIME_ERR, "undefined property '%s'", name);
+        return UNDEF_VAL;
+    }
 
-    if ((method = find_method(obj, obj->instance.klass, name)) != NULL)
-        return method;
+    ic_update(expr->get.cache, (ICEntry) { shape, klass->klass.id, -1, NULL, method });
 
-    log_error(LOX_RUNTIME_ERR, "undefined property '%s'", name);
-    return NULL;
+    *this = obj;
+    return OBJ_VAL(method);
 }
 
 
-static LoxObj *eval_literal(const Expr *expr)
+static Value eval_literal(const Expr *expr)
 {
-    switch (expr->literal->type) {
-        case TOKEN_NUMBER:
-            return new_num_obj(atof(expr->literal->lexeme));
-        case TOKEN_STRING:
-            return new_str_obj(strdup(expr->literal->lexeme));
-        case TOKEN_FALSE:
-            return new_bool_obj(false);
-        case TOKEN_TRUE:
-            return new_bool_obj(true);
-        case TOKEN_NIL:
-            return new_nil_obj();
-        default:
-            return NULL;
-    }
+    return expr->literal.value;
 }
 
 
-static LoxObj *eval_var(const Expr *expr)
+static Value eval_var(const Expr *expr)
 {
-    LoxObj *obj;
+    return lookup_var(expr->var.name, &expr->var.bind);
+}
+
 
-    if ((obj = env_get(ENV, expr->varname->lexeme)) == NULL)
-        log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", expr->varname->lexeme);
+static Value lookup_var(const Token *name, const Binding *bind)
+{
+    Value value;
+
+    if (bind->depth == EXPR_GLOBAL)
+        value = global_get(bind->slot);
+    else if (bind->depth == EXPR_UPVALUE)
+        value = *CLOSURE->fun.upvalues[bind->slot]->upvalue.location;
+    else
+        value = ENV_GET_AT(ENV, bind->depth, bind->slot);
 
-    return obj;
+    if (IS_UNDEF(value))
+        log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", name->lexeme);
+
+    return value;
+}
+
+
+static void assign_var(const Binding *bind, Value value)
+{
+    LoxObj *upvalue;
+
+    if (bind->depth == EXPR_GLOBAL) {
+        global_set(bind->slot, value);
+    } else if (bind->depth == EXPR_UPVALUE) {
+        upvalue = CLOSURE->fun.upvalues[bind->slot];
+        *upvalue->upvalue.location = value;
+        GC_BARRIER(upvalue);
+    } else {
+        ENV_SET_AT(ENV, bind->depth, bind->slot, value);
+    }
+}
+
+
+// Outside of any scope the name is a global.
+static void define_var(char *name, Value value)
+{
+    if (ENV == NULL)
+        global_set(global_slot(name), value);
+    else
+        env_def(ENV, value);
 }
 
 
@@ -720,34 +987,22 @@ static char *joinstr(const char *s1, const char *s2)
     len1 = strlen(s1);
     len2 = strlen(s2);
 
-    s = (char *) malloc((len1 + len2) * sizeof(char));
-    strcat(s, s1);
-    strcat(s + len1, s2);
+    s = (char *) malloc((len1 + len2 + 1) * sizeof(char));
+    memcpy(s, s1, len1);
+    memcpy(s + len1, s2, len2 + 1);
 
     return s;
 }
 
 
-static LoxObj *find_method(LoxObj *obj, LoxObj *klass, char *name)
+static bool is_string(Value value)
 {
-    LoxEnv *env;
-    LoxObj *prop, *method;
-
-    method = NULL;
-    if ((prop = DICT_GET(LoxObj, klass->klass.methods, name)) != NULL) {
-        method = new_fun_obj(prop->fun.declaration, prop->fun.arity, prop->fun.init);
-
-        if (prop->fun.closure != NULL)
-            env = enclose_env(prop->fun.closure);
-        else
-            env = enclose_env(ENV);
-        
-        env_def(env, "this", obj);
-        method->fun.closure = env;
-    }
+    return IS_OBJ(value) && AS_OBJ(value)->type == LOX_OBJ_STRING;
+}
 
-    if (method == NULL && klass->klass.superclass != NULL)
-        return find_method(obj, klass->klass.superclass, name);
 
-    return method;
+// Subclasses hold the methods they inherit, see class_inherit().
+static LoxObj *find_method(LoxObj *klass, char *name)
+{
+    return DICT_GET(LoxObj, klass->klass.methods, name);
 }
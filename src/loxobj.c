@@ -4,23 +4,21 @@
 #include <string.h>
 
 #include "dict.h"
+#include "gc.h"
 #include "loxobj.h"
 
+#define INSTANCE_SIZE(klass) (sizeof(LoxObj) + (klass)->klass.nfields * sizeof(Value))
 
-LoxObj *new_bool_obj(bool val)
-{
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
-
-    obj->type = LOX_OBJ_BOOL;
-    obj->bval = val;
+static LoxObj *init_instance(LoxObj *obj, LoxObj *klass);
+static LoxObj *init_method(LoxObj *obj, LoxObj *receiver, LoxObj *fun);
+static LoxObj *init_str(LoxObj *obj, char *s);
 
-    return obj;
-}
+static unsigned NEXT_CLASS_ID = 1;
 
 
 LoxObj *new_callable_obj(unsigned arity, func_t func)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    LoxObj *obj = (LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ);
 
     obj->type = LOX_OBJ_CALLABLE;
     obj->callable.arity = arity;
@@ -32,26 +30,57 @@ LoxObj *new_callable_obj(unsigned arity, func_t func)
 
 LoxObj *new_class_obj(char *name, LoxObj *superclass, Dict *methods)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    LoxObj *obj = (LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ);
 
     obj->type = LOX_OBJ_CLASS;
+    obj->klass.id = NEXT_CLASS_ID++;
     obj->klass.name = strdup(name);
+    gc_grow(&obj->gc, strlen(name) + 1);
     obj->klass.superclass = superclass;
     obj->klass.methods = methods;
+    obj->klass.init = NULL;
+    obj->klass.arity = 0;
+    obj->klass.nfields = 0;
     
     return obj;
 }
 
 
+LoxObj *new_closure_obj(LoxObj *proto)
+{
+    LoxObj *obj = (LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ);
+
+    obj->type = LOX_OBJ_FUN;
+    obj->fun.declaration = NULL;
+    obj->fun.proto = proto;
+    obj->fun.arity = proto->proto.arity;
+    obj->fun.init = proto->proto.init;
+    obj->fun.nupvalues = proto->proto.nupvalues;
+    obj->fun.upvalues = NULL;
+    if (obj->fun.nupvalues > 0) {
+        obj->fun.upvalues = (LoxObj **) calloc(obj->fun.nupvalues, sizeof(LoxObj *));
+        gc_grow(&obj->gc, obj->fun.nupvalues * sizeof(LoxObj *));
+    }
+
+    return obj;
+}
+
+
 LoxObj *new_fun_obj(Stmt *declaration, unsigned arity, bool init)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    LoxObj *obj = (LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ);
 
     obj->type = LOX_OBJ_FUN;
     obj->fun.declaration = declaration;
+    obj->fun.proto = NULL;
     obj->fun.arity = arity;
     obj->fun.init = init;
-    obj->fun.closure = NULL;
+    obj->fun.nupvalues = declaration->fun.nupvalues;
+    obj->fun.upvalues = NULL;
+    if (obj->fun.nupvalues > 0) {
+        obj->fun.upvalues = (LoxObj **) calloc(obj->fun.nupvalues, sizeof(LoxObj *));
+        gc_grow(&obj->gc, obj->fun.nupvalues * sizeof(LoxObj *));
+    }
 
     return obj;
 }
@@ -59,32 +88,38 @@ LoxObj *new_fun_obj(Stmt *declaration, unsigned arity, bool init)
 
 LoxObj *new_instance_obj(LoxObj *klass)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    return init_instance((LoxObj *) gc_alloc(INSTANCE_SIZE(klass), GC_KIND_OBJ), klass);
+}
 
-    obj->type = LOX_OBJ_INSTANCE;
-    obj->instance.klass = klass;
-    obj->instance.fields = Dict_New();
 
-    return obj;
+LoxObj *new_local_instance_obj(LoxObj *klass)
+{
+    return init_instance((LoxObj *) gc_alloc_local(INSTANCE_SIZE(klass), GC_KIND_OBJ), klass);
 }
 
 
-LoxObj *new_nil_obj()
+LoxObj *new_method_obj(LoxObj *receiver, LoxObj *fun)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    return init_method((LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ), receiver, fun);
+}
 
-    obj->type = LOX_OBJ_NIL;
-    
-    return obj;
+
+LoxObj *new_local_method_obj(LoxObj *receiver, LoxObj *fun)
+{
+    return init_method((LoxObj *) gc_alloc_local(sizeof(LoxObj), GC_KIND_OBJ), receiver, fun);
 }
 
 
-LoxObj *new_num_obj(float val)
+LoxObj *new_proto_obj(char *name, unsigned arity, bool init)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    LoxObj *obj = (LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ);
 
-    obj->type = LOX_OBJ_NUMBER;
-    obj->fval = val;
+    obj->type = LOX_OBJ_PROTO;
+    obj->proto.name = (name != NULL) ? strdup(name) : NULL;
+    obj->proto.arity = arity;
+    obj->proto.init = init;
+    obj->proto.nupvalues = 0;
+    obj->proto.chunk = new_chunk();
 
     return obj;
 }
@@ -92,59 +127,139 @@ LoxObj *new_num_obj(float val)
 
 LoxObj *new_str_obj(char *s)
 {
-    LoxObj *obj = (LoxObj *) malloc(sizeof(LoxObj));
+    return init_str((LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ), s);
+}
 
-    obj->type = LOX_OBJ_STRING;
-    obj->sval = s;
+
+LoxObj *new_local_str_obj(char *s)
+{
+    return init_str((LoxObj *) gc_alloc_local(sizeof(LoxObj), GC_KIND_OBJ), s);
+}
+
+
+LoxObj *new_upvalue_obj(Value *location)
+{
+    LoxObj *obj = (LoxObj *) gc_alloc(sizeof(LoxObj), GC_KIND_OBJ);
+
+    obj->type = LOX_OBJ_UPVALUE;
+    obj->upvalue.location = location;
+    obj->upvalue.closed = UNDEF_VAL;
+    obj->upvalue.next = NULL;
 
     return obj;
 }
 
-    
+
+// Releases what the object owns, its own memory belongs to the collector.
 void free_obj(LoxObj *obj)
 {
     switch (obj->type) {
+        case LOX_OBJ_CLASS:
+            free(obj->klass.name);
+            Dict_Free(obj->klass.methods);
+            break;
+        case LOX_OBJ_FUN:
+            free(obj->fun.upvalues);
+            break;
+        case LOX_OBJ_INSTANCE:
+            if (obj->instance.fields != (Value *) (obj + 1))
+                free(obj->instance.fields);
+            break;
+        case LOX_OBJ_PROTO:
+            free(obj->proto.name);
+            free_chunk(obj->proto.chunk);
+            break;
         case LOX_OBJ_STRING:
             free(obj->sval);
             break;
         default:
             break;
     }
+}
+
+
+Value instance_get(LoxObj *instance, char *name)
+{
+    int slot;
+
+    if ((slot = shape_lookup(instance->instance.shape, name)) < 0)
+        return UNDEF_VAL;
 
-    free(obj);
+    return instance->instance.fields[slot];
 }
 
 
-bool is_obj_truthy(const LoxObj *obj) 
+void instance_set(LoxObj *instance, char *name, Value value)
 {
-    switch (obj->type) {
-        case LOX_OBJ_BOOL:
-            return (obj->bval == true);
-        case LOX_OBJ_NIL:
-            return false;
-        default:
-            return true;
+    int slot;
+    unsigned capacity;
+    Value *fields;
+    Shape *shape;
+
+    if ((slot = shape_lookup(instance->instance.shape, name)) >= 0) {
+        instance->instance.fields[slot] = value;
+        GC_BARRIER(instance);
+        return;
     }
+
+    shape = shape_add(instance->instance.shape, name);
+
+    if (shape->nfields > instance->instance.capacity) {
+        capacity = (instance->instance.capacity < 2) ? 4 : instance->instance.capacity * 2;
+        fields = (Value *) malloc(capacity * sizeof(Value));
+        memcpy(fields, instance->instance.fields, instance->instance.capacity * sizeof(Value));
+
+        if (instance->instance.fields != (Value *) (instance + 1)) {
+            free(instance->instance.fields);
+            gc_grow(&instance->gc, (capacity - instance->instance.capacity) * sizeof(Value));
+        } else {
+            gc_grow(&instance->gc, capacity * sizeof(Value));
+        }
+
+        instance->instance.fields = fields;
+        instance->instance.capacity = capacity;
+    }
+
+    instance->instance.fields[shape->nfields - 1] = value;
+    instance->instance.shape = shape;
+    GC_BARRIER(instance);
+
+    if (shape->nfields > instance->instance.klass->klass.nfields)
+        instance->instance.klass->klass.nfields = shape->nfields;
 }
 
 
-bool is_obj_equal(const LoxObj *a, const LoxObj *b)
+// Methods are copied down: a class holds those it inherits along with its
+// own, so finding one is a single probe however deep the hierarchy is. Call
+// it before adding the class's own methods, they override.
+void class_inherit(LoxObj *klass)
 {
-    if (a->type == LOX_OBJ_NIL && b->type == LOX_OBJ_NIL)
-        return true;
-    if (a->type == LOX_OBJ_NIL)
-        return false;
-    if (a->type != b->type)
-        return false;
-    
-    if (a->type == LOX_OBJ_BOOL)
-        return a->bval == b->bval;
-    if (a->type == LOX_OBJ_NUMBER)
-        return a->fval == b->fval;
-    if (a->type == LOX_OBJ_STRING)
-        return strcmp(a->sval, b->sval) == 0;
+    size_t pos;
+    char *name;
+    Value method;
+    LoxObj *superclass;
+
+    superclass = klass->klass.superclass;
+
+    pos = 0;
+    while (Dict_Next(superclass->klass.methods, &pos, &name, &method))
+        Dict_Set(klass->klass.methods, name, method);
+
+    klass->klass.init = superclass->klass.init;
+    klass->klass.arity = superclass->klass.arity;
+    GC_BARRIER(klass);
+}
+
+
+void class_add_method(LoxObj *klass, char *name, LoxObj *method)
+{
+    DICT_SET(klass->klass.methods, name, method);
 
-    return false;
+    if (strcmp(name, "init") == 0) {
+        klass->klass.init = method;
+        klass->klass.arity = method->fun.arity;
+    }
+    GC_BARRIER(klass);
 }
 
 
@@ -154,42 +269,66 @@ char *str_obj(const LoxObj *obj)
     size_t n;
 
     switch (obj->type) {
-        case LOX_OBJ_BOOL:
-            return strdup((obj->bval) ? "true" : "false");
         case LOX_OBJ_CALLABLE:
             return strdup("<native>");
         case LOX_OBJ_CLASS:
             return strdup(obj->klass.name);
         case LOX_OBJ_FUN:
+            if (obj->fun.proto != NULL)
+                return str_obj(obj->fun.proto);
             n = strlen("<fn >") + strlen(obj->fun.declaration->fun.name);
             s = (char *) calloc(n + 1, sizeof(char));
             sprintf(s, "<fn %s>", obj->fun.declaration->fun.name);
             return s;
         case LOX_OBJ_INSTANCE:
-            n = strlen(obj->instance.klass->klass.name) + strlen("instance");
+            n = strlen("instance ") + strlen(obj->instance.klass->klass.name);
             s = (char *) calloc(n + 1, sizeof(char));
             sprintf(s, "instance %s", obj->instance.klass->klass.name);
             return s;
-        case LOX_OBJ_NUMBER:
-            n = snprintf(NULL, 0, "%f", obj->fval);
-            s = (char *) malloc(n * sizeof(char));
-            sprintf(s, "%f", obj->fval);
+        case LOX_OBJ_METHOD:
+            return str_obj(obj->method.fun);
+        case LOX_OBJ_PROTO:
+            if (obj->proto.name == NULL)
+                return strdup("<script>");
+            n = strlen("<fn >") + strlen(obj->proto.name);
+            s = (char *) calloc(n + 1, sizeof(char));
+            sprintf(s, "<fn %s>", obj->proto.name);
             return s;
         case LOX_OBJ_STRING:
             return strdup(obj->sval);
-        case LOX_OBJ_NIL:
-            return strdup("nil");
         default:
             return NULL;
     }
 }
 
 
-void print_obj(const LoxObj *obj)
+static LoxObj *init_instance(LoxObj *obj, LoxObj *klass)
 {
-    char *s;
+    obj->type = LOX_OBJ_INSTANCE;
+    obj->instance.klass = klass;
+    obj->instance.shape = shape_root();
+    obj->instance.capacity = klass->klass.nfields;
+    obj->instance.fields = (Value *) (obj + 1);
 
-    s = str_obj(obj);
-    printf("%s\n", s);
-    free(s);
+    return obj;
+}
+
+
+static LoxObj *init_method(LoxObj *obj, LoxObj *receiver, LoxObj *fun)
+{
+    obj->type = LOX_OBJ_METHOD;
+    obj->method.receiver = receiver;
+    obj->method.fun = fun;
+
+    return obj;
+}
+
+
+static LoxObj *init_str(LoxObj *obj, char *s)
+{
+    obj->type = LOX_OBJ_STRING;
+    obj->sval = s;
+    gc_grow(&obj->gc, strlen(s) + 1);
+
+    return obj;
 }
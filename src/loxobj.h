@@ -3,70 +3,113 @@
 
 #include <stdbool.h>
 
+#include "chunk.h"
 #include "dict.h"
+#include "gc.h"
+#include "shape.h"
 #include "stmt.h"
+#include "value.h"
 
 struct loxenv;  // forward declaration for LoxEnv
 
+// Numbers, booleans and nil are immediates (see value.h), only values that
+// need the heap are objects.
 enum LoxObjType {
-    LOX_OBJ_BOOL = 0,
-    LOX_OBJ_CALLABLE,
+    LOX_OBJ_CALLABLE = 0,
     LOX_OBJ_CLASS,
     LOX_OBJ_FUN,
     LOX_OBJ_INSTANCE,
-    LOX_OBJ_NIL,
-    LOX_OBJ_NUMBER,
+    LOX_OBJ_METHOD,
+    LOX_OBJ_PROTO,
     LOX_OBJ_STRING,
+    LOX_OBJ_UPVALUE,
 };
 
 struct loxobj;
 
-typedef struct loxobj *(*func_t)(struct loxobj *self, unsigned argc, struct loxobj **args);
+typedef Value (*func_t)(struct loxobj *self, unsigned argc, Value *args);
 
 typedef struct loxobj {
+    GCObj gc;
     enum LoxObjType type;
     union {
-        bool bval;
-        float fval;
         char *sval;
         struct {
             unsigned arity;
             func_t func;
         } callable;
         struct {
-            struct loxenv *closure;
-            Stmt *declaration;
+            Stmt *declaration;          // NULL for compiled functions
+            struct loxobj *proto;       // NULL for tree-walked functions
             unsigned arity;
             bool init;
+            unsigned nupvalues;
+            struct loxobj **upvalues;
         } fun;
         struct {
+            // 'fields' starts out pointing to slots allocated right after
+            // the object and moves to the heap if they run out
             struct loxobj *klass;
-            Dict *fields;
+            Shape *shape;
+            unsigned capacity;
+            Value *fields;
         } instance;
         struct {
+            // compiled body of a function, shared by all its closures
             char *name;
+            unsigned arity;
+            bool init;
+            unsigned nupvalues;
+            Chunk *chunk;
+        } proto;
+        struct {
+            struct loxobj *receiver;
+            struct loxobj *fun;
+        } method;
+        struct {
+            // points into an environment slot while the variable is in
+            // scope, and to 'closed' once the scope is gone
+            Value *location;
+            Value closed;
+            struct loxobj *next;
+        } upvalue;
+        struct {
+            char *name;
+            unsigned id;        // unique, keys inline caches
             struct loxobj *superclass;
-            Dict *methods;
+            Dict *methods;      // inherited ones included
+            struct loxobj *init;
+            unsigned arity;     // of 'init', 0 without one
+            unsigned nfields;   // most fields seen on an instance, sizes new ones
         } klass;
     };
 } LoxObj;
 
 
-LoxObj *new_bool_obj(bool val);
 LoxObj *new_callable_obj(unsigned arity, func_t func);
+LoxObj *new_closure_obj(LoxObj *proto);
 LoxObj *new_class_obj(char *name, LoxObj *superclass, Dict *methods);
 LoxObj *new_fun_obj(Stmt *declaration, unsigned arity, bool init);
 LoxObj *new_instance_obj(LoxObj *klass);
-LoxObj *new_nil_obj();
-LoxObj *new_num_obj(float val);
+LoxObj *new_method_obj(LoxObj *receiver, LoxObj *fun);
+LoxObj *new_proto_obj(char *name, unsigned arity, bool init);
 LoxObj *new_str_obj(char *s);
+LoxObj *new_upvalue_obj(Value *location);
+
+// Like the above, but allocated from the running call's region: only for
+// values that can't outlive it (see gc_alloc_local()).
+LoxObj *new_local_instance_obj(LoxObj *klass);
+LoxObj *new_local_method_obj(LoxObj *receiver, LoxObj *fun);
+LoxObj *new_local_str_obj(char *s);
 
 void free_obj(LoxObj *obj);
 
-bool is_obj_truthy(const LoxObj *obj);
-bool is_obj_equal(const LoxObj *left, const LoxObj *right);
+Value instance_get(LoxObj *instance, char *name);
+void instance_set(LoxObj *instance, char *name, Value value);
+
+void class_inherit(LoxObj *klass);
+void class_add_method(LoxObj *klass, char *name, LoxObj *method);
 
 char *str_obj(const LoxObj *obj);
-void print_obj(const LoxObj *obj);
 
 #endif
@@ -1,56 +1,208 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "cache.h"
+#include "constant.h"
+#include "dict.h"
+#include "environment.h"
 #include "expr.h"
+#include "gc.h"
+#include "globals.h"
 #include "interpreter.h"
+#include "optimizer.h"
 #include "parser.h"
 #include "resolver.h"
 #include "scanner.h"
+#include "shape.h"
+#include "slab.h"
 #include "stmt.h"
+#include "vm.h"
+
+static void usage();
+static char *map_file(const char *path, size_t *size);
+static void run_source(Arena *arena, const char *source, size_t size, int (*run)(Stmt **stmts));
+
+static int OPT_LEVEL = 1;
+
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--engine=ast|vm] [-O0|-O1] [--gc-incremental=usec] [--gc-threads=n] [--gc-sweep=eager|lazy] [--gc-compact] [--gc-stats] [--ic-stats] [--alloc-stats] [--opt-stats] [path]\n");
+    exit(1);
+}
+
 
 int main(int argc, char *argv[])
 {
-    FILE *source;
-    Token *tokens;
-    Stmt **stmts;
+    int i, budget, nthreads;
+    bool gc_stats, ic_stats, alloc_stats, opt_stats;
+    int (*run)(Stmt **stmts);
+    char *path, *source, *line;
+    size_t size, cap;
+    ssize_t n;
+    Arena arena = ARENA_INIT;
 
-    if (argc == 2) {
-        source = fopen(argv[1], "rb");
-        if (source == NULL) {
-            fprintf(stderr, "Could not open file \"%s\".\n", argv[1]);
+    path = NULL;
+    gc_stats = ic_stats = alloc_stats = opt_stats = false;
+    run = interpret;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc-stats") == 0)
+            gc_stats = true;
+        else if (strcmp(argv[i], "--ic-stats") == 0)
+            ic_stats = true;
+        else if (strcmp(argv[i], "--alloc-stats") == 0)
+            alloc_stats = true;
+        else if (strcmp(argv[i], "--opt-stats") == 0)
+            opt_stats = true;
+        else if (strncmp(argv[i], "--gc-incremental=", 17) == 0) {
+            if ((budget = atoi(argv[i] + 17)) <= 0)
+                usage();
+            gc_set_incremental(budget);
+        } else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            if ((nthreads = atoi(argv[i] + 13)) <= 0)
+                usage();
+            gc_set_threads(nthreads);
+        } else if (strcmp(argv[i], "--gc-sweep=eager") == 0) {
+            gc_set_lazy_sweep(false);
+        } else if (strcmp(argv[i], "--gc-sweep=lazy") == 0) {
+            gc_set_lazy_sweep(true);
+        } else if (strcmp(argv[i], "--gc-compact") == 0) {
+            gc_set_compact(true);
+        } else if (strcmp(argv[i], "-O0") == 0)
+            OPT_LEVEL = 0;
+        else if (strcmp(argv[i], "-O1") == 0)
+            OPT_LEVEL = 1;
+        else if (strcmp(argv[i], "--engine=ast") == 0)
+            run = interpret;
+        else if (strcmp(argv[i], "--engine=vm") == 0)
+            run = vm_interpret;
+        else if (argv[i][0] == '-' || path != NULL)
+            usage();
+        else
+            path = argv[i];
+    }
+
+    if (path != NULL) {
+        if ((source = map_file(path, &size)) == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
             exit(1);
         }
-    } else if (argc == 1) {
-        source = stdin;
+        run_source(&arena, source, size, run);
+        if (size > 0)
+            munmap(source, size);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(1);
+        line = NULL;
+        cap = 0;
+        for (;;) {
+            printf("lox > ");
+            if ((n = getline(&line, &cap, stdin)) < 0)
+                break;
+            run_source(&arena, line, n, run);
+        }
+        free(line);
     }
 
-    for (;;) {
-        if (feof(source))
-            break;
+    if (gc_stats)
+        gc_print_stats();
+    if (ic_stats)
+        ic_print_stats();
+    if (alloc_stats)
+        slab_print_stats();
+    if (opt_stats)
+        opt_print_stats();
 
-        if (source == stdin)
-            printf("lox > ");
+    gc_free_all();
+    free_frames();
+    free_arena(&arena);
+    free_constants();
+    free_globals();
+    free_shapes();
+    ic_free_all();
+    Dict_FreeKeys();
+    slab_free_all();
+
+    return 0;
+}
 
-        if ((tokens = scan(source)) == NULL)
-            continue;
 
-        if ((stmts = parse(tokens)) == NULL)
-            continue;
+// Scripts are scanned in place, without reading them into a buffer first.
+static char *map_file(const char *path, size_t *size)
+{
+    int fd;
+    char *source;
+    struct stat st;
 
-        if (resolve(stmts) != 0)
-            continue;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
 
-        if (interpret(stmts) != 0)
-            continue;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
 
-        free_stmts(stmts);
-        free_tokens(tokens); 
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return "";
     }
 
-    fclose(source);
+    source = (char *) mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    return 0;
+    return (source == MAP_FAILED) ? NULL : source;
+}
+
+
+// Tokens, the AST, its constants and inline caches are dropped together once the
+// source has run, or as soon as it fails to parse or resolve. Functions
+// created by the tree-walk interpreter point into the AST, so a source
+// that declares any is kept around until exit.
+static void run_source(Arena *arena, const char *source, size_t size, int (*run)(Stmt **stmts))
+{
+    unsigned i;
+    bool keep;
+    size_t constants;
+    ArenaMark mark;
+    InlineCache *sites;
+    Token *tokens;
+    Stmt **stmts;
+
+    if ((tokens = scan(source, size)) == NULL)
+        return;
+
+    mark = arena_mark(arena);
+    constants = constants_top();
+    sites = ic_top();
+    arena_own(arena, tokens);
+
+    if ((stmts = parse(tokens, arena)) == NULL || resolve(stmts, arena) != 0) {
+        ic_reset(sites);
+        arena_reset(arena, mark);
+        constants_reset(constants);
+        return;
+    }
+
+    if (OPT_LEVEL > 0)
+        optimize(stmts, arena);
+
+    run(stmts);
+
+    keep = false;
+    if (run == interpret)
+        for (i = 0; stmts[i] != NULL && !keep; i++)
+            keep = declares_fun(stmts[i]);
+
+    if (!keep) {
+        ic_reset(sites);
+        arena_reset(arena, mark);
+        constants_reset(constants);
+    }
 }
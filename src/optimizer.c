@@ -0,0 +1,343 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "constant.h"
+#include "expr.h"
+#include "loxobj.h"
+#include "optimizer.h"
+#include "stmt.h"
+
+#define IS_CONSTANT(expr) ((expr)->type == EXPR_LITERAL)
+
+static Stmt *fold_stmt(Stmt *stmt);
+static Stmt *fold_branch(Stmt *stmt);
+static void fold_block(Stmt *stmt);
+static Expr *fold_expr(Expr *expr);
+static Expr *fold_binary(Expr *expr);
+static Expr *fold_logic(Expr *expr);
+static Expr *fold_unary(Expr *expr);
+static Expr *fold_var(Expr *expr);
+static Expr *new_folded(Token *token, Value value);
+static Value concat(Value left, Value right);
+static bool is_string(Value value);
+
+static Arena *ARENA = NULL;
+static size_t FOLDED = 0;
+static size_t PROPAGATED = 0;
+static size_t PRUNED = 0;
+
+
+void optimize(Stmt **stmts, Arena *arena)
+{
+    unsigned i, n;
+    Stmt *stmt;
+
+    ARENA = arena;
+
+    for (i = n = 0; stmts[i] != NULL; i++)
+        if ((stmt = fold_stmt(stmts[i])) != NULL)
+            stmts[n++] = stmt;
+    stmts[n] = NULL;
+
+    ARENA = NULL;
+}
+
+
+void opt_print_stats()
+{
+    fprintf(stderr, "opt: folded:          %zu\n", FOLDED);
+    fprintf(stderr, "opt: propagated:      %zu\n", PROPAGATED);
+    fprintf(stderr, "opt: pruned:          %zu\n", PRUNED);
+}
+
+
+// Returns the statement to run instead, NULL if there's nothing left to run.
+static Stmt *fold_stmt(Stmt *stmt)
+{
+    unsigned i;
+    Expr *cond;
+
+    switch (stmt->type) {
+        case STMT_BLOCK:
+            fold_block(stmt);
+            return (stmt->block.n > 0) ? stmt : NULL;
+        case STMT_CLASS:
+            for (i = 0; i < stmt->klass.n; i++)
+                fold_block(stmt->klass.methods[i]->fun.body);
+            return stmt;
+        case STMT_EXPR:
+            stmt->expr = fold_expr(stmt->expr);
+            return IS_CONSTANT(stmt->expr) ? NULL : stmt;
+        case STMT_FUN:
+            fold_block(stmt->fun.body);
+            return stmt;
+        case STMT_IF:
+            cond = stmt->ifelse.cond = fold_expr(stmt->ifelse.cond);
+            if (IS_CONSTANT(cond)) {
+                PRUNED++;
+                if (is_value_truthy(cond->literal.value))
+                    return fold_stmt(stmt->ifelse.conseq);
+                return (stmt->ifelse.alt != NULL) ? fold_stmt(stmt->ifelse.alt) : NULL;
+            }
+            stmt->ifelse.conseq = fold_branch(stmt->ifelse.conseq);
+            if (stmt->ifelse.alt != NULL)
+                stmt->ifelse.alt = fold_stmt(stmt->ifelse.alt);
+            return stmt;
+        case STMT_PRINT:
+        case STMT_RETURN:
+            if (stmt->expr != NULL)
+                stmt->expr = fold_expr(stmt->expr);
+            return stmt;
+        case STMT_VAR:
+            if (stmt->var.expr != NULL)
+                stmt->var.expr = fold_expr(stmt->var.expr);
+            return stmt;
+        case STMT_WHILE:
+            if ((cond = stmt->whileloop.cond) != NULL) {
+                cond = stmt->whileloop.cond = fold_expr(cond);
+                if (IS_CONSTANT(cond) && !is_value_truthy(cond->literal.value)) {
+                    PRUNED++;
+                    return NULL;
+                }
+            }
+            stmt->whileloop.body = fold_branch(stmt->whileloop.body);
+            return stmt;
+        default:
+            return stmt;
+    }
+}
+
+
+// Loop bodies and the 'then' branch can't be left out, an empty block
+// stands in for them once they fold away.
+static Stmt *fold_branch(Stmt *stmt)
+{
+    if ((stmt = fold_stmt(stmt)) == NULL)
+        stmt = new_block_stmt(ARENA, 0, NULL);
+
+    return stmt;
+}
+
+
+static void fold_block(Stmt *stmt)
+{
+    unsigned i, n;
+    Stmt *folded;
+
+    for (i = n = 0; i < stmt->block.n; i++)
+        if ((folded = fold_stmt(stmt->block.stmts[i])) != NULL)
+            stmt->block.stmts[n++] = folded;
+
+    stmt->block.n = n;
+}
+
+
+static Expr *fold_expr(Expr *expr)
+{
+    unsigned i;
+
+    switch (expr->type) {
+        case EXPR_ASSIGN:
+            expr->assign.value = fold_expr(expr->assign.value);
+            return expr;
+        case EXPR_BINARY:
+            return fold_binary(expr);
+        case EXPR_CALL:
+            expr->call.callee = fold_expr(expr->call.callee);
+            for (i = 0; i < expr->call.argc; i++)
+                expr->call.args[i] = fold_expr(expr->call.args[i]);
+            return expr;
+        case EXPR_GET:
+            expr->get.object = fold_expr(expr->get.object);
+            return expr;
+        case EXPR_GROUPING:
+            return fold_expr(expr->grouping);
+        case EXPR_LOGIC:
+            return fold_logic(expr);
+        case EXPR_SET:
+            expr->set.object = fold_expr(expr->set.object);
+            expr->set.value = fold_expr(expr->set.value);
+            return expr;
+        case EXPR_UNARY:
+            return fold_unary(expr);
+        case EXPR_VAR:
+            return fold_var(expr);
+        default:
+            return expr;
+    }
+}
+
+
+static Expr *fold_binary(Expr *expr)
+{
+    bool numbers;
+    double a, b;
+    Value left, right, value;
+
+    expr->binary.left = fold_expr(expr->binary.left);
+    expr->binary.right = fold_expr(expr->binary.right);
+
+    if (!IS_CONSTANT(expr->binary.left) || !IS_CONSTANT(expr->binary.right))
+        return expr;
+
+    left = expr->binary.left->literal.value;
+    right = expr->binary.right->literal.value;
+
+    numbers = IS_NUMBER(left) && IS_NUMBER(right);
+    a = numbers ? AS_NUMBER(left) : 0;
+    b = numbers ? AS_NUMBER(right) : 0;
+
+    // operand type errors are not folded, the runtime reports them
+    switch (expr->binary.op->type) {
+        case TOKEN_MINUS:
+            value = numbers ? NUMBER_VAL(a - b) : UNDEF_VAL;
+            break;
+        case TOKEN_SLASH:
+            value = numbers ? NUMBER_VAL(a / b) : UNDEF_VAL;
+            break;
+        case TOKEN_STAR:
+            value = numbers ? NUMBER_VAL(a * b) : UNDEF_VAL;
+            break;
+        case TOKEN_PLUS:
+            if (numbers)
+                value = NUMBER_VAL(a + b);
+            else if (is_string(left) && is_string(right))
+                value = concat(left, right);
+            else
+                value = UNDEF_VAL;
+            break;
+        case TOKEN_BANG_EQUAL:
+            value = BOOL_VAL(!is_value_equal(left, right));
+            break;
+        case TOKEN_EQUAL_EQUAL:
+            value = BOOL_VAL(is_value_equal(left, right));
+            break;
+        case TOKEN_LESS:
+            value = numbers ? BOOL_VAL(a < b) : UNDEF_VAL;
+            break;
+        case TOKEN_LESS_EQUAL:
+            value = numbers ? BOOL_VAL(a <= b) : UNDEF_VAL;
+            break;
+        case TOKEN_GREATER:
+            value = numbers ? BOOL_VAL(a > b) : UNDEF_VAL;
+            break;
+        case TOKEN_GREATER_EQUAL:
+            value = numbers ? BOOL_VAL(a >= b) : UNDEF_VAL;
+            break;
+        default:
+            value = UNDEF_VAL;
+            break;
+    }
+
+    if (IS_UNDEF(value))
+        return expr;
+
+    FOLDED++;
+    return new_folded(expr->binary.op, value);
+}
+
+
+static Expr *fold_logic(Expr *expr)
+{
+    bool truthy;
+    Expr *left, *right;
+
+    left = expr->binary.left = fold_expr(expr->binary.left);
+    right = expr->binary.right = fold_expr(expr->binary.right);
+
+    if (!IS_CONSTANT(left))
+        return expr;
+
+    FOLDED++;
+    truthy = is_value_truthy(left->literal.value);
+
+    if (expr->binary.op->type == TOKEN_OR)
+        return truthy ? left : right;
+    return truthy ? right : left;
+}
+
+
+static Expr *fold_unary(Expr *expr)
+{
+    Value value;
+
+    expr->unary.right = fold_expr(expr->unary.right);
+
+    if (!IS_CONSTANT(expr->unary.right))
+        return expr;
+
+    value = expr->unary.right->literal.value;
+
+    switch (expr->unary.op->type) {
+        case TOKEN_BANG:
+            value = BOOL_VAL(!is_value_truthy(value));
+            break;
+        case TOKEN_MINUS:
+            if (!IS_NUMBER(value))
+                return expr;
+            value = NUMBER_VAL(AS_NUMBER(value) * -1);
+            break;
+        default:
+            return expr;
+    }
+
+    FOLDED++;
+    return new_folded(expr->unary.op, value);
+}
+
+
+// The declaration has been folded already, it comes first in the source.
+static Expr *fold_var(Expr *expr)
+{
+    Stmt *decl;
+
+    decl = expr->var.decl;
+    if (decl == NULL || decl->var.assigned)
+        return expr;
+    if (decl->var.expr == NULL || !IS_CONSTANT(decl->var.expr))
+        return expr;
+
+    PROPAGATED++;
+    return new_folded(expr->var.name, decl->var.expr->literal.value);
+}
+
+
+static Expr *new_folded(Token *token, Value value)
+{
+    Expr *expr = (Expr *) arena_alloc(ARENA, sizeof(Expr));
+
+    expr->type = EXPR_LITERAL;
+    expr->literal.token = token;
+    expr->literal.value = value;
+
+    return expr;
+}
+
+
+static Value concat(Value left, Value right)
+{
+    size_t len1, len2;
+    char *s;
+    Value value;
+
+    len1 = strlen(AS_OBJ(left)->sval);
+    len2 = strlen(AS_OBJ(right)->sval);
+
+    s = (char *) malloc((len1 + len2 + 1) * sizeof(char));
+    memcpy(s, AS_OBJ(left)->sval, len1);
+    memcpy(s + len1, AS_OBJ(right)->sval, len2 + 1);
+
+    value = OBJ_VAL(new_str_obj(s));
+    add_constant(value);
+
+    return value;
+}
+
+
+static bool is_string(Value value)
+{
+    return IS_OBJ(value) && AS_OBJ(value)->type == LOX_OBJ_STRING;
+}
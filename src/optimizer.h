@@ -0,0 +1,14 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "arena.h"
+#include "stmt.h"
+
+// Rewrites the resolved AST in place: operators on literals are folded,
+// locals that are initialised with a constant and never assigned are
+// replaced by it, and branches on a constant condition are pruned. Errors
+// (like adding a number to a string) are left for the runtime to report.
+void optimize(Stmt **stmts, Arena *arena);
+void opt_print_stats();
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "expr.h"
 #include "logger.h"
 #include "parser.h"
@@ -11,7 +12,9 @@
 #define MAX_CALL_ARGS 254
 
 struct tokenlist {
-    Token *curr;
+    Token *tokens;
+    size_t pos;
+    Arena *arena;
 };
 
 static Stmt *declaration(struct tokenlist *tlist);
@@ -38,25 +41,24 @@ static Expr *unary(struct tokenlist *tlist);
 static Expr *call(struct tokenlist *tlist);
 static Expr *finish_call(struct tokenlist *tlist, Expr *expr);
 static Expr *primary(struct tokenlist *tlist);
+static void *keep_array(struct tokenlist *tlist, void *array, size_t size);
 
 
 static Token *get_token(struct tokenlist *tlist)
 {
-    Token *prev;
-
-    if ((prev = tlist->curr) == NULL)
+    if (tlist->tokens[tlist->pos].type == TOKEN_EOF)
         return NULL;
 
-    prev = tlist->curr;
-    tlist->curr = tlist->curr->next;
-
-    return prev;
+    return &tlist->tokens[tlist->pos++];
 }
 
 
 static Token *peek_token(struct tokenlist *tlist)
 {
-    return tlist->curr;
+    if (tlist->tokens[tlist->pos].type == TOKEN_EOF)
+        return NULL;
+
+    return &tlist->tokens[tlist->pos];
 }
 
 
@@ -70,7 +72,9 @@ static Token *take_token(struct tokenlist *tlist, TokenType tok_type)
 }
 
 
-Stmt **parse(Token *tokens)
+// Nodes are allocated from the arena and never freed one by one: on a
+// syntax error the caller drops the partial tree by resetting the arena.
+Stmt **parse(Token *tokens, Arena *arena)
 {
     unsigned i;
     size_t n;
@@ -78,7 +82,9 @@ Stmt **parse(Token *tokens)
     struct tokenlist tlist;
     Stmt *stmt, **stmts;
 
-    tlist.curr = tokens;
+    tlist.tokens = tokens;
+    tlist.pos = 0;
+    tlist.arena = arena;
 
     n = 1;
     stmts = (Stmt **) calloc(n, sizeof(Stmt *));
@@ -95,24 +101,13 @@ Stmt **parse(Token *tokens)
     }
 
     if (has_error) {
-        free_stmts(stmts);
+        free(stmts);
         return NULL;
     }
 
     stmts[i] = NULL;
 
-    return stmts;
-}
-
-
-void free_stmts(Stmt **stmts)
-{
-    unsigned i;
-
-    for (i = 0; stmts[i] != NULL; i++)
-        free_stmt(stmts[i]);
-
-    free(stmts);
+    return keep_array(&tlist, stmts, (i + 1) * sizeof(Stmt *));
 }
 
 
@@ -149,7 +144,7 @@ static Stmt *class_declaration(struct tokenlist *tlist)
             log_error(LOX_SYNTAX_ERR, "expected superclass name");
             return NULL;
         }
-        superclass = new_var_expr(token);
+        superclass = new_var_expr(tlist->arena, token);
     }
 
     if (take_token(tlist, TOKEN_LEFT_BRACE) == NULL) {
@@ -174,14 +169,10 @@ static Stmt *class_declaration(struct tokenlist *tlist)
         goto cleanup;
     }
 
-    return new_class_stmt(name, superclass, i, methods);
+    methods = keep_array(tlist, methods, i * sizeof(Stmt *));
+    return new_class_stmt(tlist->arena, name, superclass, i, methods);
 
 cleanup:
-    if (superclass != NULL)
-        free_expr(superclass);
-    n = i;
-    for (i = 0; i < n; i++)
-        free_stmt(methods[i]);
     free(methods);
 
     return NULL;
@@ -191,9 +182,9 @@ cleanup:
 static Stmt *fun_declaration(struct tokenlist *tlist)
 {
     char *name;
-    size_t n;
+    size_t n, start;
     unsigned i;
-    Token *token, **params, *start;
+    Token *token, **params;
     Stmt *body;
 
     i = n = 0;
@@ -215,7 +206,7 @@ static Stmt *fun_declaration(struct tokenlist *tlist)
     if (token != NULL && token->type != TOKEN_RIGHT_PAREN) {
 
         // estimate how much space to allocate for parameters
-        start = peek_token(tlist);
+        start = tlist->pos;
         do {
             token = get_token(tlist);
             if (token != NULL && token->type == TOKEN_IDENTIFIER)
@@ -223,13 +214,13 @@ static Stmt *fun_declaration(struct tokenlist *tlist)
         } while (take_token(tlist, TOKEN_COMMA) != NULL);
 
         // fill up parameters
-        tlist->curr = start;
-        params = (Token **) calloc(n, sizeof(Token *));
+        tlist->pos = start;
+        params = (Token **) arena_alloc(tlist->arena, n * sizeof(Token *));
         do {
             token = get_token(tlist);
             if (token != NULL && token->type != TOKEN_IDENTIFIER) {
                 log_error(LOX_SYNTAX_ERR, "expected parameter name");
-                goto cleanup;
+                return NULL;
             }
             params[i++] = token;
         } while (take_token(tlist, TOKEN_COMMA) != NULL);
@@ -237,28 +228,23 @@ static Stmt *fun_declaration(struct tokenlist *tlist)
 
     if (i > MAX_CALL_ARGS) {
         log_error(LOX_SYNTAX_ERR, "cannot have more than %d parameters", MAX_CALL_ARGS);
-        goto cleanup;
+        return NULL;
     }
 
     if (take_token(tlist, TOKEN_RIGHT_PAREN) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected ')' after parameters");
-        goto cleanup;
+        return NULL;
     }
 
     if (take_token(tlist, TOKEN_LEFT_BRACE) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected '{' before function body");
-        goto cleanup;
+        return NULL;
     }
 
     if ((body = block_stmt(tlist)) == NULL)
-        goto cleanup;
-
-    return new_fun_stmt(strdup(name), i, params, body);
-
-cleanup:
-    if (params != NULL) free(params);
+        return NULL;
 
-    return NULL;
+    return new_fun_stmt(tlist->arena, name, i, params, body);
 }
 
 
@@ -282,12 +268,11 @@ static Stmt *var_declaration(struct tokenlist *tlist)
             return NULL;
 
     if (take_token(tlist, TOKEN_SEMICOLON) == NULL) {
-        free_expr(expr);
         log_error(LOX_SYNTAX_ERR, "expected ';' at the end of statement");
         return NULL;
     }
 
-    return new_var_stmt(strdup(name), expr);
+    return new_var_stmt(tlist->arena, name, expr);
 }
 
 
@@ -353,56 +338,48 @@ static Stmt *for_stmt(struct tokenlist *tlist)
 
     if ((token = peek_token(tlist)) != NULL && token->type != TOKEN_SEMICOLON)
         if ((cond = expression(tlist)) == NULL)
-            goto cleanup;
+            return NULL;
     
     if (take_token(tlist, TOKEN_SEMICOLON) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected ';' after loop condition");
-        goto cleanup;
+        return NULL;
     }
 
     /* loop increment */
 
     if ((token = peek_token(tlist)) != NULL && token->type != TOKEN_RIGHT_PAREN)
         if ((inc = expression(tlist)) == NULL)
-            goto cleanup;
+            return NULL;
 
     if (take_token(tlist, TOKEN_RIGHT_PAREN) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected ')' after for clauses");
-        goto cleanup;
+        return NULL;
     }
     
     /* loop body */
 
     if ((body = statement(tlist)) == NULL)
-        goto cleanup;
+        return NULL;
 
     /* transform 'for' loop to 'while' */
 
     if (inc != NULL) {
-        stmts = (Stmt **) calloc(2, sizeof(Stmt *));
+        stmts = (Stmt **) arena_alloc(tlist->arena, 2 * sizeof(Stmt *));
         stmts[0] = body;
-        stmts[1] = new_expr_stmt(inc);
-        body = new_block_stmt(2, stmts);
+        stmts[1] = new_expr_stmt(tlist->arena, inc);
+        body = new_block_stmt(tlist->arena, 2, stmts);
     }
 
-    body = new_while_stmt(cond, body);
+    body = new_while_stmt(tlist->arena, cond, body);
 
     if (init != NULL) {
-        stmts = (Stmt **) calloc(2, sizeof(Stmt *));
+        stmts = (Stmt **) arena_alloc(tlist->arena, 2 * sizeof(Stmt *));
         stmts[0] = init;
         stmts[1] = body;
-        body = new_block_stmt(2, stmts);
+        body = new_block_stmt(tlist->arena, 2, stmts);
     }
 
     return body;
-
-cleanup:
-    if (init != NULL) free_stmt(init);
-    if (cond != NULL) free_expr(cond);
-    if (inc != NULL) free_expr(inc);
-    if (body != NULL) free_stmt(body);
-
-    return NULL;
 }
 
 
@@ -414,12 +391,11 @@ static Stmt *print_stmt(struct tokenlist *tlist)
         return NULL;
 
     if (take_token(tlist, TOKEN_SEMICOLON) == NULL) {
-        free_expr(expr);
         log_error(LOX_SYNTAX_ERR, "expected ';' at the end of statement");
         return NULL;
     } 
 
-    return new_print_stmt(expr);
+    return new_print_stmt(tlist->arena, expr);
 }
 
 
@@ -435,13 +411,11 @@ static Stmt *return_stmt(struct tokenlist *tlist)
     }
 
     if (take_token(tlist, TOKEN_SEMICOLON) == NULL) {
-        if (expr != NULL)
-            free_expr(expr);
         log_error(LOX_SYNTAX_ERR, "expected ';' at the end of statement");
         return NULL;
     } 
 
-    return new_return_stmt(expr);
+    return new_return_stmt(tlist->arena, expr);
 }
 
 
@@ -477,12 +451,10 @@ static Stmt *block_stmt(struct tokenlist *tlist)
         goto cleanup;
     }
 
-    return new_block_stmt(i, stmts);
+    stmts = keep_array(tlist, stmts, i * sizeof(Stmt *));
+    return new_block_stmt(tlist->arena, i, stmts);
 
 cleanup:
-    n = i;
-    for (i = 0; i < n; i++)
-        free_stmt(stmts[i]);
     free(stmts);
 
     return NULL;
@@ -507,24 +479,17 @@ static Stmt *if_stmt(struct tokenlist *tlist)
 
     if (take_token(tlist, TOKEN_RIGHT_PAREN) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected ')' after if condition");
-        goto cleanup;
+        return NULL;
     }
 
     if ((conseq = statement(tlist)) == NULL)
-        goto cleanup;
+        return NULL;
 
     if (take_token(tlist, TOKEN_ELSE))
         if ((alt = statement(tlist)) == NULL)
-            goto cleanup;
-
-    return new_if_stmt(cond, conseq, alt); 
-
-cleanup:
-    if (cond != NULL) free_expr(cond);
-    if (conseq != NULL) free_stmt(conseq);
-    if (alt != NULL) free_stmt(alt);
+            return NULL;
 
-    return NULL;
+    return new_if_stmt(tlist->arena, cond, conseq, alt); 
 }
 
 
@@ -546,19 +511,13 @@ static Stmt *while_stmt(struct tokenlist *tlist)
 
     if (take_token(tlist, TOKEN_RIGHT_PAREN) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected ')' after while condition");
-        goto cleanup;
+        return NULL;
     }
 
     if ((body = statement(tlist)) == NULL)
-        goto cleanup;
-
-    return new_while_stmt(cond, body);
-
-cleanup:
-    if (cond != NULL) free_expr(cond);
-    if (body != NULL) free_stmt(body);
+        return NULL;
 
-    return NULL;
+    return new_while_stmt(tlist->arena, cond, body);
 }
 
 
@@ -570,12 +529,11 @@ static Stmt *expr_stmt(struct tokenlist *tlist)
         return NULL;
 
     if ((take_token(tlist, TOKEN_SEMICOLON)) == NULL) {
-        free_expr(expr);
         log_error(LOX_SYNTAX_ERR, "expected ';' at the end of statement");
         return NULL;
     } 
 
-    return new_expr_stmt(expr);
+    return new_expr_stmt(tlist->arena, expr);
 }
 
 
@@ -596,25 +554,19 @@ static Expr *assignment(struct tokenlist *tlist)
 
     if ((take_token(tlist, TOKEN_EQUAL)) != NULL) {
         if ((rexpr = assignment(tlist)) == NULL)
-            goto cleanup;
+            return NULL;
 
         if (expr->type == EXPR_VAR)
-            return new_assign_expr(expr->varname, rexpr);
+            return new_assign_expr(tlist->arena, expr->var.name, rexpr);
 
         if (expr->type == EXPR_GET)
-            return new_set_expr(expr->get.name, expr->get.object, rexpr);
+            return new_set_expr(tlist->arena, expr->get.name, expr->get.object, rexpr);
 
         log_error(LOX_SYNTAX_ERR, "invalid assignment target");
-        goto cleanup;
+        return NULL;
     }
 
     return expr;
-
-cleanup:
-    if (expr != NULL) free_expr(expr);
-    if (rexpr != NULL) free_expr(rexpr);
-
-    return NULL;
 }
 
 
@@ -630,17 +582,11 @@ static Expr *logic_or(struct tokenlist *tlist)
 
     while ((token = take_token(tlist, TOKEN_OR)) != NULL) {
         if ((rexpr = logic_and(tlist)) == NULL)
-            goto cleanup;
-        expr = new_logic_expr(expr, token, rexpr);
+            return NULL;
+        expr = new_logic_expr(tlist->arena, expr, token, rexpr);
     }
 
     return expr;
-
-cleanup:
-    if (expr != NULL) free_expr(expr);
-    if (rexpr != NULL) free_expr(rexpr);
-
-    return NULL;
 }
 
 
@@ -656,17 +602,11 @@ static Expr *logic_and(struct tokenlist *tlist)
 
     while ((token = take_token(tlist, TOKEN_AND)) != NULL) {
         if ((rexpr = equality(tlist)) == NULL)
-            goto cleanup;
-        expr = new_logic_expr(expr, token, rexpr);
+            return NULL;
+        expr = new_logic_expr(tlist->arena, expr, token, rexpr);
     }
 
     return expr;
-
-cleanup:
-    if (expr != NULL) free_expr(expr);
-    if (rexpr != NULL) free_expr(rexpr);
-
-    return NULL;
 }
 
 
@@ -682,12 +622,10 @@ static Expr *equality(struct tokenlist *tlist)
         if (token->type == TOKEN_BANG_EQUAL || token->type == TOKEN_EQUAL_EQUAL) {
             get_token(tlist);
 
-            if ((right = comparison(tlist)) == NULL) {
-                free_expr(expr);
+            if ((right = comparison(tlist)) == NULL)
                 return NULL;
-            }
 
-            expr = new_binary_expr(expr, token, right);
+            expr = new_binary_expr(tlist->arena, expr, token, right);
             continue;
         }
 
@@ -711,11 +649,9 @@ static Expr *comparison(struct tokenlist *tlist)
             || token->type == TOKEN_LESS || token->type == TOKEN_LESS_EQUAL) {
             get_token(tlist);
 
-            if ((right = addition(tlist)) == NULL) {
-                free_expr(expr);
+            if ((right = addition(tlist)) == NULL)
                 return NULL;
-            }
-            expr = new_binary_expr(expr, token, right);
+            expr = new_binary_expr(tlist->arena, expr, token, right);
             continue;
         }
 
@@ -737,11 +673,9 @@ static Expr *addition(struct tokenlist *tlist)
     while ((token = peek_token(tlist)) != NULL) {
         if (token->type == TOKEN_MINUS || token->type == TOKEN_PLUS) {
             get_token(tlist);
-            if ((right = multiplication(tlist)) == NULL) {
-                free_expr(expr);
+            if ((right = multiplication(tlist)) == NULL)
                 return NULL;
-            }
-            expr = new_binary_expr(expr, token, right);
+            expr = new_binary_expr(tlist->arena, expr, token, right);
             continue;
         }
 
@@ -763,11 +697,9 @@ static Expr *multiplication(struct tokenlist *tlist)
     while ((token = peek_token(tlist)) != NULL) {
         if (token->type == TOKEN_SLASH || token->type == TOKEN_STAR) {
             get_token(tlist);
-            if ((right = unary(tlist)) == NULL) {
-                free_expr(expr);
+            if ((right = unary(tlist)) == NULL)
                 return NULL;
-            }
-            expr = new_binary_expr(expr, token, right);
+            expr = new_binary_expr(tlist->arena, expr, token, right);
             continue;
         }
 
@@ -788,7 +720,7 @@ static Expr *unary(struct tokenlist *tlist)
             get_token(tlist);
             if ((expr = unary(tlist)) == NULL)
                 return NULL;
-            return new_unary_expr(token, expr);
+            return new_unary_expr(tlist->arena, token, expr);
         }
     } 
 
@@ -806,18 +738,15 @@ static Expr *call(struct tokenlist *tlist)
     
     for (;;) {
         if (take_token(tlist, TOKEN_LEFT_PAREN) != NULL) {
-            if ((temp = finish_call(tlist, expr)) == NULL) {
-                free_expr(expr);
+            if ((temp = finish_call(tlist, expr)) == NULL)
                 return NULL;
-            }
             expr = temp;
         } else if (take_token(tlist, TOKEN_DOT)) {
             if ((name = take_token(tlist, TOKEN_IDENTIFIER)) == NULL) {
-                free_expr(expr);
                 log_error(LOX_SYNTAX_ERR, "expect property name after '.'");
                 return NULL;
             }
-            expr = new_get_expr(name, expr);
+            expr = new_get_expr(tlist->arena, name, expr);
         } else {
             break;
         }
@@ -831,28 +760,19 @@ static Expr *finish_call(struct tokenlist *tlist, Expr *expr)
 {
     size_t n;
     unsigned i;
-    Token *token, *first;
+    Token *token;
     Expr *arg, **args;
 
-    args = NULL;
-    i = n = 0;
+    n = 1;
+    i = 0;
+    args = (Expr **) calloc(n, sizeof(Expr *));
 
-    first = peek_token(tlist);
     if ((token = peek_token(tlist)) != NULL && token->type != TOKEN_RIGHT_PAREN) {
-        n = 1;
-        while ((token = get_token(tlist)) != NULL && token->type != TOKEN_RIGHT_PAREN) {
-            if (token->type == TOKEN_COMMA)
-                n++;
-        }
-    }
-    tlist->curr = first;
-
-    if (n > 0) {
-        args = (Expr **) calloc(n, sizeof(Expr *));
-
         do {
             if ((arg = expression(tlist)) == NULL)
                 goto cleanup;
+            if (i >= n)
+                args = (Expr **) realloc(args, sizeof(Expr *) * (n *= 2));
             args[i++] = arg;
         } while (take_token(tlist, TOKEN_COMMA) != NULL);
     }
@@ -862,20 +782,16 @@ static Expr *finish_call(struct tokenlist *tlist, Expr *expr)
         goto cleanup;
     }
 
-    if (token == NULL || (token != NULL && token->type != TOKEN_RIGHT_PAREN)) {
+    if ((token = take_token(tlist, TOKEN_RIGHT_PAREN)) == NULL) {
         log_error(LOX_SYNTAX_ERR, "expected ')' after arguments");
         goto cleanup;
     }
- 
-    get_token(tlist);
 
-    return new_call_expr(expr, token, i, args);
+    args = keep_array(tlist, args, i * sizeof(Expr *));
+    return new_call_expr(tlist->arena, expr, token, i, args);
 
 cleanup:
-    n = i;
-    for (i = 0; i < n; i++)
-        free_expr(args[i]);
-    if (args != NULL) free(args);
+    free(args);
 
     return NULL;
 }
@@ -895,11 +811,11 @@ static Expr *primary(struct tokenlist *tlist)
 
     if (token->type == TOKEN_LEFT_PAREN) {
         if ((expr = expression(tlist)) == NULL)
-            goto cleanup;
+            return NULL;
 
         if (take_token(tlist, TOKEN_RIGHT_PAREN) == NULL) {
             log_error(LOX_SYNTAX_ERR, "expected ')' after expression");
-            goto cleanup;
+            return NULL;
         }
 
         return expr;
@@ -908,31 +824,40 @@ static Expr *primary(struct tokenlist *tlist)
     if (token->type == TOKEN_FALSE || token->type == TOKEN_NIL \
         || token->type == TOKEN_NUMBER || token->type == TOKEN_STRING \
         || token->type == TOKEN_TRUE)
-        return new_literal_expr(token);
+        return new_literal_expr(tlist->arena, token);
 
     if (token->type == TOKEN_THIS)
-        return new_this_expr(token);
+        return new_this_expr(tlist->arena, token);
 
     if (token->type == TOKEN_SUPER) {
         if (take_token(tlist, TOKEN_DOT) == NULL) {
             log_error(LOX_SYNTAX_ERR, "expected '.' after 'super'");
-            goto cleanup;
+            return NULL;
         }
         if ((method = take_token(tlist, TOKEN_IDENTIFIER)) == NULL) {
             log_error(LOX_SYNTAX_ERR, "expect superclass method name");
-            goto cleanup;
+            return NULL;
         }
-        return new_super_expr(token, method);
+        return new_super_expr(tlist->arena, token, method);
     }
 
     if (token->type == TOKEN_IDENTIFIER)
-        return new_var_expr(token);
+        return new_var_expr(tlist->arena, token);
 
     log_error(LOX_SYNTAX_ERR, "invalid syntax");
-    goto cleanup;
-
-cleanup:
-    if (expr != NULL)
-        free_expr(expr);
     return NULL;
 }
+
+
+// Child lists are grown on the heap while parsing and moved into the arena
+// once their final size is known.
+static void *keep_array(struct tokenlist *tlist, void *array, size_t size)
+{
+    void *p;
+
+    p = arena_alloc(tlist->arena, size);
+    memcpy(p, array, size);
+    free(array);
+
+    return p;
+}
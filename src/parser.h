@@ -1,10 +1,10 @@
 #ifndef clox_parser_h
 #define clox_parser_h
 
+#include "arena.h"
 #include "scanner.h"
 #include "stmt.h"
 
-Stmt **parse(Token *tokens);
-void free_stmts(Stmt **stmts);
+Stmt **parse(Token *tokens, Arena *arena);
 
 #endif
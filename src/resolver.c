@@ -2,16 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "dict.h"
 #include "expr.h"
+#include "globals.h"
 #include "logger.h"
 #include "stmt.h"
 
 #define UNUSED(x) (void)(x)
 
-bool FALSE = false;
-bool TRUE = true;
-
 enum ClassType {
     CLASS_TYPE_NONE,
     CLASS_TYPE_CLASS,
@@ -26,63 +25,111 @@ enum FunType {
 };
 
 
+// A local escapes if its value may outlive the frame: it's returned,
+// captured, passed on or stored in an object. Allocations whose value only
+// ends up in locals that don't escape are flagged local once their scope
+// ends; a local that escapes makes the ones that flowed into it escape too.
+typedef struct local {
+    unsigned slot;
+    bool defined;
+    Stmt *decl;             // declaring 'var' statement, if any
+    unsigned depth;         // of its scope within the function
+    bool escapes;
+    unsigned nsites;
+    Expr **sites;           // allocations it may hold
+    unsigned nsources;
+    struct local **sources; // locals of the same or outer scopes it may hold
+} Local;
+
+
 typedef struct scope {
     struct scope *next;
     Dict *storage;
+    unsigned n;
+    unsigned depth;
 } Scope;
 
 
-typedef struct {
+// Scopes of the function being resolved; the chain of enclosing functions
+// is used to turn references to their locals into upvalues.
+typedef struct funstate {
+    struct funstate *enclosing;
     Scope *scopes;
+    Stmt *stmt;
+    Arena *arena;           // the AST's, upvalue lists are stored there
+} FunState;
+
+
+// 'sink' is where the value of the expression being resolved goes: a
+// local of the function, ESCAPE, or NULL if it's only looked at.
+typedef struct {
+    FunState *fun;
     bool has_error;
     enum ClassType class_type;
     enum FunType fun_type;
+    Local *sink;
 } Resolver;
 
+static Local ESCAPE_SINK;
+#define ESCAPE (&ESCAPE_SINK)
 
-static Resolver *Resolver_New();
+
+static Resolver *Resolver_New(Arena *arena);
 static void Resolver_Free(Resolver *resolver);
 
 static Scope *Scope_New();
 static void Scope_Free();
-
-static void Resolver_Resolve_Stmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_BlockStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_ClassStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_ExprStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_FunStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_Fun(Resolver *resolver, const Stmt *stmt, enum FunType fun_type);
-static void Resolver_Resolve_IfStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_PrintStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_ReturnStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_VarStmt(Resolver *resolver, const Stmt *stmt);
-static void Resolver_Resolve_WhileStmt(Resolver *resolver, const Stmt *stmt);
-
-static void Resolver_Resolve_Expr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_AssignExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_BinaryExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_CallExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_GetExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_GroupingExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_ThisExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_SetExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_SuperExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_UnaryExpr(Resolver *resolver, const Expr *expr);
-static void Resolver_Resolve_VarExpr(Resolver *resolver, const Expr *expr);
+static void Scope_Escapes(Scope *scope);
+
+static void Local_Escape(Local *local);
+static void Local_AddSite(Local *local, Expr *expr);
+static void Local_AddSource(Local *local, Local *source);
+
+static void Resolver_Resolve_Stmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_BlockStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_ClassStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_ExprStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_FunStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_Fun(Resolver *resolver, Stmt *stmt, enum FunType fun_type);
+static void Resolver_Resolve_IfStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_PrintStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_ReturnStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_VarStmt(Resolver *resolver, Stmt *stmt);
+static void Resolver_Resolve_WhileStmt(Resolver *resolver, Stmt *stmt);
+
+static void Resolver_Resolve_Value(Resolver *resolver, Expr *expr, Local *sink);
+static void Resolver_Resolve_Expr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_AssignExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_BinaryExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_LogicExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_CallExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_GetExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_GroupingExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_ThisExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_SetExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_SuperExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_UnaryExpr(Resolver *resolver, Expr *expr);
+static void Resolver_Resolve_VarExpr(Resolver *resolver, Expr *expr);
 
 static void Resolver_BeginScope(Resolver *resolver);
 static void Resolver_EndScope(Resolver *resolver);
 static void Resolver_Declare(Resolver *resolver, const char *name);
 static void Resolver_Define(Resolver *resolver, const char *name);
+static Local *Resolver_ResolveLocal(Resolver *resolver, const char *name, Binding *bind);
+static void Resolver_Flow(Resolver *resolver, Local *local, Binding *bind);
+static void Resolver_Site(Resolver *resolver, Expr *expr);
 
+static Local *FunState_Resolve(FunState *fun, const char *name, Binding *bind);
+static unsigned FunState_AddUpvalue(FunState *fun, bool is_local, unsigned depth, unsigned index);
 
-int resolve(Stmt **stmts)
+
+int resolve(Stmt **stmts, Arena *arena)
 {
     bool has_error;
     unsigned i;
     Resolver *resolver;
 
-    resolver = Resolver_New();
+    resolver = Resolver_New(arena);
 
     for (i = 0; stmts[i] != NULL; i++)
         Resolver_Resolve_Stmt(resolver, stmts[i]);
@@ -102,25 +149,91 @@ static Scope *Scope_New()
 
     scope->next = NULL;
     scope->storage = Dict_New();
+    scope->n = 0;
+    scope->depth = 0;
 
     return scope;
 }
 
 
+// Locals are settled: the allocations they hold are flagged local unless
+// they escape.
 static void Scope_Free(Scope *scope)
 {
+    size_t pos;
+    unsigned i;
+    Value value;
+    Local *local;
+
+    Scope_Escapes(scope);
+
+    pos = 0;
+    while (Dict_Next(scope->storage, &pos, NULL, &value)) {
+        local = (Local *) AS_PTR(value);
+        for (i = 0; i < local->nsites; i++)
+            local->sites[i]->local = !local->escapes;
+        free(local->sites);
+        free(local->sources);
+        free(local);
+    }
+
     Dict_Free(scope->storage);
     free(scope);
 }
 
 
-static Resolver *Resolver_New()
+// Nothing can make the locals of a scope escape once it ends, pass on
+// the escapes to the locals that flowed into them.
+static void Scope_Escapes(Scope *scope)
+{
+    size_t pos;
+    Value value;
+
+    pos = 0;
+    while (Dict_Next(scope->storage, &pos, NULL, &value))
+        if (((Local *) AS_PTR(value))->escapes)
+            Local_Escape((Local *) AS_PTR(value));
+}
+
+
+static void Local_Escape(Local *local)
+{
+    unsigned i;
+
+    local->escapes = true;
+    for (i = 0; i < local->nsources; i++)
+        if (!local->sources[i]->escapes)
+            Local_Escape(local->sources[i]);
+}
+
+
+static void Local_AddSite(Local *local, Expr *expr)
+{
+    local->sites = (Expr **) realloc(local->sites, (local->nsites + 1) * sizeof(Expr *));
+    local->sites[local->nsites++] = expr;
+}
+
+
+static void Local_AddSource(Local *local, Local *source)
+{
+    local->sources = (Local **) realloc(local->sources, (local->nsources + 1) * sizeof(Local *));
+    local->sources[local->nsources++] = source;
+}
+
+
+static Resolver *Resolver_New(Arena *arena)
 {
     Resolver *resolver = (Resolver *) malloc(sizeof(Resolver)); 
 
-    resolver->scopes = NULL;
+    resolver->fun = (FunState *) malloc(sizeof(FunState));
+    resolver->fun->enclosing = NULL;
+    resolver->fun->scopes = NULL;
+    resolver->fun->stmt = NULL;
+    resolver->fun->arena = arena;
     resolver->has_error = false;
+    resolver->class_type = CLASS_TYPE_NONE;
     resolver->fun_type = FUN_TYPE_NONE;
+    resolver->sink = NULL;
 
     return resolver;
 }
@@ -130,14 +243,17 @@ static void Resolver_Free(Resolver *resolver)
 {
     Scope *scope;
 
-    for (scope = resolver->scopes; scope != NULL; scope = resolver->scopes->next)
+    while ((scope = resolver->fun->scopes) != NULL) {
+        resolver->fun->scopes = scope->next;
         Scope_Free(scope);
+    }
     
+    free(resolver->fun);
     free(resolver);
 }
 
 
-static void Resolver_Resolve_Stmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_Stmt(Resolver *resolver, Stmt *stmt)
 {
     switch (stmt->type) {
         case STMT_BLOCK:
@@ -162,20 +278,30 @@ static void Resolver_Resolve_Stmt(Resolver *resolver, const Stmt *stmt)
 }
 
 
-static void Resolver_Resolve_BlockStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_BlockStmt(Resolver *resolver, Stmt *stmt)
 {
     unsigned i;
 
+    // a block that declares nothing gets no scope, nor an env to run in
+    if (!declares_local(stmt)) {
+        for (i = 0; i < stmt->block.n; i++)
+            Resolver_Resolve_Stmt(resolver, stmt->block.stmts[i]);
+        stmt->block.nslots = 0;
+        return;
+    }
+
     Resolver_BeginScope(resolver);
     
     for (i = 0; i < stmt->block.n; i++)
         Resolver_Resolve_Stmt(resolver, stmt->block.stmts[i]);
 
+    stmt->block.nslots = resolver->fun->scopes->n;
+
     Resolver_EndScope(resolver);
 }
 
 
-static void Resolver_Resolve_ClassStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_ClassStmt(Resolver *resolver, Stmt *stmt)
 {
     unsigned i;
     enum ClassType class_type;
@@ -188,13 +314,16 @@ static void Resolver_Resolve_ClassStmt(Resolver *resolver, const Stmt *stmt)
     Resolver_Define(resolver, stmt->klass.name->lexeme);
 
     if (stmt->klass.superclass != NULL) {
-        if (strcmp(stmt->klass.superclass->varname->lexeme, stmt->klass.name->lexeme) == 0) {
+        if (strcmp(stmt->klass.superclass->var.name->lexeme, stmt->klass.name->lexeme) == 0) {
             resolver->has_error = true;
             log_error(LOX_SYNTAX_ERR, "a class cannot inherit from itself");
             return;
         }
         resolver->class_type = CLASS_TYPE_SUBCLASS;
-        Resolver_Resolve_Expr(resolver, stmt->klass.superclass);
+        Resolver_Resolve_Value(resolver, stmt->klass.superclass, ESCAPE);
+
+        Resolver_BeginScope(resolver);
+        Resolver_Define(resolver, "super");
     }
 
     for (i = 0; i < stmt->klass.n; i++) {
@@ -205,17 +334,20 @@ static void Resolver_Resolve_ClassStmt(Resolver *resolver, const Stmt *stmt)
         Resolver_Resolve_Fun(resolver, stmt->klass.methods[i], fun_type);
     }
 
+    if (stmt->klass.superclass != NULL)
+        Resolver_EndScope(resolver);
+
     resolver->class_type = class_type;
 }
 
 
-static void Resolver_Resolve_ExprStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_ExprStmt(Resolver *resolver, Stmt *stmt)
 {
-    Resolver_Resolve_Expr(resolver, stmt->expr);
+    Resolver_Resolve_Value(resolver, stmt->expr, NULL);
 }
 
 
-static void Resolver_Resolve_FunStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_FunStmt(Resolver *resolver, Stmt *stmt)
 {
     Resolver_Declare(resolver, stmt->fun.name);
     Resolver_Define(resolver, stmt->fun.name);
@@ -223,44 +355,65 @@ static void Resolver_Resolve_FunStmt(Resolver *resolver, const Stmt *stmt)
 }
 
 
-static void Resolver_Resolve_Fun(Resolver *resolver, const Stmt *stmt, enum FunType fun_type)
+static void Resolver_Resolve_Fun(Resolver *resolver, Stmt *stmt, enum FunType fun_type)
 {
     unsigned i;
     enum FunType curr;
+    FunState fun;
+    Local *this;
 
     curr = resolver->fun_type;
     resolver->fun_type = fun_type;
 
+    fun.enclosing = resolver->fun;
+    fun.scopes = NULL;
+    fun.stmt = stmt;
+    fun.arena = resolver->fun->arena;
+    resolver->fun = &fun;
+
     Resolver_BeginScope(resolver);
 
+    // the receiver of a method lives in the first slot of its frame
+    if (fun_type == FUN_TYPE_METHOD || fun_type == FUN_TYPE_INIT)
+        Resolver_Define(resolver, "this");
+
     for (i = 0; i < stmt->fun.n; i++) {
       Resolver_Declare(resolver, stmt->fun.params[i]->lexeme);
       Resolver_Define(resolver, stmt->fun.params[i]->lexeme);
     }
-    Resolver_Resolve_Stmt(resolver, stmt->fun.body);
+    // the body shares the scope of the parameters, the frame holds both
+    for (i = 0; i < stmt->fun.body->block.n; i++)
+        Resolver_Resolve_Stmt(resolver, stmt->fun.body->block.stmts[i]);
+    stmt->fun.body->block.nslots = resolver->fun->scopes->n;
 
     resolver->fun_type = curr;
 
+    Scope_Escapes(resolver->fun->scopes);
+    this = DICT_GET(Local, resolver->fun->scopes->storage, "this");
+    stmt->fun.this_escapes = (this == NULL || this->escapes);
+
     Resolver_EndScope(resolver);
+
+    resolver->fun = fun.enclosing;
 }
 
 
-static void Resolver_Resolve_IfStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_IfStmt(Resolver *resolver, Stmt *stmt)
 {
-    Resolver_Resolve_Expr(resolver, stmt->ifelse.cond);
+    Resolver_Resolve_Value(resolver, stmt->ifelse.cond, NULL);
     Resolver_Resolve_Stmt(resolver, stmt->ifelse.conseq);
     if (stmt->ifelse.alt != NULL)
         Resolver_Resolve_Stmt(resolver, stmt->ifelse.alt);
 }
 
 
-static void Resolver_Resolve_PrintStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_PrintStmt(Resolver *resolver, Stmt *stmt)
 {
-    Resolver_Resolve_Expr(resolver, stmt->expr);
+    Resolver_Resolve_Value(resolver, stmt->expr, NULL);
 }
 
 
-static void Resolver_Resolve_ReturnStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_ReturnStmt(Resolver *resolver, Stmt *stmt)
 {
     if (resolver->fun_type == FUN_TYPE_NONE) {
         resolver->has_error = true;
@@ -272,38 +425,58 @@ static void Resolver_Resolve_ReturnStmt(Resolver *resolver, const Stmt *stmt)
             resolver->has_error = true;
             log_error(LOX_SYNTAX_ERR, "cannot return a value from initializer");
         }
-        Resolver_Resolve_Expr(resolver, stmt->expr);
+        Resolver_Resolve_Value(resolver, stmt->expr, ESCAPE);
     }
 }
 
 
-static void Resolver_Resolve_VarStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_VarStmt(Resolver *resolver, Stmt *stmt)
 {
+    Local *local;
+
     Resolver_Declare(resolver, stmt->var.name);
 
+    // globals live on
+    local = ESCAPE;
+    if (resolver->fun->scopes != NULL) {
+        local = DICT_GET(Local, resolver->fun->scopes->storage, stmt->var.name);
+        if (local != NULL)
+            local->decl = stmt;
+        else
+            local = ESCAPE;
+    }
+
     if (stmt->var.expr != NULL)
-        Resolver_Resolve_Expr(resolver, stmt->var.expr);
+        Resolver_Resolve_Value(resolver, stmt->var.expr, local);
 
     Resolver_Define(resolver, stmt->var.name);
 }
 
 
-static void Resolver_Resolve_WhileStmt(Resolver *resolver, const Stmt *stmt)
+static void Resolver_Resolve_WhileStmt(Resolver *resolver, Stmt *stmt)
 {
     if (stmt->whileloop.cond != NULL)
-        Resolver_Resolve_Expr(resolver, stmt->whileloop.cond);
+        Resolver_Resolve_Value(resolver, stmt->whileloop.cond, NULL);
     Resolver_Resolve_Stmt(resolver, stmt->whileloop.body);
 }
 
 
-static void Resolver_Resolve_Expr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_Value(Resolver *resolver, Expr *expr, Local *sink)
+{
+    resolver->sink = sink;
+    Resolver_Resolve_Expr(resolver, expr);
+}
+
+
+static void Resolver_Resolve_Expr(Resolver *resolver, Expr *expr)
 {
     switch (expr->type) {
         case EXPR_ASSIGN:
             return Resolver_Resolve_AssignExpr(resolver, expr);
         case EXPR_BINARY:
-        case EXPR_LOGIC:
             return Resolver_Resolve_BinaryExpr(resolver, expr);
+        case EXPR_LOGIC:
+            return Resolver_Resolve_LogicExpr(resolver, expr);
         case EXPR_CALL:
             return Resolver_Resolve_CallExpr(resolver, expr);
         case EXPR_GET:
@@ -326,63 +499,102 @@ static void Resolver_Resolve_Expr(Resolver *resolver, const Expr *expr)
 }
 
 
-static void Resolver_Resolve_AssignExpr(Resolver *resolver, const Expr *expr)
+// The value goes to the variable, and to wherever the assignment's does
+// if it's used at all.
+static void Resolver_Resolve_AssignExpr(Resolver *resolver, Expr *expr)
+{
+    Local *local, *sink;
+
+    sink = resolver->sink;
+    local = Resolver_ResolveLocal(resolver, expr->assign.name->lexeme, &expr->assign.bind);
+
+    if (local == NULL || expr->assign.bind.depth < 0 || sink != NULL)
+        sink = ESCAPE;
+    else
+        sink = local;
+    Resolver_Resolve_Value(resolver, expr->assign.value, sink);
+
+    if (local != NULL && local->decl != NULL)
+        local->decl->var.assigned = true;
+}
+
+
+// Operators only look at their operands, but '+' may allocate a string.
+static void Resolver_Resolve_BinaryExpr(Resolver *resolver, Expr *expr) 
 {
-    Resolver_Resolve_Expr(resolver, expr->assign.value);
+    if (expr->binary.op->type == TOKEN_PLUS)
+        Resolver_Site(resolver, expr);
+
+    Resolver_Resolve_Value(resolver, expr->binary.left, NULL);
+    Resolver_Resolve_Value(resolver, expr->binary.right, NULL);
 }
 
 
-static void Resolver_Resolve_BinaryExpr(Resolver *resolver, const Expr *expr) 
+static void Resolver_Resolve_LogicExpr(Resolver *resolver, Expr *expr) 
 {
-    Resolver_Resolve_Expr(resolver, expr->binary.left);
-    Resolver_Resolve_Expr(resolver, expr->binary.right);
+    Local *sink;
+
+    sink = resolver->sink;
+    Resolver_Resolve_Value(resolver, expr->binary.left, sink);
+    Resolver_Resolve_Value(resolver, expr->binary.right, sink);
 }
 
 
-static void Resolver_Resolve_CallExpr(Resolver *resolver, const Expr *expr)
+// The receiver of a method becomes its 'this', which it may keep. A bound
+// method made for 'super.method()' only lives for the call.
+static void Resolver_Resolve_CallExpr(Resolver *resolver, Expr *expr)
 {
     unsigned i;
 
-    Resolver_Resolve_Expr(resolver, expr->call.callee);
+    Resolver_Site(resolver, expr);
+
+    Resolver_Resolve_Value(resolver, expr->call.callee, ESCAPE);
+    if (expr->call.callee->type == EXPR_SUPER)
+        expr->call.callee->local = true;
 
     for (i = 0; i < expr->call.argc; i++)
-        Resolver_Resolve_Expr(resolver, expr->call.args[i]);
+        Resolver_Resolve_Value(resolver, expr->call.args[i], ESCAPE);
 }
 
 
-static void Resolver_Resolve_GetExpr(Resolver *resolver, const Expr *expr)
+// A method is bound to the object, which goes where the bound method does.
+static void Resolver_Resolve_GetExpr(Resolver *resolver, Expr *expr)
 {
-    Resolver_Resolve_Expr(resolver, expr->get.object);
+    Local *sink;
+
+    sink = resolver->sink;
+    Resolver_Site(resolver, expr);
+    Resolver_Resolve_Value(resolver, expr->get.object, sink);
 }
 
 
-static void Resolver_Resolve_GroupingExpr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_GroupingExpr(Resolver *resolver, Expr *expr)
 {
     Resolver_Resolve_Expr(resolver, expr->grouping);
 }
 
 
-static void Resolver_Resolve_ThisExpr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_ThisExpr(Resolver *resolver, Expr *expr)
 {
-    UNUSED(expr);
     if (resolver->class_type == CLASS_TYPE_NONE) {
         resolver->has_error = true;
         log_error(LOX_SYNTAX_ERR, "cannot use 'this' outside of a class.");
+        return;
     }
+
+    Resolver_Flow(resolver, Resolver_ResolveLocal(resolver, "this", &expr->var.bind), &expr->var.bind);
 }
 
 
-static void Resolver_Resolve_SetExpr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_SetExpr(Resolver *resolver, Expr *expr)
 {
-    Resolver_Resolve_Expr(resolver, expr->set.value);
-    Resolver_Resolve_Expr(resolver, expr->set.object);
+    Resolver_Resolve_Value(resolver, expr->set.value, ESCAPE);
+    Resolver_Resolve_Value(resolver, expr->set.object, NULL);
 }
 
 
-static void Resolver_Resolve_SuperExpr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_SuperExpr(Resolver *resolver, Expr *expr)
 {
-    UNUSED(expr);
-
     if (resolver->class_type == CLASS_TYPE_NONE) {
         resolver->has_error = true;
         log_error(LOX_SYNTAX_ERR, "cannot use 'super' outside of a class");
@@ -393,26 +605,34 @@ static void Resolver_Resolve_SuperExpr(Resolver *resolver, const Expr *expr)
         log_error(LOX_SYNTAX_ERR, "cannot use 'super' in a class with no superclass");
         return;
     }
+
+    Resolver_Site(resolver, expr);
+    Resolver_ResolveLocal(resolver, "super", &expr->super.bind);
+    Resolver_Flow(resolver, Resolver_ResolveLocal(resolver, "this", &expr->super.this), &expr->super.this);
 }
 
 
-static void Resolver_Resolve_UnaryExpr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_UnaryExpr(Resolver *resolver, Expr *expr)
 {
-    Resolver_Resolve_Expr(resolver, expr->unary.right);
+    Resolver_Resolve_Value(resolver, expr->unary.right, NULL);
 }
 
 
-static void Resolver_Resolve_VarExpr(Resolver *resolver, const Expr *expr)
+static void Resolver_Resolve_VarExpr(Resolver *resolver, Expr *expr)
 {
-    bool *defined;
+    Local *local;
 
-    if (resolver->scopes != NULL) {
-        defined = DICT_GET(bool, resolver->scopes->storage, expr->varname->lexeme);
-        if ((defined != NULL) && !*defined) {
+    if (resolver->fun->scopes != NULL) {
+        local = DICT_GET(Local, resolver->fun->scopes->storage, expr->var.name->lexeme);
+        if ((local != NULL) && !local->defined) {
             resolver->has_error = true;
             log_error(LOX_SYNTAX_ERR, "cannot read local variable in its own initializer");
         }
     }
+
+    local = Resolver_ResolveLocal(resolver, expr->var.name->lexeme, &expr->var.bind);
+    expr->var.decl = (local != NULL) ? local->decl : NULL;
+    Resolver_Flow(resolver, local, &expr->var.bind);
 }
 
 
@@ -422,8 +642,10 @@ static void Resolver_BeginScope(Resolver *resolver)
 
     scope = Scope_New();
 
-    scope->next = resolver->scopes;
-    resolver->scopes = scope;
+    if (resolver->fun->scopes != NULL)
+        scope->depth = resolver->fun->scopes->depth + 1;
+    scope->next = resolver->fun->scopes;
+    resolver->fun->scopes = scope;
 }
 
 
@@ -431,8 +653,8 @@ static void Resolver_EndScope(Resolver *resolver)
 {
     Scope *scope;
 
-    scope = resolver->scopes;
-    resolver->scopes = scope->next;
+    scope = resolver->fun->scopes;
+    resolver->fun->scopes = scope->next;
 
     Scope_Free(scope);
 }
@@ -440,9 +662,20 @@ static void Resolver_EndScope(Resolver *resolver)
 
 static void Resolver_Declare(Resolver *resolver, const char *name)
 {
-    if (resolver->scopes != NULL) {
-        if (DICT_GET(bool, resolver->scopes->storage, (char *) name) == NULL) {
-            DICT_SET(resolver->scopes->storage, (char *) name, &FALSE);
+    Local *local;
+
+    if (resolver->fun->scopes != NULL) {
+        if (DICT_GET(Local, resolver->fun->scopes->storage, (char *) name) == NULL) {
+            local = (Local *) malloc(sizeof(Local));
+            local->slot = resolver->fun->scopes->n++;
+            local->defined = false;
+            local->decl = NULL;
+            local->depth = resolver->fun->scopes->depth;
+            local->escapes = false;
+            local->nsites = local->nsources = 0;
+            local->sites = NULL;
+            local->sources = NULL;
+            DICT_SET(resolver->fun->scopes->storage, (char *) name, local);
         } else {
             log_error(LOX_SYNTAX_ERR, 
                       "Variable with name '%s' already declared in this scope", name);
@@ -454,6 +687,110 @@ static void Resolver_Declare(Resolver *resolver, const char *name)
 
 static void Resolver_Define(Resolver *resolver, const char *name)
 {
-    if (resolver->scopes != NULL)
-        DICT_SET(resolver->scopes->storage, (char *) name, &TRUE);
+    Local *local;
+
+    if (resolver->fun->scopes == NULL)
+        return;
+
+    if ((local = DICT_GET(Local, resolver->fun->scopes->storage, (char *) name)) == NULL) {
+        Resolver_Declare(resolver, name);
+        local = DICT_GET(Local, resolver->fun->scopes->storage, (char *) name);
+    }
+
+    local->defined = true;
+}
+
+
+static Local *Resolver_ResolveLocal(Resolver *resolver, const char *name, Binding *bind)
+{
+    Local *local;
+
+    if ((local = FunState_Resolve(resolver->fun, name, bind)) == NULL) {
+        bind->depth = EXPR_GLOBAL;
+        bind->slot = global_slot(name);
+    }
+
+    return local;
+}
+
+
+// A variable read flows into the sink. One of a local of an inner (or the
+// same) scope is settled first and can be followed; others are assumed to
+// escape. Upvalues have escaped already.
+static void Resolver_Flow(Resolver *resolver, Local *local, Binding *bind)
+{
+    Local *sink;
+
+    sink = resolver->sink;
+    if (local == NULL || bind->depth < 0 || sink == NULL || sink == local)
+        return;
+
+    if (sink != ESCAPE && sink->depth >= local->depth)
+        Local_AddSource(sink, local);
+    else
+        local->escapes = true;
+}
+
+
+static void Resolver_Site(Resolver *resolver, Expr *expr)
+{
+    expr->local = (resolver->sink == NULL);
+    if (resolver->sink != NULL && resolver->sink != ESCAPE)
+        Local_AddSite(resolver->sink, expr);
+}
+
+
+static Local *FunState_Resolve(FunState *fun, const char *name, Binding *bind)
+{
+    int hops;
+    bool is_local;
+    Scope *scope;
+    Local *local;
+
+    for (hops = 0, scope = fun->scopes; scope != NULL; hops++, scope = scope->next)
+        if ((local = DICT_GET(Local, scope->storage, (char *) name)) != NULL) {
+            bind->depth = hops;
+            bind->slot = local->slot;
+            return local;
+        }
+
+    if (fun->enclosing == NULL || (local = FunState_Resolve(fun->enclosing, name, bind)) == NULL)
+        return NULL;
+
+    // captured by a closure
+    local->escapes = true;
+
+    is_local = (bind->depth != EXPR_UPVALUE);
+    bind->slot = FunState_AddUpvalue(fun, is_local, is_local ? bind->depth : 0, bind->slot);
+    bind->depth = EXPR_UPVALUE;
+
+    return local;
+}
+
+
+static unsigned FunState_AddUpvalue(FunState *fun, bool is_local, unsigned depth, unsigned index)
+{
+    unsigned i;
+    Upvalue *upvalue, *upvalues;
+    Stmt *stmt;
+
+    stmt = fun->stmt;
+
+    for (i = 0; i < stmt->fun.nupvalues; i++) {
+        upvalue = &stmt->fun.upvalues[i];
+        if (upvalue->is_local == is_local && upvalue->depth == depth && upvalue->index == index)
+            return i;
+    }
+
+    // closures capture a handful of variables at most, copying is cheap
+    upvalues = (Upvalue *) arena_alloc(fun->arena, (stmt->fun.nupvalues + 1) * sizeof(Upvalue));
+    if (stmt->fun.nupvalues > 0)
+        memcpy(upvalues, stmt->fun.upvalues, stmt->fun.nupvalues * sizeof(Upvalue));
+    stmt->fun.upvalues = upvalues;
+    upvalue = &stmt->fun.upvalues[stmt->fun.nupvalues];
+    upvalue->is_local = is_local;
+    upvalue->depth = depth;
+    upvalue->index = index;
+
+    return stmt->fun.nupvalues++;
 }
@@ -1,8 +1,9 @@
 #ifndef clox_resolver_h
 #define clox_resolver_h
 
+#include "arena.h"
 #include "stmt.h"
 
-int resolve(Stmt **stmts);
+int resolve(Stmt **stmts, Arena *arena);
 
 #endif
@@ -1,292 +1,410 @@
-#include <ctype.h>
 #include "stdbool.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dict.h"
 #include "logger.h"
 #include "scanner.h"
 
-#define NKEYS (sizeof KEYWORDS / sizeof(KEYWORDS[0]))
-
-// Keep it ordered
-Keyword KEYWORDS[] = {
-    { "and", TOKEN_AND },
-    { "class", TOKEN_CLASS },
-    { "else", TOKEN_ELSE },
-    { "false", TOKEN_FALSE },
-    { "for", TOKEN_FOR },
-    { "fun", TOKEN_FUN },
-    { "if", TOKEN_IF },
-    { "nil", TOKEN_NIL },
-    { "or", TOKEN_OR },
-    { "print", TOKEN_PRINT },
-    { "return", TOKEN_RETURN },
-    { "super", TOKEN_SUPER },
-    { "this", TOKEN_THIS },
-    { "true", TOKEN_TRUE },
-    { "var", TOKEN_VAR },
-    { "while", TOKEN_WHILE },
+#define CHAR_SPACE 0x01
+#define CHAR_DIGIT 0x02
+#define CHAR_ALPHA 0x04     // letters and '_'
+#define CHAR_DOT 0x08
+#define CHAR_IDENT (CHAR_ALPHA | CHAR_DIGIT)
+#define CHAR_NUMBER (CHAR_DIGIT | CHAR_DOT)
+
+// Perfect hash of the keywords, from their first and last character and
+// length. A collision shows up as an overridden initializer at compile time.
+#define KEYWORD_HASH(first, last, len) ((unsigned) ((first) + 5 * (last) + (len)) & 31)
+#define KEYWORD(first, last, name, type) \
+    [KEYWORD_HASH(first, last, sizeof(name) - 1)] = { name, type }
+
+static const Keyword KEYWORDS[32] = {
+    KEYWORD('a', 'd', "and", TOKEN_AND),
+    KEYWORD('c', 's', "class", TOKEN_CLASS),
+    KEYWORD('e', 'e', "else", TOKEN_ELSE),
+    KEYWORD('f', 'e', "false", TOKEN_FALSE),
+    KEYWORD('f', 'r', "for", TOKEN_FOR),
+    KEYWORD('f', 'n', "fun", TOKEN_FUN),
+    KEYWORD('i', 'f', "if", TOKEN_IF),
+    KEYWORD('n', 'l', "nil", TOKEN_NIL),
+    KEYWORD('o', 'r', "or", TOKEN_OR),
+    KEYWORD('p', 't', "print", TOKEN_PRINT),
+    KEYWORD('r', 'n', "return", TOKEN_RETURN),
+    KEYWORD('s', 'r', "super", TOKEN_SUPER),
+    KEYWORD('t', 's', "this", TOKEN_THIS),
+    KEYWORD('t', 'e', "true", TOKEN_TRUE),
+    KEYWORD('v', 'r', "var", TOKEN_VAR),
+    KEYWORD('w', 'e', "while", TOKEN_WHILE),
 };
 
-static Token *new_token(int type, char *lexeme);
-static void free_token(Token *token);
+struct scanner {
+    const char *source;
+    const char *curr;
+    const char *end;
+    Token *tokens;
+    size_t n;
+    size_t capacity;
+};
 
-static Token *get_token(int c, FILE *s);
-static Token *new_str_token(FILE *ifp);
-static Token *new_num_token(FILE *ifp);
-static Token *new_id_token(FILE *ifp);
-static char *read_while(FILE *ifp, bool (*cond)(char c));
-static Keyword *binsearch(char *kwrd, Keyword *tab, int n);
+static void add_token(struct scanner *s, TokenType type, const char *start, char *lexeme);
+static bool match(struct scanner *s, char c);
 
+static bool scan_token(struct scanner *s);
+static bool scan_string(struct scanner *s, const char *start);
+static void scan_number(struct scanner *s, const char *start);
+static void scan_identifier(struct scanner *s, const char *start);
+static char *intern(const char *start, size_t length);
+static const Keyword *find_keyword(const char *start, size_t length);
 
-Token *scan(FILE *input)
-{
-    char c, next_c;
-    bool is_stdin;
-    Token *token, *first;
+static void init_char_class();
+static const char *skip_class(const char *p, const char *end, uint8_t cls, int *lines);
+static const char *find_char(const char *p, const char *end, char c, int *lines);
 
-    is_stdin = (input == stdin);
+static int LINENO = 1;
+static uint8_t CHAR_CLASS[256];
 
-    first = token = NULL;
-    while ((c = getc(input)) != EOF) {
-        if (is_stdin && c == '\n')
-            break;
+// lexemes are copied here to be NUL terminated before interning
+static char *SCRATCH = NULL;
+static size_t SCRATCH_SIZE = 0;
 
-        if (isspace(c))
-            continue;
 
-        if (c == '/') {
-            if ((next_c = getc(input)) == '/') {
-                while ((c = getc(input)) != '\n' && c != EOF)
-                    ;
-                continue;
-            } else {
-                ungetc(next_c, input);
-            }
+Token *scan(const char *source, size_t size)
+{
+    bool ok;
+    struct scanner s;
+
+    s.source = s.curr = source;
+    s.end = source + size;
+    s.n = 0;
+    s.capacity = size / 4 + 16;
+    s.tokens = (Token *) malloc(s.capacity * sizeof(Token));
+
+    if (CHAR_CLASS[' '] == 0)
+        init_char_class();
+
+    ok = true;
+    while (s.curr < s.end) {
+        if (CHAR_CLASS[(uint8_t) *s.curr] & CHAR_SPACE) {
+            s.curr = skip_class(s.curr, s.end, CHAR_SPACE, &LINENO);
+            continue;
         }
 
-        if (token == NULL) {
-            first = token = get_token(c, input);
-        } else {
-            token->next = get_token(c, input);
-            token = token->next;
+        if (*s.curr == '/' && s.curr + 1 < s.end && s.curr[1] == '/') {
+            s.curr = find_char(s.curr, s.end, '\n', NULL);
+            continue;
         }
+
+        // keep going after an error, to report all of them
+        if (!scan_token(&s))
+            ok = false;
     }
 
-    for (token = first; token != NULL; token = token->next)
-        if (token->type == TOKEN_ERROR) {
-            free_tokens(first);
-            return NULL;
-        }
+    add_token(&s, TOKEN_EOF, s.curr, NULL);
 
-    return first;
+    if (!ok) {
+        free_tokens(s.tokens);
+        return NULL;
+    }
+
+    return s.tokens;
 }
 
 
 void free_tokens(Token *tokens)
 {
-    Token *token, *next;
+    free(tokens);
+}
+
+
+static void add_token(struct scanner *s, TokenType type, const char *start, char *lexeme)
+{
+    Token *token;
 
-    for (token = tokens; token != NULL; token = next) {
-        next = token->next;
-        free_token(token);
+    if (s->n >= s->capacity) {
+        s->capacity *= 2;
+        s->tokens = (Token *) realloc(s->tokens, s->capacity * sizeof(Token));
     }
+
+    token = &s->tokens[s->n++];
+    token->type = type;
+    token->lineno = LINENO;
+    token->offset = start - s->source;
+    token->length = s->curr - start;
+    token->lexeme = lexeme;
+}
+
+
+static bool match(struct scanner *s, char c)
+{
+    if (s->curr >= s->end || *s->curr != c)
+        return false;
+
+    s->curr++;
+    return true;
 }
 
 
-static Token *get_token(int c, FILE *ifp)
+static bool scan_token(struct scanner *s)
 {
-    int next_c;
+    char c;
+    const char *start;
+
+    start = s->curr;
+    c = *s->curr++;
 
     switch(c) {
         case '(':
-            return new_token(TOKEN_LEFT_PAREN, "(");
+            add_token(s, TOKEN_LEFT_PAREN, start, "(");
+            break;
         case ')':
-            return new_token(TOKEN_RIGHT_PAREN, ")");
+            add_token(s, TOKEN_RIGHT_PAREN, start, ")");
+            break;
         case '{':
-            return new_token(TOKEN_LEFT_BRACE, "{");
+            add_token(s, TOKEN_LEFT_BRACE, start, "{");
+            break;
         case '}':
-            return new_token(TOKEN_RIGHT_BRACE, "}");
+            add_token(s, TOKEN_RIGHT_BRACE, start, "}");
+            break;
         case ',':
-            return new_token(TOKEN_COMMA, ",");
+            add_token(s, TOKEN_COMMA, start, ",");
+            break;
         case '.':
-            return new_token(TOKEN_DOT, ".");
+            add_token(s, TOKEN_DOT, start, ".");
+            break;
         case ';':
-            return new_token(TOKEN_SEMICOLON, ";");
+            add_token(s, TOKEN_SEMICOLON, start, ";");
+            break;
         case '-':
-            return new_token(TOKEN_MINUS, "-");
+            add_token(s, TOKEN_MINUS, start, "-");
+            break;
         case '+':
-            return new_token(TOKEN_PLUS, "+");
+            add_token(s, TOKEN_PLUS, start, "+");
+            break;
         case '*':
-            return new_token(TOKEN_STAR, "*");
+            add_token(s, TOKEN_STAR, start, "*");
+            break;
         case '/':
-            return new_token(TOKEN_SLASH, "/");
+            add_token(s, TOKEN_SLASH, start, "/");
+            break;
         case '!':
-            if ((next_c = getc(ifp)) == '=')
-                return new_token(TOKEN_BANG_EQUAL, "!=");
-            else {
-                ungetc(next_c, ifp);
-                return new_token(TOKEN_BANG, "!");
-            }
+            if (match(s, '='))
+                add_token(s, TOKEN_BANG_EQUAL, start, "!=");
+            else
+                add_token(s, TOKEN_BANG, start, "!");
+            break;
         case '=':
-            if ((next_c = getc(ifp)) == '=')
-                return new_token(TOKEN_EQUAL_EQUAL, "==");
-            else {
-                ungetc(next_c, ifp);
-                return new_token(TOKEN_EQUAL, "=");
-            }
+            if (match(s, '='))
+                add_token(s, TOKEN_EQUAL_EQUAL, start, "==");
+            else
+                add_token(s, TOKEN_EQUAL, start, "=");
+            break;
         case '<':
-            if ((next_c = getc(ifp)) == '=')
-                return new_token(TOKEN_LESS_EQUAL, "<=");
-            else {
-                ungetc(next_c, ifp);
-                return new_token(TOKEN_LESS, "<");
-            }
+            if (match(s, '='))
+                add_token(s, TOKEN_LESS_EQUAL, start, "<=");
+            else
+                add_token(s, TOKEN_LESS, start, "<");
+            break;
         case '>':
-            if ((next_c = getc(ifp)) == '=')
-                return new_token(TOKEN_GREATER_EQUAL, ">=");
-            else {
-                ungetc(next_c, ifp);
-                return new_token(TOKEN_GREATER, ">");
-            }
+            if (match(s, '='))
+                add_token(s, TOKEN_GREATER_EQUAL, start, ">=");
+            else
+                add_token(s, TOKEN_GREATER, start, ">");
+            break;
         case '"':
-            return new_str_token(ifp);
+            return scan_string(s, start);
         default:
-            if (isdigit(c)) {
-                ungetc(c, ifp);
-                return new_num_token(ifp);
-            } else if (isalpha(c) || c == '_') {
-                ungetc(c, ifp);
-                return new_id_token(ifp);
+            if (CHAR_CLASS[(uint8_t) c] & CHAR_DIGIT) {
+                scan_number(s, start);
+            } else if (CHAR_CLASS[(uint8_t) c] & CHAR_ALPHA) {
+                scan_identifier(s, start);
+            } else {
+                log_error(LOX_SYNTAX_ERR, "unexpected character: '%c'.", c);
+                return false;
             }
-            log_error(LOX_SYNTAX_ERR, "unexpected character: '%c'.", c);
-            return new_token(TOKEN_ERROR, NULL);
-   }
+            break;
+    }
+
+    return true;
 }
 
 
-static Token *new_token(int type, char *lexeme)
+static bool scan_string(struct scanner *s, const char *start)
 {
-    Token *token = (Token *) malloc(sizeof(Token));
-    
-    token->next = NULL;
+    int lines;
 
-    token->type = type;
-    token->lexeme = lexeme;
-    token->lineno = 1;
+    lines = 0;
+    s->curr = find_char(s->curr, s->end, '"', &lines);
+
+    if (s->curr >= s->end) {
+        log_error(LOX_SYNTAX_ERR, "EOF while scanning string literal.");
+        return false;
+    }
+
+    s->curr++;
+    add_token(s, TOKEN_STRING, start, intern(start + 1, s->curr - start - 2));
+    LINENO += lines;
 
-    return token;
+    return true;
 }
 
 
-static void free_token(Token *token)
+static void scan_number(struct scanner *s, const char *start)
 {
-    switch (token->type) {
-        case TOKEN_NUMBER:
-        case TOKEN_STRING:
-        case TOKEN_IDENTIFIER:
-        case TOKEN_ERROR:
-            if (token->lexeme != NULL)
-                free(token->lexeme);
-            break;
-        default:
-            if ((binsearch(token->lexeme, KEYWORDS, NKEYS)) != NULL) 
-                free(token->lexeme);
-            break;
-    }
- 
-    free(token);
+    s->curr = skip_class(s->curr, s->end, CHAR_NUMBER, NULL);
+
+    add_token(s, TOKEN_NUMBER, start, intern(start, s->curr - start));
 }
 
 
-static bool is_char(char c)       { return (c != '"'); }
-static bool is_num(char c)        { return (c != '\n' && (isdigit(c) || c == '.')); }
-static bool is_id_or_kwrd(char c) { return (c != '\n' && ((isalnum(c)) || c == '_')); }
+static void scan_identifier(struct scanner *s, const char *start)
+{
+    const Keyword *kwrd;
 
+    s->curr = skip_class(s->curr, s->end, CHAR_IDENT, NULL);
 
-static Token *new_str_token(FILE *ifp)
-{
-    char c;
-    char *s;
+    if ((kwrd = find_keyword(start, s->curr - start)) != NULL)
+        add_token(s, kwrd->type, start, kwrd->name);
+    else
+        add_token(s, TOKEN_IDENTIFIER, start, intern(start, s->curr - start));
+}
 
-    s = read_while(ifp, is_char);
 
-    if ((c = getc(ifp)) != '"') {
-        log_error(LOX_SYNTAX_ERR, "EOF while scanning string literal.");
-        return new_token(TOKEN_ERROR, s);
+static char *intern(const char *start, size_t length)
+{
+    if (length + 1 > SCRATCH_SIZE) {
+        SCRATCH_SIZE = (length + 1 > 64) ? length + 1 : 64;
+        SCRATCH = (char *) realloc(SCRATCH, SCRATCH_SIZE);
     }
 
-    return new_token(TOKEN_STRING, s);
+    memcpy(SCRATCH, start, length);
+    SCRATCH[length] = '\0';
+
+    return Dict_Intern(SCRATCH);
 }
 
 
-static Token *new_num_token(FILE *ifp)
+static const Keyword *find_keyword(const char *start, size_t length)
 {
-    char *s;
+    const Keyword *kwrd;
 
-    s = read_while(ifp, is_num);
+    kwrd = &KEYWORDS[KEYWORD_HASH((uint8_t) start[0], (uint8_t) start[length - 1], length)];
 
-    return new_token(TOKEN_NUMBER, s);
+    if (kwrd->name != NULL && strncmp(kwrd->name, start, length) == 0 && kwrd->name[length] == '\0')
+        return kwrd;
+
+    return NULL;
 }
 
 
-static Token *new_id_token(FILE *ifp)
+static void init_char_class()
 {
-    char *s;
-    Keyword *kwrd;
+    int c;
 
-    s = read_while(ifp, is_id_or_kwrd);
+    for (c = 0; c < 256; c++) {
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            CHAR_CLASS[c] |= CHAR_SPACE;
+        if (c >= '0' && c <= '9')
+            CHAR_CLASS[c] |= CHAR_DIGIT;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+            CHAR_CLASS[c] |= CHAR_ALPHA;
+    }
+    CHAR_CLASS['.'] |= CHAR_DOT;
+}
+
+
+#ifdef __SSE2__
+
+#define BYTES(c) _mm_set1_epi8((char) (c))
+#define IN_RANGE(x, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8((x), BYTES((lo) - 1)), _mm_cmplt_epi8((x), BYTES((hi) + 1)))
+
+// Bit i is set when the i-th byte of the chunk is in the class. Bytes above
+// 0x7f compare as negative, so they fall outside every range.
+static unsigned match_class(__m128i chunk, uint8_t cls)
+{
+    __m128i m;
 
-    if ((kwrd = binsearch(s, KEYWORDS, NKEYS)) != NULL)
-        return new_token(kwrd->type, s);
-    
-    return new_token(TOKEN_IDENTIFIER, s);
+    switch (cls) {
+        case CHAR_SPACE:
+            m = _mm_or_si128(_mm_cmpeq_epi8(chunk, BYTES(' ')), IN_RANGE(chunk, '\t', '\r'));
+            break;
+        case CHAR_IDENT:
+            m = _mm_or_si128(IN_RANGE(_mm_or_si128(chunk, BYTES(0x20)), 'a', 'z'),
+                             _mm_or_si128(IN_RANGE(chunk, '0', '9'), _mm_cmpeq_epi8(chunk, BYTES('_'))));
+            break;
+        default:
+            m = _mm_or_si128(IN_RANGE(chunk, '0', '9'), _mm_cmpeq_epi8(chunk, BYTES('.')));
+            break;
+    }
+
+    return _mm_movemask_epi8(m);
 }
 
 
-static char *read_while(FILE *ifp, bool (*cond)(char c))
-{ 
-    int c;
-    char *s;
-    unsigned i, maxlen;
-    
-    maxlen = 8;
-    s = (char *) malloc(maxlen * sizeof(char));
-
-    i = 0;
-    while ((c = getc(ifp)) != EOF && (*cond)(c)) {
-        s[i++] = c;
-        if (i > maxlen - 1) {
-            maxlen *= 2;
-            s = (char *) realloc(s, maxlen);
-        }
+static unsigned match_char(__m128i chunk, char c)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, BYTES(c)));
+}
+
+#endif
+
+
+// Returns the first character from p that isn't in cls. If lines isn't
+// NULL it's incremented for every newline skipped.
+static const char *skip_class(const char *p, const char *end, uint8_t cls, int *lines)
+{
+#ifdef __SSE2__
+    __m128i chunk;
+    unsigned in, n;
+
+    for (; end - p >= 16; p += 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+        in = match_class(chunk, cls);
+        n = (in == 0xffff) ? 16 : (unsigned) __builtin_ctz(~in);
+        if (lines != NULL)
+            *lines += __builtin_popcount(match_char(chunk, '\n') & ((1u << n) - 1));
+        if (n < 16)
+            return p + n;
     }
-    s[i] = '\0';
+#endif
 
-    if (c != EOF)
-        ungetc(c, ifp);
+    for (; p < end && (CHAR_CLASS[(uint8_t) *p] & cls); p++)
+        if (lines != NULL && *p == '\n')
+            (*lines)++;
 
-    return s;
+    return p;
 }
 
 
-static Keyword *binsearch(char *kwrd, Keyword *tab, int n)
+// Returns the first occurrence of c from p, or end. If lines isn't NULL it's
+// incremented for every newline before it.
+static const char *find_char(const char *p, const char *end, char c, int *lines)
 {
-    int cond;
-    Keyword *low = &tab[0];
-    Keyword *high = &tab[n]; 
-    Keyword *mid;
-
-    while (low < high) {
-        mid = low + (high - low) / 2;
-        if ((cond = strcmp(kwrd, mid->name)) < 0)
-            high = mid; 
-        else if (cond > 0)
-            low = mid + 1;
-        else
-            return mid;
+#ifdef __SSE2__
+    __m128i chunk;
+    unsigned found, n;
+
+    for (; end - p >= 16; p += 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+        found = match_char(chunk, c);
+        n = (found == 0) ? 16 : (unsigned) __builtin_ctz(found);
+        if (lines != NULL)
+            *lines += __builtin_popcount(match_char(chunk, '\n') & ((1u << n) - 1));
+        if (n < 16)
+            return p + n;
     }
+#endif
 
-    return NULL;
+    for (; p < end && *p != c; p++)
+        if (lines != NULL && *p == '\n')
+            (*lines)++;
+
+    return p;
 }
@@ -1,7 +1,7 @@
 #ifndef clox_scanner_h 
 #define clox_scanner_h 
 
-#include <stdio.h>
+#include <stddef.h>
 
 typedef enum {
     TOKEN_LEFT_PAREN = 0,
@@ -43,6 +43,7 @@ typedef enum {
     TOKEN_VAR,
     TOKEN_WHILE,
     TOKEN_ERROR,
+    TOKEN_EOF,
 } TokenType;
 
 
@@ -52,15 +53,20 @@ typedef struct {
 } Keyword;
 
 
-typedef struct token {
-    struct token *next;
+// Tokens are scanned into one array ending with a TOKEN_EOF. The source isn't
+// copied: a token records where its lexeme is, and 'lexeme' points either to
+// a static string or to the interned copy (see Dict_Intern), shared by all
+// tokens spelled the same.
+typedef struct {
     TokenType type;
-    char *lexeme;
     int lineno;
+    unsigned offset;
+    unsigned length;
+    char *lexeme;
 } Token;
 
 
-Token *scan(FILE *input);
+Token *scan(const char *source, size_t size);
 void free_tokens(Token *tokens);
 
 #endif
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+
+#include "dict.h"
+#include "shape.h"
+#include "value.h"
+
+static Shape *new_shape(Shape *parent, Dict *slots);
+static void free_shape(Shape *shape);
+
+static Shape *ROOT = NULL;
+
+
+Shape *shape_root()
+{
+    if (ROOT == NULL)
+        ROOT = new_shape(NULL, Dict_New());
+
+    return ROOT;
+}
+
+
+void free_shapes()
+{
+    if (ROOT != NULL)
+        free_shape(ROOT);
+    ROOT = NULL;
+}
+
+
+int shape_lookup(Shape *shape, char *name)
+{
+    Value slot;
+
+    if (IS_UNDEF(slot = Dict_Get(shape->slots, name)))
+        return -1;
+
+    return (int) AS_NUMBER(slot);
+}
+
+
+Shape *shape_add(Shape *shape, char *name)
+{
+    Shape *next;
+    Dict *slots;
+
+    if ((next = DICT_GET(Shape, shape->transitions, name)) != NULL)
+        return next;
+
+    slots = Dict_Copy(shape->slots);
+    Dict_Set(slots, name, NUMBER_VAL(shape->nfields));
+
+    next = new_shape(shape, slots);
+    DICT_SET(shape->transitions, name, next);
+
+    return next;
+}
+
+
+static Shape *new_shape(Shape *parent, Dict *slots)
+{
+    Shape *shape = (Shape *) malloc(sizeof(Shape));
+
+    shape->parent = parent;
+    shape->nfields = (parent != NULL) ? parent->nfields + 1 : 0;
+    shape->slots = slots;
+    shape->transitions = Dict_New();
+
+    return shape;
+}
+
+
+static void free_shape(Shape *shape)
+{
+    size_t pos;
+    Value next;
+
+    pos = 0;
+    while (Dict_Next(shape->transitions, &pos, NULL, &next))
+        free_shape(AS_PTR(next));
+
+    Dict_Free(shape->transitions);
+    Dict_Free(shape->slots);
+    free(shape);
+}
@@ -0,0 +1,23 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "dict.h"
+
+// Instances don't carry their own field names: they point to a shape,
+// shared by all instances that got the same fields in the same order. Adding
+// a field moves an instance along the transition to the next shape, so the
+// shapes form a tree rooted at the empty shape.
+typedef struct shape {
+    struct shape *parent;
+    unsigned nfields;
+    Dict *slots;            // field name -> index into the instance's fields
+    Dict *transitions;      // field name -> next shape
+} Shape;
+
+Shape *shape_root();
+void free_shapes();
+
+int shape_lookup(Shape *shape, char *name);
+Shape *shape_add(Shape *shape, char *name);
+
+#endif
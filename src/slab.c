@@ -0,0 +1,411 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS and madvise()
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+// Define to malloc every object (useful to let sanitizers track them)
+// #define DEBUG_NO_SLAB
+
+#define SLAB_SLOTS (SLAB_SIZE / SLAB_ALIGN)
+#define SLAB_REGION (256 * SLAB_SIZE)   // mapped at once
+
+typedef struct slabinfo {
+    char *base;
+    uint64_t live[SLAB_SLOTS / 64];     // occupied slots
+    unsigned nlive;
+    bool pinned;                        // holds an object that can't move
+    bool evacuated;
+} SlabInfo;
+
+typedef struct {
+    void **items;
+    size_t n;
+    size_t capacity;
+} PageList;
+
+static void grow_pool(SlabPool *pool);
+static void *new_slab();
+static void release_slab(void *slab);
+static void page_list_push(PageList *list, void *page);
+static void plan_pool(SlabPool *pool, unsigned cls);
+static SlabInfo *find_slab(SlabPool *pool, void *p);
+static int compare_bases(const void *a, const void *b);
+static int compare_density(const void *a, const void *b);
+
+static SlabAllocator *ALLOCATORS = NULL;
+
+// Slabs are pages of larger mappings. Pages given back by compaction are
+// reused first, the kernel maps them in again once they are written to.
+static char *REGION = NULL;         // what's left of the newest mapping
+static char *REGION_END = NULL;
+static PageList REGIONS = { NULL, 0, 0 };
+static PageList RELEASED = { NULL, 0, 0 };
+
+
+unsigned slab_class(size_t size)
+{
+#ifdef DEBUG_NO_SLAB
+    return SLAB_LARGE;
+#else
+    if (size == 0 || size > SLAB_CLASSES * SLAB_ALIGN)
+        return SLAB_LARGE;
+    return (size - 1) / SLAB_ALIGN;
+#endif
+}
+
+
+void *slab_alloc(SlabAllocator *slabs, unsigned cls, size_t size)
+{
+    void *p;
+    SlabPool *pool;
+
+    if (!slabs->registered) {
+        slabs->registered = true;
+        slabs->next = ALLOCATORS;
+        ALLOCATORS = slabs;
+    }
+
+    if (cls == SLAB_LARGE) {
+        slabs->large++;
+        return malloc(size);
+    }
+
+    pool = &slabs->pools[cls];
+    pool->live++;
+
+    if ((p = pool->free) != NULL) {
+        pool->free = *(void **) p;
+        return p;
+    }
+
+    size = SLAB_CLASS_SIZE(cls);
+    if ((size_t) (pool->end - pool->next) < size)
+        grow_pool(pool);
+
+    p = pool->next;
+    pool->next += size;
+
+    return p;
+}
+
+
+void slab_free(SlabAllocator *slabs, unsigned cls, void *p)
+{
+    SlabPool *pool;
+
+    if (cls == SLAB_LARGE) {
+        slabs->large--;
+        free(p);
+        return;
+    }
+
+    pool = &slabs->pools[cls];
+    pool->live--;
+    *(void **) p = pool->free;
+    pool->free = p;
+}
+
+
+// Bytes taken by live objects (with the rest of their size class), and by
+// the slabs they are carved from.
+void slab_usage(SlabAllocator *slabs, size_t *used, size_t *reserved)
+{
+    unsigned i;
+
+    *used = *reserved = 0;
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        *used += slabs->pools[i].live * SLAB_CLASS_SIZE(i);
+        *reserved += slabs->pools[i].nslabs * SLAB_SIZE;
+    }
+}
+
+
+void slab_compact_start(SlabAllocator *slabs)
+{
+    unsigned i;
+    size_t k;
+    void *slab;
+    SlabPool *pool;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        pool = &slabs->pools[i];
+        if (pool->nslabs == 0)
+            continue;
+
+        pool->info = (SlabInfo *) calloc(pool->nslabs, sizeof(SlabInfo));
+        for (k = 0, slab = pool->slabs; slab != NULL; slab = *(void **) slab)
+            pool->info[k++].base = (char *) slab;
+        qsort(pool->info, pool->nslabs, sizeof(SlabInfo), compare_bases);
+    }
+}
+
+
+void slab_compact_note(SlabAllocator *slabs, unsigned cls, void *p, bool pinned)
+{
+    size_t slot;
+    SlabInfo *info;
+
+    if (cls == SLAB_LARGE)
+        return;
+
+    info = find_slab(&slabs->pools[cls], p);
+    slot = ((char *) p - info->base - SLAB_ALIGN) / SLAB_CLASS_SIZE(cls);
+    info->live[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    info->nlive++;
+    info->pinned |= pinned;
+}
+
+
+void slab_compact_plan(SlabAllocator *slabs)
+{
+    unsigned i;
+
+    for (i = 0; i < SLAB_CLASSES; i++)
+        if (slabs->pools[i].info != NULL)
+            plan_pool(&slabs->pools[i], i);
+}
+
+
+bool slab_is_evacuated(SlabAllocator *slabs, unsigned cls, void *p)
+{
+    if (cls == SLAB_LARGE || slabs->pools[cls].info == NULL)
+        return false;
+
+    return find_slab(&slabs->pools[cls], p)->evacuated;
+}
+
+
+// Returns the number of slabs given back.
+size_t slab_compact_finish(SlabAllocator *slabs)
+{
+    unsigned i;
+    size_t k, n, released;
+    void **link, *slab;
+    SlabPool *pool;
+
+    released = 0;
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        pool = &slabs->pools[i];
+        if (pool->info == NULL)
+            continue;
+
+        // moved objects were counted again by slab_alloc()
+        pool->live = 0;
+        for (k = 0; k < pool->nslabs; k++)
+            pool->live += pool->info[k].nlive;
+
+        for (link = &pool->slabs, n = 0; (slab = *link) != NULL; ) {
+            if (find_slab(pool, slab)->evacuated) {
+                *link = *(void **) slab;
+                release_slab(slab);
+                n++;
+            } else {
+                link = (void **) slab;
+            }
+        }
+        pool->nslabs -= n;
+        released += n;
+
+        free(pool->info);
+        pool->info = NULL;
+    }
+
+    return released;
+}
+
+
+void slab_print_stats()
+{
+    unsigned i;
+    SlabAllocator *slabs;
+    SlabPool *pool;
+
+    for (slabs = ALLOCATORS; slabs != NULL; slabs = slabs->next) {
+        for (i = 0; i < SLAB_CLASSES; i++) {
+            pool = &slabs->pools[i];
+            if (pool->nslabs == 0)
+                continue;
+            fprintf(stderr, "slab: %-8s %4u B: %8zu live, %6zu slabs\n",
+                    slabs->name, SLAB_CLASS_SIZE(i), pool->live, pool->nslabs);
+        }
+        if (slabs->large > 0)
+            fprintf(stderr, "slab: %-8s  large: %8zu live\n", slabs->name, slabs->large);
+    }
+}
+
+
+// Drops every slab at once, objects still allocated from them are gone too.
+void slab_free_all()
+{
+    unsigned i;
+    size_t k;
+    SlabAllocator *slabs;
+    SlabPool *pool;
+
+    for (slabs = ALLOCATORS; slabs != NULL; slabs = slabs->next) {
+        for (i = 0; i < SLAB_CLASSES; i++) {
+            pool = &slabs->pools[i];
+            pool->free = pool->slabs = NULL;
+            pool->next = pool->end = NULL;
+            pool->live = pool->nslabs = 0;
+        }
+        slabs->registered = false;
+    }
+    ALLOCATORS = NULL;
+
+    for (k = 0; k < REGIONS.n; k++)
+        munmap(REGIONS.items[k], SLAB_REGION);
+    free(REGIONS.items);
+    free(RELEASED.items);
+    REGIONS.items = RELEASED.items = NULL;
+    REGIONS.n = REGIONS.capacity = RELEASED.n = RELEASED.capacity = 0;
+    REGION = REGION_END = NULL;
+}
+
+
+static void grow_pool(SlabPool *pool)
+{
+    char *slab;
+
+    slab = (char *) new_slab();
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+
+    // the first bytes link the slab, objects start at the next alignment
+    pool->next = slab + SLAB_ALIGN;
+    pool->end = slab + SLAB_SIZE;
+}
+
+
+
+static void *new_slab()
+{
+    void *slab;
+
+    if (RELEASED.n > 0)
+        return RELEASED.items[--RELEASED.n];
+
+    if (REGION == REGION_END) {
+        REGION = (char *) mmap(NULL, SLAB_REGION, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (REGION == MAP_FAILED) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        REGION_END = REGION + SLAB_REGION;
+        page_list_push(&REGIONS, REGION);
+    }
+
+    slab = REGION;
+    REGION += SLAB_SIZE;
+
+    return slab;
+}
+
+
+// The page stays mapped, but the kernel takes its memory back.
+static void release_slab(void *slab)
+{
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+    page_list_push(&RELEASED, slab);
+}
+
+
+static void page_list_push(PageList *list, void *page)
+{
+    if (list->n >= list->capacity) {
+        list->capacity = (list->capacity < 64) ? 64 : list->capacity * 2;
+        list->items = (void **) realloc(list->items, list->capacity * sizeof(void *));
+    }
+    list->items[list->n++] = page;
+}
+
+
+// The densest slabs are kept, as many as it takes to hold all the live
+// objects of the pool, along with those that hold pinned objects. The
+// free list is rebuilt from the holes in the kept slabs, lowest addresses
+// first, and the bump pointer is dropped.
+static void plan_pool(SlabPool *pool, unsigned cls)
+{
+    size_t k, slot, nslots, total, room;
+    SlabInfo **order, *info;
+    char *p;
+
+    nslots = (SLAB_SIZE - SLAB_ALIGN) / SLAB_CLASS_SIZE(cls);
+
+    order = (SlabInfo **) malloc(pool->nslabs * sizeof(SlabInfo *));
+    total = 0;
+    for (k = 0; k < pool->nslabs; k++) {
+        order[k] = &pool->info[k];
+        total += pool->info[k].nlive;
+    }
+    qsort(order, pool->nslabs, sizeof(SlabInfo *), compare_density);
+
+    room = 0;
+    for (k = 0; k < pool->nslabs; k++) {
+        if (order[k]->pinned || room < total)
+            room += nslots;
+        else
+            order[k]->evacuated = true;
+    }
+    free(order);
+
+    pool->free = NULL;
+    pool->next = pool->end = NULL;
+    for (k = pool->nslabs; k-- > 0; ) {
+        info = &pool->info[k];
+        if (info->evacuated)
+            continue;
+        for (slot = nslots; slot-- > 0; ) {
+            if (info->live[slot / 64] & ((uint64_t) 1 << (slot % 64)))
+                continue;
+            p = info->base + SLAB_ALIGN + slot * SLAB_CLASS_SIZE(cls);
+            *(void **) p = pool->free;
+            pool->free = p;
+        }
+    }
+}
+
+
+// The slab holding p is the last one that starts at or below it.
+static SlabInfo *find_slab(SlabPool *pool, void *p)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = pool->nslabs;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (pool->info[mid].base <= (char *) p)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return &pool->info[lo];
+}
+
+
+static int compare_bases(const void *a, const void *b)
+{
+    const char *x = ((const SlabInfo *) a)->base, *y = ((const SlabInfo *) b)->base;
+
+    return (x > y) - (x < y);
+}
+
+
+// Pinned slabs first, then the fullest.
+static int compare_density(const void *a, const void *b)
+{
+    const SlabInfo *x = *(SlabInfo *const *) a, *y = *(SlabInfo *const *) b;
+
+    if (x->pinned != y->pinned)
+        return y->pinned - x->pinned;
+    return (y->nlive > x->nlive) - (y->nlive < x->nlive);
+}
@@ -0,0 +1,60 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SLAB_SIZE 4096
+#define SLAB_ALIGN 16
+#define SLAB_CLASSES 32                             // up to 512 bytes
+#define SLAB_LARGE SLAB_CLASSES
+#define SLAB_CLASS_SIZE(cls) (((cls) + 1) * SLAB_ALIGN)
+
+struct slabinfo;    // per-slab side table while compacting
+
+// Objects of one type are carved out of page-sized slabs, one pool per
+// size class. Freed objects go on the pool's free list and are handed out
+// again before the rest of the current slab. Slabs are only given back to
+// the system by slab_free_all(), or once compaction has emptied them.
+// Requests above the largest size class fall through to malloc.
+typedef struct {
+    void *free;             // free list, linked through the objects
+    char *next;             // bump pointer into the newest slab
+    char *end;
+    void *slabs;            // all slabs, linked through their first word
+    size_t live;
+    size_t nslabs;
+    struct slabinfo *info;  // sorted by address, only while compacting
+} SlabPool;
+
+typedef struct slaballocator {
+    const char *name;
+    struct slaballocator *next;     // allocators in use, for --alloc-stats
+    bool registered;
+    size_t large;                   // live objects that didn't fit a class
+    SlabPool pools[SLAB_CLASSES];
+} SlabAllocator;
+
+#define SLAB_ALLOCATOR(name) { (name), NULL, false, 0, { { NULL } } }
+
+unsigned slab_class(size_t size);
+void *slab_alloc(SlabAllocator *slabs, unsigned cls, size_t size);
+void slab_free(SlabAllocator *slabs, unsigned cls, void *p);
+
+void slab_usage(SlabAllocator *slabs, size_t *used, size_t *reserved);
+
+// Compaction, driven by the owner of the objects: every live object is
+// noted, then the sparsest slabs are picked for evacuation and the free
+// lists are rebuilt from the holes in the others. The owner moves the
+// objects out of evacuated slabs with slab_alloc(), which can't grow a pool
+// meanwhile, and finally the evacuated slabs are given back to the system.
+void slab_compact_start(SlabAllocator *slabs);
+void slab_compact_note(SlabAllocator *slabs, unsigned cls, void *p, bool pinned);
+void slab_compact_plan(SlabAllocator *slabs);
+bool slab_is_evacuated(SlabAllocator *slabs, unsigned cls, void *p);
+size_t slab_compact_finish(SlabAllocator *slabs);
+
+void slab_print_stats();
+void slab_free_all();
+
+#endif
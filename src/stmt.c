@@ -1,24 +1,24 @@
-#include <stdlib.h>
-
+#include "arena.h"
 #include "expr.h"
 #include "stmt.h"
 
 
-Stmt *new_block_stmt(size_t n, Stmt **stmts)
+Stmt *new_block_stmt(Arena *arena, size_t n, Stmt **stmts)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_BLOCK;
     stmt->block.n = n;
     stmt->block.stmts = stmts;
+    stmt->block.nslots = 0;
 
     return stmt;
 }
 
 
-Stmt *new_expr_stmt(Expr *expr)
+Stmt *new_expr_stmt(Arena *arena, Expr *expr)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_EXPR;
     stmt->expr = expr;
@@ -27,23 +27,26 @@ Stmt *new_expr_stmt(Expr *expr)
 }
 
 
-Stmt *new_fun_stmt(char *name, size_t n, Token **params, Stmt *body)
+Stmt *new_fun_stmt(Arena *arena, char *name, size_t n, Token **params, Stmt *body)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_FUN;
     stmt->fun.name = name;
     stmt->fun.n = n;
     stmt->fun.params = params;
     stmt->fun.body = body;
+    stmt->fun.nupvalues = 0;
+    stmt->fun.upvalues = NULL;
+    stmt->fun.this_escapes = true;
 
     return stmt;
 }
 
 
-Stmt *new_if_stmt(Expr *cond, Stmt *conseq, Stmt *alt)
+Stmt *new_if_stmt(Arena *arena, Expr *cond, Stmt *conseq, Stmt *alt)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_IF;
     stmt->ifelse.cond = cond;
@@ -54,9 +57,9 @@ Stmt *new_if_stmt(Expr *cond, Stmt *conseq, Stmt *alt)
 }
 
 
-Stmt *new_class_stmt(Token *name, Expr *superclass, size_t n, Stmt **methods)
+Stmt *new_class_stmt(Arena *arena, Token *name, Expr *superclass, size_t n, Stmt **methods)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_CLASS;
     stmt->klass.name = name;
@@ -68,9 +71,9 @@ Stmt *new_class_stmt(Token *name, Expr *superclass, size_t n, Stmt **methods)
 }
 
 
-Stmt *new_print_stmt(Expr *expr)
+Stmt *new_print_stmt(Arena *arena, Expr *expr)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_PRINT;
     stmt->expr = expr;
@@ -79,9 +82,9 @@ Stmt *new_print_stmt(Expr *expr)
 }
 
 
-Stmt *new_return_stmt(Expr *expr)
+Stmt *new_return_stmt(Arena *arena, Expr *expr)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_RETURN;
     stmt->expr = expr;
@@ -90,21 +93,22 @@ Stmt *new_return_stmt(Expr *expr)
 }
 
 
-Stmt *new_var_stmt(char *name, Expr *expr)
+Stmt *new_var_stmt(Arena *arena, char *name, Expr *expr)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_VAR;
     stmt->var.name = name;
     stmt->var.expr = expr;
+    stmt->var.assigned = false;
 
     return stmt;
 }
 
 
-Stmt *new_while_stmt(Expr *cond, Stmt *body)
+Stmt *new_while_stmt(Arena *arena, Expr *cond, Stmt *body)
 {
-    Stmt *stmt = (Stmt *) malloc(sizeof(Stmt));
+    Stmt *stmt = (Stmt *) arena_alloc(arena, sizeof(Stmt));
 
     stmt->type = STMT_WHILE;
     stmt->whileloop.cond = cond;
@@ -114,56 +118,45 @@ Stmt *new_while_stmt(Expr *cond, Stmt *body)
 }
 
 
-void free_stmt(Stmt *stmt)
+// Whether the block declares a name of its own, those of nested blocks aside.
+bool declares_local(const Stmt *block)
+{
+    unsigned i;
+
+    for (i = 0; i < block->block.n; i++)
+        switch (block->block.stmts[i]->type) {
+            case STMT_CLASS:
+            case STMT_FUN:
+            case STMT_VAR:
+                return true;
+            default:
+                break;
+        }
+
+    return false;
+}
+
+
+// Whether the statement declares a function or class anywhere within it.
+bool declares_fun(const Stmt *stmt)
 {
     unsigned i;
 
     switch (stmt->type) {
         case STMT_BLOCK:
             for (i = 0; i < stmt->block.n; i++)
-                free_stmt(stmt->block.stmts[i]); 
-            free(stmt->block.stmts);
-            break;
+                if (declares_fun(stmt->block.stmts[i]))
+                    return true;
+            return false;
         case STMT_CLASS:
-            if (stmt->klass.superclass != NULL)
-                free_expr(stmt->klass.superclass);
-            for (i = 0; i < stmt->klass.n; i++)
-                free_stmt(stmt->klass.methods[i]);
-            free(stmt->klass.methods);
-            break;
-        case STMT_EXPR:
-            free_expr(stmt->expr);
-            break;
         case STMT_FUN:
-            free(stmt->fun.name);
-            free_stmt(stmt->fun.body);
-            break;
+            return true;
         case STMT_IF:
-            free_expr(stmt->ifelse.cond);
-            free_stmt(stmt->ifelse.conseq);
-            if (stmt->ifelse.alt != NULL)
-                free_stmt(stmt->ifelse.alt);
-            break;
-        case STMT_PRINT:
-            free_expr(stmt->expr);
-            break;
-        case STMT_RETURN:
-            if (stmt->expr != NULL)
-                free_expr(stmt->expr);
-            break;
-        case STMT_VAR:
-            free(stmt->var.name);
-            if (stmt->var.expr != NULL)
-                free_expr(stmt->var.expr);
-            break;
+            return declares_fun(stmt->ifelse.conseq) \
+                || (stmt->ifelse.alt != NULL && declares_fun(stmt->ifelse.alt));
         case STMT_WHILE:
-            if (stmt->whileloop.cond != NULL)
-                free_expr(stmt->whileloop.cond);
-            free_stmt(stmt->whileloop.body);
-            break;
+            return declares_fun(stmt->whileloop.body);
         default:
-            break;
+            return false;
     }
-
-    free(stmt);
 }
@@ -1,10 +1,21 @@
 #ifndef clox_stmt_h
 #define clox_stmt_h
 
+#include <stdbool.h>
+
 #include "expr.h"
 
 struct loxenv;
 
+// Describes how a closure captures a variable when it is created: either a
+// local of the enclosing function (depth/index relative to the environment
+// the function is declared in) or one of the enclosing closure's upvalues.
+typedef struct {
+    bool is_local;
+    unsigned depth;
+    unsigned index;
+} Upvalue;
+
 enum StmtType {
     STMT_BLOCK = 0,
     STMT_CLASS,
@@ -22,25 +33,34 @@ typedef struct stmt {
     enum StmtType type;
     union {
         Expr *expr;
-        struct { size_t n; struct stmt **stmts; } block;
-        struct { char *name; size_t n; Token **params; struct stmt *body; } fun;
+        struct { size_t n; struct stmt **stmts; unsigned nslots; } block;
+        struct {
+            char *name;
+            size_t n;
+            Token **params;
+            struct stmt *body;
+            size_t nupvalues;
+            Upvalue *upvalues;
+            bool this_escapes;      // a method may keep its receiver
+        } fun;
         struct { Expr *cond; struct stmt *conseq; struct stmt *alt; } ifelse;
         struct { Token *name; Expr *superclass; size_t n; struct stmt **methods; } klass;
-        struct { char *name; Expr *expr; } var;
+        struct { char *name; Expr *expr; bool assigned; } var;
         struct { Expr *cond; struct stmt *body; } whileloop;
     };
 } Stmt;
 
-Stmt *new_block_stmt(size_t n, Stmt **stmts);
-Stmt *new_fun_stmt(char *name, size_t n, Token **params, Stmt *body);
-Stmt *new_expr_stmt(Expr *expr);
-Stmt *new_if_stmt(Expr *cond, Stmt *conseq, Stmt *alt);
-Stmt *new_class_stmt(Token *name, Expr *superclass, size_t n, Stmt **methods);
-Stmt *new_print_stmt(Expr *expr);
-Stmt *new_return_stmt(Expr *expr);
-Stmt *new_var_stmt(char *name, Expr *expr);
-Stmt *new_while_stmt(Expr *cond, Stmt *body);
-
-void free_stmt(Stmt *stmt);
+Stmt *new_block_stmt(Arena *arena, size_t n, Stmt **stmts);
+Stmt *new_fun_stmt(Arena *arena, char *name, size_t n, Token **params, Stmt *body);
+Stmt *new_expr_stmt(Arena *arena, Expr *expr);
+Stmt *new_if_stmt(Arena *arena, Expr *cond, Stmt *conseq, Stmt *alt);
+Stmt *new_class_stmt(Arena *arena, Token *name, Expr *superclass, size_t n, Stmt **methods);
+Stmt *new_print_stmt(Arena *arena, Expr *expr);
+Stmt *new_return_stmt(Arena *arena, Expr *expr);
+Stmt *new_var_stmt(Arena *arena, char *name, Expr *expr);
+Stmt *new_while_stmt(Arena *arena, Expr *cond, Stmt *body);
+
+bool declares_local(const Stmt *block);
+bool declares_fun(const Stmt *stmt);
 
 #endif
@@ -0,0 +1,55 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loxobj.h"
+#include "value.h"
+
+
+bool is_value_truthy(Value value)
+{
+    return !IS_NIL(value) && value != FALSE_VAL;
+}
+
+
+bool is_value_equal(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (IS_OBJ(a) && IS_OBJ(b))
+        return AS_OBJ(a)->type == LOX_OBJ_STRING && AS_OBJ(b)->type == LOX_OBJ_STRING
+               && strcmp(AS_OBJ(a)->sval, AS_OBJ(b)->sval) == 0;
+
+    return a == b;
+}
+
+
+char *str_value(Value value)
+{
+    char *s;
+    size_t n;
+
+    if (IS_OBJ(value))
+        return str_obj(AS_OBJ(value));
+    if (IS_NIL(value))
+        return strdup("nil");
+    if (IS_BOOL(value))
+        return strdup(AS_BOOL(value) ? "true" : "false");
+
+    n = snprintf(NULL, 0, "%f", AS_NUMBER(value));
+    s = (char *) malloc((n + 1) * sizeof(char));
+    sprintf(s, "%f", AS_NUMBER(value));
+
+    return s;
+}
+
+
+void print_value(Value value)
+{
+    char *s;
+
+    s = str_value(value);
+    printf("%s\n", s);
+    free(s);
+}
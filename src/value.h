@@ -0,0 +1,71 @@
+#ifndef clox_value_h
+#define clox_value_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+struct loxobj;
+
+// Values are NaN-boxed into 64 bits: any double that isn't a quiet NaN is
+// a number, nil and the booleans are tagged quiet NaNs, and heap objects
+// are quiet NaNs with the sign bit set and the pointer in the low 48 bits.
+// UNDEF_VAL never reaches Lox code: it marks a missing dict entry, an
+// unassigned slot or a failed evaluation.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEF 4
+
+#define NIL_VAL ((Value) (QNAN | TAG_NIL))
+#define FALSE_VAL ((Value) (QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value) (QNAN | TAG_TRUE))
+#define UNDEF_VAL ((Value) (QNAN | TAG_UNDEF))
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(num) num_to_value(num)
+#define OBJ_VAL(obj) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (obj)))
+
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_UNDEF(value) ((value) == UNDEF_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_num(value)
+#define AS_OBJ(value) ((struct loxobj *) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+// Dicts that hold plain pointers (resolver scopes, method tables) go
+// through these, a missing key reads as NULL.
+#define AS_PTR(value) (IS_OBJ(value) ? (void *) AS_OBJ(value) : NULL)
+
+
+static inline Value num_to_value(double num)
+{
+    Value value;
+
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+
+static inline double value_to_num(Value value)
+{
+    double num;
+
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+bool is_value_truthy(Value value);
+bool is_value_equal(Value a, Value b);
+
+char *str_value(Value value);
+void print_value(Value value);
+
+#endif
@@ -0,0 +1,589 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "dict.h"
+#include "gc.h"
+#include "globals.h"
+#include "logger.h"
+#include "loxobj.h"
+#include "stmt.h"
+#include "value.h"
+#include "vm.h"
+
+#define FRAMES_MAX 1024
+#define STACK_MAX (FRAMES_MAX * 256)
+
+typedef struct {
+    LoxObj *closure;
+    uint8_t *ip;
+    Value *slots;
+} CallFrame;
+
+
+static void init_vm();
+static void reset_stack();
+static void mark_roots();
+static void move_roots();
+
+static int run();
+static bool call_value(Value callee, unsigned argc);
+static bool call_closure(LoxObj *closure, unsigned argc);
+static bool invoke(char *name, unsigned argc);
+static bool invoke_from_class(LoxObj *klass, char *name, unsigned argc);
+static bool bind_method(LoxObj *klass, char *name);
+static LoxObj *capture_upvalue(Value *local);
+static void close_upvalues(Value *last);
+static LoxObj *find_method(LoxObj *klass, char *name);
+static bool is_obj_type(Value value, enum LoxObjType type);
+static char *joinstr(const char *s1, const char *s2);
+
+// The stack never moves: open upvalues point straight into it.
+static Value STACK[STACK_MAX];
+static Value *TOP = STACK;
+static CallFrame FRAMES[FRAMES_MAX];
+static unsigned NFRAMES = 0;
+
+static bool STARTED = false;
+static LoxObj *OPEN_UPVALUES = NULL;
+
+#define PUSH(obj) (*TOP++ = (obj))
+#define POP() (*--TOP)
+#define PEEK(distance) (*(TOP - 1 - (distance)))
+
+
+int vm_interpret(Stmt **stmts)
+{
+    LoxObj *proto, *closure;
+
+    if (!STARTED)
+        init_vm();
+
+    if ((proto = compile(stmts)) == NULL)
+        return -1;
+
+    GC_PUSH(proto);
+    closure = new_closure_obj(proto);
+    GC_POP(1);
+
+    PUSH(OBJ_VAL(closure));
+    call_closure(closure, 0);
+
+    return run();
+}
+
+
+static void init_vm()
+{
+    STARTED = true;
+    gc_register_roots(mark_roots, move_roots);
+    define_natives();
+}
+
+
+static void reset_stack()
+{
+    TOP = STACK;
+    NFRAMES = 0;
+    OPEN_UPVALUES = NULL;
+}
+
+
+static void mark_roots()
+{
+    Value *slot;
+    LoxObj *upvalue;
+
+    for (slot = STACK; slot < TOP; slot++)
+        gc_mark_value(*slot);
+
+    for (upvalue = OPEN_UPVALUES; upvalue != NULL; upvalue = upvalue->upvalue.next)
+        gc_mark((GCObj *) upvalue);
+}
+
+
+static void move_roots()
+{
+    unsigned i;
+    Value *slot;
+
+    for (slot = STACK; slot < TOP; slot++)
+        *slot = gc_moved_value(*slot);
+
+    for (i = 0; i < NFRAMES; i++)
+        FRAMES[i].closure = (LoxObj *) gc_moved((GCObj *) FRAMES[i].closure);
+
+    OPEN_UPVALUES = (LoxObj *) gc_moved((GCObj *) OPEN_UPVALUES);
+}
+
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->closure->fun.proto->proto.chunk->constants[READ_SHORT()])
+#define READ_STRING() (AS_OBJ(READ_CONSTANT())->sval)
+
+#define NUMERIC_OPERANDS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+
+#define BINARY_OP(make, op) \
+    do { \
+        if (!NUMERIC_OPERANDS()) { \
+            log_error(LOX_RUNTIME_ERR, "operands must be numbers"); \
+            goto error; \
+        } \
+        value = make(AS_NUMBER(PEEK(1)) op AS_NUMBER(PEEK(0))); \
+        TOP -= 2; \
+        PUSH(value); \
+    } while (0)
+
+// Calls store the instruction pointer back into the frame and reload it
+// once the callee frame is set up.
+#define SYNC_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() (frame = &FRAMES[NFRAMES - 1], ip = frame->ip)
+
+
+static int run()
+{
+    unsigned argc, slot, index, i;
+    char *name;
+    uint8_t *ip;
+    CallFrame *frame;
+    LoxObj *obj;
+    Value value, superclass;
+
+    LOAD_FRAME();
+
+    for (;;) {
+        switch (READ_BYTE()) {
+            case OP_CONSTANT:
+                PUSH(READ_CONSTANT());
+                break;
+            case OP_NIL:
+                PUSH(NIL_VAL);
+                break;
+            case OP_TRUE:
+                PUSH(TRUE_VAL);
+                break;
+            case OP_FALSE:
+                PUSH(FALSE_VAL);
+                break;
+            case OP_POP:
+                TOP--;
+                break;
+            case OP_POPN:
+                TOP -= READ_BYTE();
+                break;
+            case OP_GET_LOCAL:
+                PUSH(frame->slots[READ_BYTE()]);
+                break;
+            case OP_SET_LOCAL:
+                frame->slots[READ_BYTE()] = PEEK(0);
+                break;
+            case OP_GET_GLOBAL:
+                slot = READ_SHORT();
+                if (IS_UNDEF(value = global_get(slot))) {
+                    log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", global_name(slot));
+                    goto error;
+                }
+                PUSH(value);
+                break;
+            case OP_DEFINE_GLOBAL:
+                global_set(READ_SHORT(), PEEK(0));
+                TOP--;
+                break;
+            case OP_SET_GLOBAL:
+                slot = READ_SHORT();
+                if (IS_UNDEF(global_get(slot))) {
+                    log_error(LOX_RUNTIME_ERR, "undefined variable '%s'", global_name(slot));
+                    goto error;
+                }
+                global_set(slot, PEEK(0));
+                break;
+            case OP_GET_UPVALUE:
+                PUSH(*frame->closure->fun.upvalues[READ_BYTE()]->upvalue.location);
+                break;
+            case OP_SET_UPVALUE:
+                obj = frame->closure->fun.upvalues[READ_BYTE()];
+                *obj->upvalue.location = PEEK(0);
+                GC_BARRIER(obj);
+                break;
+            case OP_GET_PROPERTY:
+                name = READ_STRING();
+                if (!is_obj_type(PEEK(0), LOX_OBJ_INSTANCE)) {
+                    log_error(LOX_RUNTIME_ERR, "only instances have properties");
+                    goto error;
+                }
+                obj = AS_OBJ(PEEK(0));
+                if (!IS_UNDEF(value = instance_get(obj, name))) {
+                    PEEK(0) = value;
+                    break;
+                }
+                if (!bind_method(obj->instance.klass, name))
+                    goto error;
+                break;
+            case OP_SET_PROPERTY:
+                if (!is_obj_type(PEEK(1), LOX_OBJ_INSTANCE)) {
+                    log_error(LOX_RUNTIME_ERR, "only instances have fields");
+                    goto error;
+                }
+                instance_set(AS_OBJ(PEEK(1)), READ_STRING(), PEEK(0));
+                value = POP();
+                PEEK(0) = value;
+                break;
+            case OP_GET_SUPER:
+                superclass = POP();
+                if (!bind_method(AS_OBJ(superclass), READ_STRING()))
+                    goto error;
+                break;
+            case OP_EQUAL:
+                value = BOOL_VAL(is_value_equal(PEEK(1), PEEK(0)));
+                TOP -= 2;
+                PUSH(value);
+                break;
+            case OP_NOT_EQUAL:
+                value = BOOL_VAL(!is_value_equal(PEEK(1), PEEK(0)));
+                TOP -= 2;
+                PUSH(value);
+                break;
+            case OP_GREATER:
+                BINARY_OP(BOOL_VAL, >);
+                break;
+            case OP_GREATER_EQUAL:
+                BINARY_OP(BOOL_VAL, >=);
+                break;
+            case OP_LESS:
+                BINARY_OP(BOOL_VAL, <);
+                break;
+            case OP_LESS_EQUAL:
+                BINARY_OP(BOOL_VAL, <=);
+                break;
+            case OP_ADD:
+                if (NUMERIC_OPERANDS()) {
+                    value = NUMBER_VAL(AS_NUMBER(PEEK(1)) + AS_NUMBER(PEEK(0)));
+                } else if (is_obj_type(PEEK(0), LOX_OBJ_STRING)
+                           && is_obj_type(PEEK(1), LOX_OBJ_STRING)) {
+                    obj = new_str_obj(joinstr(AS_OBJ(PEEK(1))->sval, AS_OBJ(PEEK(0))->sval));
+                    value = OBJ_VAL(obj);
+                } else {
+                    log_error(LOX_RUNTIME_ERR, "operands must be two numbers or two strings");
+                    goto error;
+                }
+                TOP -= 2;
+                PUSH(value);
+                break;
+            case OP_SUBTRACT:
+                BINARY_OP(NUMBER_VAL, -);
+                break;
+            case OP_MULTIPLY:
+                BINARY_OP(NUMBER_VAL, *);
+                break;
+            case OP_DIVIDE:
+                BINARY_OP(NUMBER_VAL, /);
+                break;
+            case OP_NOT:
+                PEEK(0) = BOOL_VAL(!is_value_truthy(PEEK(0)));
+                break;
+            case OP_NEGATE:
+                if (!IS_NUMBER(PEEK(0))) {
+                    log_error(LOX_RUNTIME_ERR, "operand must be a number");
+                    goto error;
+                }
+                PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) * -1);
+                break;
+            case OP_PRINT:
+                print_value(POP());
+                break;
+            case OP_JUMP:
+                index = READ_SHORT();
+                ip += index;
+                break;
+            case OP_JUMP_IF_FALSE:
+                index = READ_SHORT();
+                if (!is_value_truthy(PEEK(0)))
+                    ip += index;
+                break;
+            case OP_LOOP:
+                index = READ_SHORT();
+                ip -= index;
+                // frames and the stack are all that's live across a loop
+                gc_safepoint();
+                break;
+            case OP_CALL:
+                argc = READ_BYTE();
+                SYNC_FRAME();
+                if (!call_value(PEEK(argc), argc))
+                    goto error;
+                LOAD_FRAME();
+                break;
+            case OP_INVOKE:
+                name = READ_STRING();
+                argc = READ_BYTE();
+                SYNC_FRAME();
+                if (!invoke(name, argc))
+                    goto error;
+                LOAD_FRAME();
+                break;
+            case OP_SUPER_INVOKE:
+                name = READ_STRING();
+                argc = READ_BYTE();
+                superclass = POP();
+                SYNC_FRAME();
+                if (!invoke_from_class(AS_OBJ(superclass), name, argc))
+                    goto error;
+                LOAD_FRAME();
+                break;
+            case OP_CLOSURE:
+                obj = new_closure_obj(AS_OBJ(READ_CONSTANT()));
+                PUSH(OBJ_VAL(obj));
+                for (i = 0; i < obj->fun.nupvalues; i++) {
+                    slot = READ_BYTE();
+                    index = READ_BYTE();
+                    if (slot)
+                        obj->fun.upvalues[i] = capture_upvalue(frame->slots + index);
+                    else
+                        obj->fun.upvalues[i] = frame->closure->fun.upvalues[index];
+                    GC_BARRIER(obj);
+                }
+                break;
+            case OP_CLOSE_UPVALUE:
+                close_upvalues(TOP - 1);
+                TOP--;
+                break;
+            case OP_RETURN:
+                value = POP();
+                close_upvalues(frame->slots);
+                NFRAMES--;
+                if (NFRAMES == 0) {
+                    TOP--;
+                    return 0;
+                }
+                TOP = frame->slots;
+                PUSH(value);
+                LOAD_FRAME();
+                break;
+            case OP_CLASS:
+                obj = new_class_obj(READ_STRING(), NULL, Dict_New());
+                PUSH(OBJ_VAL(obj));
+                break;
+            case OP_INHERIT:
+                if (!is_obj_type(PEEK(1), LOX_OBJ_CLASS)) {
+                    log_error(LOX_RUNTIME_ERR, "superclass must be a class");
+                    goto error;
+                }
+                AS_OBJ(PEEK(0))->klass.superclass = AS_OBJ(PEEK(1));
+                class_inherit(AS_OBJ(PEEK(0)));
+                break;
+            case OP_METHOD:
+                class_add_method(AS_OBJ(PEEK(1)), READ_STRING(), AS_OBJ(PEEK(0)));
+                TOP--;
+                break;
+        }
+    }
+
+error:
+    reset_stack();
+    return -1;
+}
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef NUMERIC_OPERANDS
+#undef BINARY_OP
+#undef SYNC_FRAME
+#undef LOAD_FRAME
+
+
+// The callee sits below its arguments and is replaced by the receiver
+// (or the new instance) when calling methods and classes.
+static bool call_value(Value value, unsigned argc)
+{
+    LoxObj *callee, *init;
+
+    if (!IS_OBJ(value)) {
+        log_error(LOX_RUNTIME_ERR, "can only call functions or classes");
+        return false;
+    }
+
+    callee = AS_OBJ(value);
+
+    switch (callee->type) {
+        case LOX_OBJ_CALLABLE:
+            if (argc != callee->callable.arity) {
+                log_error(LOX_RUNTIME_ERR, "expected %u arguments, got %u",
+                          callee->callable.arity, argc);
+                return false;
+            }
+            if (IS_UNDEF(value = callee->callable.func(callee, argc, TOP - argc)))
+                return false;
+            TOP -= argc + 1;
+            PUSH(value);
+            return true;
+        case LOX_OBJ_CLASS:
+            *(TOP - 1 - argc) = OBJ_VAL(new_instance_obj(callee));
+            if ((init = callee->klass.init) != NULL)
+                return call_closure(init, argc);
+            if (argc != 0) {
+                log_error(LOX_RUNTIME_ERR, "expected 0 arguments, got %u", argc);
+                return false;
+            }
+            return true;
+        case LOX_OBJ_FUN:
+            return call_closure(callee, argc);
+        case LOX_OBJ_METHOD:
+            *(TOP - 1 - argc) = OBJ_VAL(callee->method.receiver);
+            return call_closure(callee->method.fun, argc);
+        default:
+            log_error(LOX_RUNTIME_ERR, "can only call functions or classes");
+            return false;
+    }
+}
+
+
+static bool call_closure(LoxObj *closure, unsigned argc)
+{
+    CallFrame *frame;
+
+    if (argc != closure->fun.arity) {
+        log_error(LOX_RUNTIME_ERR, "expected %u arguments, got %u", closure->fun.arity, argc);
+        return false;
+    }
+
+    if (NFRAMES == FRAMES_MAX) {
+        log_error(LOX_RUNTIME_ERR, "stack overflow");
+        return false;
+    }
+
+    frame = &FRAMES[NFRAMES++];
+    frame->closure = closure;
+    frame->ip = closure->fun.proto->proto.chunk->code;
+    frame->slots = TOP - argc - 1;
+
+    return true;
+}
+
+
+static bool invoke(char *name, unsigned argc)
+{
+    LoxObj *receiver;
+    Value field;
+
+    if (!is_obj_type(PEEK(argc), LOX_OBJ_INSTANCE)) {
+        log_error(LOX_RUNTIME_ERR, "only instances have properties");
+        return false;
+    }
+
+    receiver = AS_OBJ(PEEK(argc));
+
+    if (!IS_UNDEF(field = instance_get(receiver, name))) {
+        *(TOP - 1 - argc) = field;
+        return call_value(field, argc);
+    }
+
+    return invoke_from_class(receiver->instance.klass, name, argc);
+}
+
+
+static bool invoke_from_class(LoxObj *klass, char *name, unsigned argc)
+{
+    LoxObj *method;
+
+    if ((method = find_method(klass, name)) == NULL) {
+        log_error(LOX_RUNTIME_ERR, "undefined property '%s'", name);
+        return false;
+    }
+
+    return call_closure(method, argc);
+}
+
+
+// Replaces the instance on top of the stack with its bound method.
+static bool bind_method(LoxObj *klass, char *name)
+{
+    LoxObj *method;
+
+    if ((method = find_method(klass, name)) == NULL) {
+        log_error(LOX_RUNTIME_ERR, "undefined property '%s'", name);
+        return false;
+    }
+
+    method = new_method_obj(AS_OBJ(PEEK(0)), method);
+    PEEK(0) = OBJ_VAL(method);
+
+    return true;
+}
+
+
+// Open upvalues are kept sorted by stack address, topmost first, so
+// closing a frame only has to look at the head of the list.
+static LoxObj *capture_upvalue(Value *local)
+{
+    LoxObj *prev, *upvalue, *created;
+
+    prev = NULL;
+    upvalue = OPEN_UPVALUES;
+    while (upvalue != NULL && upvalue->upvalue.location > local) {
+        prev = upvalue;
+        upvalue = upvalue->upvalue.next;
+    }
+
+    if (upvalue != NULL && upvalue->upvalue.location == local)
+        return upvalue;
+
+    created = new_upvalue_obj(local);
+    created->upvalue.next = upvalue;
+
+    if (prev == NULL)
+        OPEN_UPVALUES = created;
+    else
+        prev->upvalue.next = created;
+
+    return created;
+}
+
+
+static void close_upvalues(Value *last)
+{
+    LoxObj *upvalue;
+
+    while (OPEN_UPVALUES != NULL && OPEN_UPVALUES->upvalue.location >= last) {
+        upvalue = OPEN_UPVALUES;
+        upvalue->upvalue.closed = *upvalue->upvalue.location;
+        upvalue->upvalue.location = &upvalue->upvalue.closed;
+        OPEN_UPVALUES = upvalue->upvalue.next;
+        upvalue->upvalue.next = NULL;
+        GC_BARRIER(upvalue);
+    }
+}
+
+
+// Subclasses hold the methods they inherit, see class_inherit().
+static LoxObj *find_method(LoxObj *klass, char *name)
+{
+    return DICT_GET(LoxObj, klass->klass.methods, name);
+}
+
+
+static bool is_obj_type(Value value, enum LoxObjType type)
+{
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+
+static char *joinstr(const char *s1, const char *s2)
+{
+    int len1, len2;
+    char *s;
+
+    len1 = strlen(s1);
+    len2 = strlen(s2);
+
+    s = (char *) malloc((len1 + len2 + 1) * sizeof(char));
+    memcpy(s, s1, len1);
+    memcpy(s + len1, s2, len2 + 1);
+
+    return s;
+}
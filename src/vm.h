@@ -0,0 +1,8 @@
+#ifndef clox_vm_h
+#define clox_vm_h
+
+#include "stmt.h"
+
+int vm_interpret(Stmt **stmts);
+
+#endif